@@ -3,6 +3,9 @@
 
 #include "server.h"
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,14 +21,39 @@
 #endif
 
 #define PATH_LEN 1024
-#define NUM_BUILT_INS 6
+#define PROC_FD_PATH_LEN 32
 #define MAX_MEOWS 5
 #define MEANING_OF_LIFE 42
+#define BUILTIN_SLOTS 32    // Power of two, at least twice the number of builtins
 
-void process_cd(client_info *client);
-void process_pwd(client_info *client);
-void process_echo(client_info *client);
-void process_type(client_info *client);
-void process_meow(client_info *client);
+#define BUILTIN_STOPS_SERVER 0x01u    // The command shuts the server down instead of running a handler
+#define BUILTIN_FAST_PATH 0x02u       // In-process version of an external command, skipped when fast paths are off
+
+// What a handler did with the command
+enum builtin_result
+{
+    BUILTIN_DONE,        // The output is ready to send
+    BUILTIN_EXTERNAL     // Nothing was sent, run the external command instead
+};
+
+typedef int (*builtin_handler)(client_info *client, server_data *server_state);
+
+// One entry of the builtin registry, the only place a builtin is declared
+typedef struct builtin_command
+{
+    const char     *name;
+    builtin_handler handler;
+    unsigned int    flags;
+} builtin_command;
+
+int                    builtin_registry_init(void);
+const builtin_command *builtin_lookup(const server_data *server_state, const char *name);
+
+int process_cd(client_info *client, server_data *server_state);
+int process_pwd(client_info *client, server_data *server_state);
+int process_echo(client_info *client, server_data *server_state);
+int process_type(client_info *client, server_data *server_state);
+int process_meow(client_info *client, server_data *server_state);
+int process_stats(client_info *client, server_data *server_state);
 
 #endif    // BUILTIN_H
@@ -1,20 +1,64 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "protocol.h"
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define MAX_INPUT 1024
-#define CMD_NOT_FOUND 127
+#define MAX_IN_FLIGHT 64
+#define BATCH_IN_FLIGHT 512                                               // Batch mode keeps more commands queued at the server
+#define INPUT_CHUNK 65536                                                 // Bytes of commands read at once
+#define SEND_BUFFER_SIZE 65536                                            // Encoded COMMAND frames waiting for the socket
+#define RECV_BUFFER_SIZE (2 * (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD))    // Always holds at least one whole frame
+#define OUTPUT_IOV_MAX 1024                                               // Payloads written by one writev, the Linux and macOS limit
+
+typedef struct
+{
+    int      sockfd;
+    int      input_fd;
+    bool     input_open;
+    bool     batch;              // No prompt, the exit status reports failed commands
+    bool     stop_on_failure;    // Send nothing more once a command fails
+    bool     prompted;           // The prompt is showing and nothing has happened since
+    int      window;             // Most commands sent but not yet answered
+    uint32_t next_request_id;
+    int      in_flight;          // Commands sent but not yet answered with a STATUS frame
+    int      first_failure;      // Exit status of the first command that failed, 0 if none has
+    size_t   line_len;
+    char     line[MAX_INPUT];    // The line being assembled from the input
+    char    *input;              // Input read but not yet split into lines
+    size_t   input_pos;
+    size_t   input_len;
+    uint8_t *send_buffer;
+    size_t   send_pos;
+    size_t   send_len;
+    uint8_t *recv_buffer;
+    size_t   recv_len;
+} client_state;
 
 static volatile sig_atomic_t exit_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port);
+static int  handshake(int sockfd);
+static int  run_session(client_state *state);
+static int  read_input(client_state *state);
+static int  send_lines(client_state *state);
+static void queue_line(client_state *state);
+static int  flush_requests(client_state *state);
+static int  receive_frames(client_state *state);
+static int  process_frames(client_state *state);
+static int  write_output(struct iovec *iov, int iovcnt);
+static void record_status(client_state *state, int32_t status);
 static void setup_signal_handler(void);
 static void sigint_handler(int signum);
 
@@ -0,0 +1,70 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+    #include <sys/epoll.h>
+#else
+    #include <poll.h>
+#endif
+
+#define EVENT_BATCH 64
+
+#define EVENT_IN 0x1u
+#define EVENT_OUT 0x2u
+#define EVENT_HUP 0x4u
+
+enum event_kind
+{
+    EVENT_LISTENER,
+    EVENT_CLIENT,
+    EVENT_JOB_OUTPUT,
+    EVENT_JOB_EXIT,
+    EVENT_PATH_CACHE,
+    EVENT_WAKE
+};
+
+// A single readiness notification returned by event_wait
+typedef struct
+{
+    uint32_t kind;
+    uint32_t token;
+    uint32_t events;
+} event_record;
+
+// Edge-triggered event backend with its own FIFO of ready tokens
+typedef struct
+{
+    int       fd;
+    int       wake_fds[2];    // Written by other threads to interrupt event_wait
+    uint32_t *ready;
+    uint8_t  *queued;
+    uint32_t  capacity;
+    uint32_t  head;
+    uint32_t  count;
+#if !defined(__linux__)
+    struct pollfd *pollfds;
+    event_record  *records;
+    nfds_t         nfds;
+    nfds_t         max_fds;
+#endif
+} event_loop;
+
+int  event_loop_create(event_loop *loop, uint32_t capacity);
+void event_loop_destroy(event_loop *loop);
+int  event_add(event_loop *loop, int fd, uint32_t kind, uint32_t token);
+int  event_del(event_loop *loop, int fd);
+int  event_watch_output(event_loop *loop, int fd, uint32_t kind, uint32_t token, bool enable);
+int  event_wait(event_loop *loop, event_record *records, int max_records, int timeout_ms);
+void event_ready_push(event_loop *loop, uint32_t token);
+bool event_ready_pop(event_loop *loop, uint32_t *token);
+void event_wake(event_loop *loop);
+void event_wake_drain(event_loop *loop);
+
+#endif    // EVENT_H
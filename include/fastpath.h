@@ -0,0 +1,38 @@
+#ifndef FASTPATH_H
+#define FASTPATH_H
+
+#include "builtin.h"
+#include <grp.h>
+#include <inttypes.h>
+#include <locale.h>
+#include <pwd.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#if defined(__linux__)
+    #include <linux/magic.h>
+    #include <sys/syscall.h>
+    #include <sys/sysmacros.h>
+    #include <sys/vfs.h>
+#endif
+
+#define FAST_PATH_MAX_INPUT (4 * 1024 * 1024)    // Larger inputs are streamed by the external command instead
+#define FAST_PATH_MAX_OPERANDS 16
+#define FAST_PATH_MAX_ENTRIES 4096
+#define FAST_PATH_DIRENT_BUFFER 32768
+#define FAST_PATH_MAX_ARGS ((MAX_ARGS_LENGTH / 2) + 1)
+#define FAST_PATH_NSS_BUFFER 1024
+#define FAST_PATH_TIME_LEN 64
+#define HEAD_DEFAULT_LINES 10
+
+int fast_path_init(void);
+int process_ls(client_info *client, server_data *server_state);
+int process_cat(client_info *client, server_data *server_state);
+int process_head(client_info *client, server_data *server_state);
+int process_wc(client_info *client, server_data *server_state);
+int process_stat(client_info *client, server_data *server_state);
+
+#endif    // FASTPATH_H
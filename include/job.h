@@ -0,0 +1,62 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include "launch.h"
+#include "timer.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__linux__)
+    #include <sys/syscall.h>
+#endif
+
+struct result_capture;
+
+// A child process started on behalf of a session
+typedef struct
+{
+    pid_t                  pid;                                // The command, or a pipeline's last stage, leading the job's process group
+    pid_t                  stages[MAX_PIPELINE_STAGES - 1];    // Earlier stages of a pipeline that haven't been reaped
+    int                    stage_count;
+    int                    pidfd;         // Readable once the child exits, -1 if unsupported
+    int                    output_fd;     // Read end of the child's stdout/stderr pipe, -1 at EOF
+    int                    client;        // Owning session, -1 once the session has gone away
+    uint32_t               request_id;    // The request whose output this job produces
+    int                    status;        // Wait status, valid once reaped is set
+    size_t                 bytes_out;     // Output relayed to the session so far
+    struct result_capture *capture;       // Output kept for the result cache, NULL if the result isn't cached
+    timer_entry            timer;         // The deadline, then the SIGKILL that follows SIGTERM
+    timer_entry            reap_timer;    // Polls for the exit of a child without a pidfd
+    bool                   reaped;        // pid has been waited for
+    bool                   exited;        // Every process of the job has been waited for
+    bool                   readable;      // The output pipe may have data that has not been read yet
+    bool                   in_use;
+} job_info;
+
+typedef struct
+{
+    job_info *jobs;
+    int      *free_list;
+    int       capacity;
+    int       free_count;
+} job_table;
+
+int       job_table_create(job_table *table, int capacity);
+void      job_table_destroy(job_table *table);
+job_info *job_acquire(job_table *table, int *index);
+void      job_release(job_table *table, int index);
+int       job_watch_exit(job_info *job);
+bool      job_reap(job_info *job, bool wait);
+void      job_signal(const job_info *job, int signal);
+bool      job_is_done(const job_info *job);
+ssize_t   job_read_output(job_info *job, void *buffer, size_t size);
+size_t    job_output_available(const job_info *job);
+
+#endif    // JOB_H
@@ -0,0 +1,47 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include "protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_PIPELINE_STAGES 8
+#define MAX_STAGE_ARGS 32
+#define MAX_STAGE_PATH 256
+
+// One program of a pipeline. Words point into the command line the pipeline was parsed from.
+typedef struct
+{
+    char       *argv[MAX_STAGE_ARGS + 1];    // NULL-terminated, argv[0] is the name as typed
+    const char *input_path;                  // Target of <, NULL to read the previous stage
+    const char *output_path;                 // Target of > or >>, NULL to feed the next stage
+    bool        append;                      // The output redirection was >>
+    int         input_fd;                    // Opened input_path, -1 if none
+    int         output_fd;                   // Opened output_path, -1 if none
+    char        path[MAX_STAGE_PATH];        // The executable, resolved by the caller
+} pipeline_stage;
+
+// Programs connected stdout to stdin, the last one's output going to the caller
+typedef struct
+{
+    pipeline_stage stages[MAX_PIPELINE_STAGES];
+    int            stage_count;
+} pipeline;
+
+int  spawn_command(const char *path, char *const argv[], int output_fd, int dir_fd, pid_t *pid);
+bool pipeline_is_compound(const char *line);
+int  pipeline_parse(char *line, pipeline *pl, const char **error);
+int  pipeline_open_redirects(pipeline *pl, int dir_fd, const char **failed);
+void pipeline_close_redirects(pipeline *pl);
+int  spawn_pipeline(const pipeline *pl, int output_fd, int dir_fd, pid_t *pids);
+int  set_cloexec(int fd);
+
+#endif    // LAUNCH_H
@@ -0,0 +1,117 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include "event.h"
+#include "protocol.h"
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define LOADGEN_DEFAULT_CONNECTIONS 100
+#define LOADGEN_DEFAULT_RATE 1000
+#define LOADGEN_DEFAULT_DURATION 10
+#define LOADGEN_DEFAULT_MIX "6:echo hello,2:pwd,2:uname -a"
+#define LOADGEN_MAX_CONNECTIONS 100000
+#define LOADGEN_MAX_COMMANDS 32
+#define LOADGEN_MAX_COMMAND 256
+#define LOADGEN_PIPELINE 64    // Requests a connection may have outstanding, a power of two
+#define LOADGEN_DRAIN_SECONDS 5
+#define LOADGEN_RECV_BUFFER 65536
+#define LOADGEN_PERCENTILE_TICKS 5    // Rows per halving of the remaining distance
+
+#define HISTOGRAM_SUB_BITS 8    // 256 sub-buckets per power of two, under 0.4% error
+#define HISTOGRAM_SUB_COUNT (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT (HISTOGRAM_SUB_COUNT / 2)
+#define HISTOGRAM_MAX_SHIFT 32    // Latencies up to about 2^40 ns
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT + (HISTOGRAM_MAX_SHIFT * HISTOGRAM_HALF_COUNT))
+
+#define NANOS_PER_SEC 1000000000ULL
+#define NANOS_PER_MILLI 1000000ULL
+#define NANOS_PER_MICRO 1000.0
+
+// Log-linear latency histogram in the style of HdrHistogram, values in nanoseconds
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} latency_histogram;
+
+// One command of the mix and the latencies measured for it
+typedef struct
+{
+    char              line[LOADGEN_MAX_COMMAND];
+    uint32_t          length;
+    uint32_t          weight;
+    uint64_t          completed;
+    uint64_t          failed;    // Completed with a non-zero status
+    latency_histogram latency;
+} loadgen_command;
+
+// A connection to the server and the requests waiting for a STATUS frame on it
+typedef struct
+{
+    int      sockfd;
+    uint32_t next_request_id;
+    uint64_t sent_at[LOADGEN_PIPELINE];    // When each outstanding request was due, oldest first
+    uint8_t  command[LOADGEN_PIPELINE];    // Index of each outstanding request's command
+    uint32_t head;
+    uint32_t in_flight;
+    uint8_t  pending[FRAME_HEADER_SIZE + sizeof(uint32_t)];    // Start of the frame being received
+    size_t   pending_len;
+    uint32_t skip;    // Payload bytes of the current frame that are ignored
+    bool     greeted;
+    bool     open;
+} loadgen_connection;
+
+typedef struct
+{
+    loadgen_connection *connections;
+    int                 connection_count;
+    loadgen_command     commands[LOADGEN_MAX_COMMANDS];
+    int                 command_count;
+    uint32_t            total_weight;
+    uint64_t            rate;    // Requests per second across all connections
+    uint64_t            duration;
+    uint64_t            issued;
+    uint64_t            completed;
+    uint64_t            failed;
+    uint64_t            lost;    // Outstanding on a connection the server closed
+    uint32_t            next_connection;
+    uint32_t            random;
+    event_loop          events;
+    latency_histogram   latency;
+} loadgen_state;
+
+static volatile sig_atomic_t exit_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static int      parse_mix(loadgen_state *state, const char *mix);
+static int      parse_positive(const char *text, const char *name, uint64_t max, uint64_t *value);
+static int      open_connections(loadgen_state *state, const struct sockaddr_storage *addr, in_port_t port);
+static int      await_greetings(loadgen_state *state);
+static int      run_load(loadgen_state *state);
+static bool     issue_request(loadgen_state *state, uint64_t due);
+static int      receive_frames(loadgen_state *state, loadgen_connection *connection);
+static void     process_bytes(loadgen_state *state, loadgen_connection *connection, const uint8_t *data, size_t length);
+static void     complete_request(loadgen_state *state, loadgen_connection *connection, int32_t status);
+static void     close_connection(loadgen_state *state, loadgen_connection *connection);
+static int      pick_command(loadgen_state *state);
+static uint64_t now_nanos(void);
+static void     histogram_record(latency_histogram *histogram, uint64_t value);
+static uint64_t histogram_value_at(const latency_histogram *histogram, double percentile);
+static uint64_t bucket_value(uint32_t index);
+static void     print_report(const loadgen_state *state, uint64_t elapsed);
+static void     print_distribution(const latency_histogram *histogram);
+static void     raise_fd_limit(void);
+static void     setup_signal_handler(void);
+static void     sigint_handler(int signum);
+
+#endif    // LOADGEN_H
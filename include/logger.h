@@ -0,0 +1,52 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOGGER_MAX_RINGS 128           // Threads that can log, one ring each
+#define LOGGER_RING_RECORDS 1024       // Power of two
+#define LOGGER_LINE_MAX 512            // Longer messages are truncated
+#define LOGGER_BATCH_SIZE 65536        // Bytes written to a stream at once
+#define LOGGER_FLUSH_INTERVAL_MS 10    // How long the flusher sleeps once the rings are empty
+
+// Severity of a message, a message is kept when its level is at most the threshold
+enum logger_level
+{
+    LOG_LEVEL_OFF = -1,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+// Most verbose level being kept, read on every LOG_AT
+extern int logger_threshold;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Skips formatting, and evaluating the arguments, when the level is disabled
+#define LOG_AT(level, ...)                                                          \
+    do                                                                              \
+    {                                                                               \
+        if((int)(level) <= __atomic_load_n(&logger_threshold, __ATOMIC_RELAXED))    \
+        {                                                                           \
+            logger_write((level), __VA_ARGS__);                                     \
+        }                                                                           \
+    } while(0)
+
+int      logger_parse_level(const char *name, enum logger_level *level);
+int      logger_start(enum logger_level level);
+void     logger_stop(void);
+void     logger_write(enum logger_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+uint64_t logger_dropped(void);
+pid_t    logger_fork(void);
+
+#endif    // LOGGER_H
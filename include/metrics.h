@@ -0,0 +1,77 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_STATES 10    // FSM states from WAIT_FOR_CMD to ERROR
+#define METRICS_TEXT_SIZE 8192
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_LABEL_SIZE 64
+#define METRICS_READ_TIMEOUT 1    // Seconds a scraper has to send its request
+#define METRICS_PREFIX "shell_"
+
+// What a command was answered with
+enum metrics_command
+{
+    METRICS_BUILTIN,
+    METRICS_FAST_PATH,
+    METRICS_EXTERNAL,
+    METRICS_CACHED,
+    METRICS_INVALID,
+    METRICS_COMMAND_KINDS
+};
+
+// Counters and gauges of one reactor. Only the reactor writes them, any thread may read them.
+typedef struct
+{
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t sessions;    // Gauge: connections with a session
+    uint64_t channels;    // Gauge: sessions opened on a channel of a connection
+    uint64_t children;    // Gauge: commands still running
+    uint64_t states[METRICS_STATES];
+    uint64_t commands[METRICS_COMMAND_KINDS];
+    uint64_t spawn_failures;
+    uint64_t timed_out;        // Commands terminated at their deadline
+    uint64_t idle_closed;      // Sessions closed for being idle
+    uint64_t output_stalls;    // Times a client's socket filled up and output had to be queued
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t log_dropped;    // Process-wide, filled in by metrics_collect
+} server_metrics;
+
+struct server_data;
+
+// Unix socket answering every connection with the metrics of all reactors
+typedef struct
+{
+    int                       listen_fd;
+    int                       stop_pipe[2];
+    const char               *path;
+    const struct server_data *reactors;
+    int                       reactor_count;
+    pthread_t                 thread;
+} metrics_endpoint;
+
+void metrics_add(uint64_t *value, uint64_t amount);
+void metrics_sub(uint64_t *value, uint64_t amount);
+void metrics_collect(const struct server_data *reactors, int reactor_count, server_metrics *total);
+int  metrics_format(const server_metrics *total, char *buffer, size_t size);
+int  metrics_endpoint_start(metrics_endpoint *endpoint, const char *path, const struct server_data *reactors, int reactor_count);
+void metrics_endpoint_stop(metrics_endpoint *endpoint);
+
+#endif    // METRICS_H
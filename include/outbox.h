@@ -0,0 +1,50 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include "protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+    #include <sys/sendfile.h>
+#endif
+
+#define OUTBOX_CHUNK_SIZE 16384    // Small frames queued back to back share a chunk of this size
+#define OUTBOX_IOV_MAX 64          // Queued chunks written by one sendmsg
+#define OUTBOX_COPY_SIZE 4096      // Bytes of a file copied at once where sendfile can't be used
+
+// Part of the queue: bytes held in data, or a range of a file sent with sendfile(2)
+typedef struct outbox_chunk
+{
+    struct outbox_chunk *next;
+    int                  file_fd;    // -1 when the bytes are held in data
+    off_t                offset;     // Next byte of the file to send
+    size_t               start;      // Next byte of data to send
+    size_t               length;     // Bytes left to send
+    size_t               size;       // Capacity of data
+    uint8_t              data[];
+} outbox_chunk;
+
+// Frames a connection's socket hasn't taken yet, sent in order once it has room again
+typedef struct
+{
+    outbox_chunk *head;
+    outbox_chunk *tail;
+    size_t        bytes;    // Bytes queued, file ranges included
+} outbox;
+
+int  outbox_sendv(outbox *box, int fd, const struct iovec *iov, int iovcnt);
+int  outbox_send(outbox *box, int fd, uint8_t type, uint8_t flags, uint16_t channel, uint32_t request_id, const void *payload, uint32_t length);
+int  outbox_splice(outbox *box, int fd, int pipe_fd, uint8_t type, uint16_t channel, uint32_t request_id, uint32_t length);
+int  outbox_sendfile(outbox *box, int fd, int file_fd, off_t offset, uint8_t type, uint16_t channel, uint32_t request_id, uint32_t length);
+int  outbox_flush(outbox *box, int fd);
+void outbox_clear(outbox *box);
+
+#endif    // OUTBOX_H
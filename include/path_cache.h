@@ -0,0 +1,47 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#if defined(__linux__)
+    #include <sys/inotify.h>
+#endif
+
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin:/usr/sbin:/sbin"
+
+// An executable name and the PATH directory it resolves to
+typedef struct
+{
+    char    *name;    // NULL for an empty bucket
+    uint32_t hash;
+    uint32_t dir;     // Index into path_cache.dirs
+} path_entry;
+
+// Index of every executable on PATH, kept current by inotify watches
+typedef struct
+{
+    path_entry *entries;
+    size_t      capacity;    // Always a power of two
+    size_t      count;
+    char       *path;        // The PATH value the index was built from
+    char      **dirs;        // PATH split into directories, in search order
+    int        *watches;
+    size_t      dir_count;
+    int         inotify_fd;    // -1 when changes cannot be watched
+    bool        stale;         // Rebuild before the next lookup
+} path_cache;
+
+int  path_cache_create(path_cache *cache);
+void path_cache_destroy(path_cache *cache);
+int  path_cache_lookup(path_cache *cache, const char *name, char *full_path, size_t size);
+void path_cache_handle_event(path_cache *cache);
+
+#endif    // PATH_CACHE_H
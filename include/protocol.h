@@ -0,0 +1,85 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define PROTOCOL_VERSION 2
+#define FRAME_HEADER_SIZE 12
+#define CHANNEL_WINDOW 2048    // Command bytes, headers included, an opened channel takes before credit is returned
+#define MAX_CHANNELS 64        // Channels per connection, channel 0 included
+#define FRAME_MAX_PAYLOAD 65536
+#define CMD_SYNTAX_ERROR 2
+#define CMD_NOT_EXECUTABLE 126
+#define CMD_NOT_FOUND 127
+
+#define FRAME_FLAG_CONCURRENT 0x01    // COMMAND may run while earlier requests are still running
+
+/*
+    Every message on the wire is a frame:
+
+        0       1       2               4               8              12
+        +-------+-------+---------------+---------------+---------------+
+        | type  | flags |    channel    |  request id   |    length     |
+        +-------+-------+---------------+---------------+---------------+
+        | payload (length bytes)                                        |
+
+    Multi-byte fields are in network byte order. Both sides open with a HELLO
+    carrying their protocol version. Each COMMAND is answered by zero or more
+    OUTPUT frames followed by exactly one STATUS frame with the same request id.
+    Clients may pipeline COMMANDs without waiting for earlier STATUS frames; the
+    server runs them in order unless FRAME_FLAG_CONCURRENT is set, so frames of
+    different requests may interleave.
+
+    A connection carries independent sessions, each with its own working
+    directory and command stream, on channels 1 to MAX_CHANNELS - 1. The client
+    opens one with OPEN, granting the server some output credit, and the server
+    answers OPEN with the channel's input credit, or CLOSE if it can't open it.
+    Every frame of a session carries its channel. On an opened channel:
+
+        - The client sends no more COMMAND bytes, headers included, than the
+          input credit it holds. The server returns credit with CREDIT frames as
+          it takes commands off the channel, so one busy channel never holds up
+          the commands of the others.
+        - The server stops relaying command output once the channel's output
+          credit runs out, until the client grants more with CREDIT. Replies the
+          server can't pause still count against it.
+
+    Channel 0 is open from the handshake and has no credit in either direction,
+    TCP alone paces it like a connection without channels.
+*/
+enum frame_type
+{
+    FRAME_HELLO = 1,    // Payload: uint32 protocol version
+    FRAME_COMMAND,      // Payload: command line, not NUL-terminated
+    FRAME_OUTPUT,       // Payload: raw command output
+    FRAME_STATUS,       // Payload: int32 exit status, ends the request
+    FRAME_OPEN,         // Payload: uint32 credit granted to the other side
+    FRAME_CLOSE,        // No payload, ends the channel and is echoed back
+    FRAME_CREDIT        // Payload: uint32 more bytes the other side may send
+};
+
+typedef struct
+{
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t channel;
+    uint32_t request_id;
+    uint32_t length;
+} frame_header;
+
+void     frame_encode_header(uint8_t *buffer, uint8_t type, uint8_t flags, uint16_t channel, uint32_t request_id, uint32_t length);
+void     frame_decode_header(const uint8_t *buffer, frame_header *header);
+void     frame_encode_u32(uint8_t *buffer, uint32_t value);
+uint32_t frame_decode_u32(const uint8_t *buffer);
+int      frame_sendv(int fd, struct iovec *iov, int iovcnt);
+int      frame_send(int fd, uint8_t type, uint8_t flags, uint16_t channel, uint32_t request_id, const void *payload, uint32_t length);
+int      frame_recv(int fd, frame_header *header, void *payload, size_t size);
+
+#endif    // PROTOCOL_H
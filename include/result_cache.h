@@ -0,0 +1,75 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "session.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define RESULT_CACHE_ENTRIES 256    // Power of two
+#define RESULT_CACHE_PROBE 8        // Slots searched from an entry's home slot
+#define RESULT_CACHE_MAX_INPUTS 8
+#define RESULT_CACHE_MAX_OUTPUT OUTPUT_CHUNK    // Larger outputs are not cached
+#define RESULT_CACHE_MAX_TTL 3600
+
+// The version of a file a cached result was produced from
+typedef struct
+{
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+    struct timespec ctime;
+} result_stamp;
+
+// What a cached result depends on: the command line, the session's directory and the files it reads
+typedef struct
+{
+    char         command[MAX_PATH_LENGTH];    // The resolved executable
+    char         args[MAX_ARGS_LENGTH];
+    dev_t        cwd_dev;
+    ino_t        cwd_ino;
+    result_stamp inputs[RESULT_CACHE_MAX_INPUTS];    // The operands, or the directory itself without any
+    int          input_count;
+    uint32_t     hash;
+} result_key;
+
+// Output collected from a running job until it exits
+typedef struct result_capture
+{
+    result_key key;
+    size_t     length;
+    bool       overflow;    // The output outgrew the cache and is not stored
+    char       output[RESULT_CACHE_MAX_OUTPUT];
+} result_capture;
+
+typedef struct
+{
+    result_key key;
+    char      *output;    // NULL for an empty slot
+    size_t     length;
+    time_t     stored;    // CLOCK_MONOTONIC seconds
+} result_entry;
+
+// Recent output of read-only commands, owned by one reactor
+typedef struct
+{
+    result_entry *entries;    // NULL while caching is off
+    int           ttl;        // Seconds an entry is served for
+} result_cache;
+
+int             result_cache_create(result_cache *cache, int ttl);
+void            result_cache_destroy(result_cache *cache);
+int             result_key_build(const result_cache *cache, int cwd_fd, const char *command, const char *args, result_key *key);
+int             result_cache_lookup(result_cache *cache, const result_key *key, char *output, size_t *length);
+void            result_cache_store(result_cache *cache, const result_capture *capture);
+result_capture *result_capture_create(const result_key *key);
+void            result_capture_append(result_capture *capture, const void *data, size_t length);
+
+#endif    // RESULT_CACHE_H
@@ -1,6 +1,15 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "event.h"
+#include "job.h"
+#include "launch.h"
+#include "logger.h"
+#include "metrics.h"
+#include "path_cache.h"
+#include "protocol.h"
+#include "result_cache.h"
+#include "session.h"
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -11,43 +20,69 @@
 #include <p101_posix/p101_string.h>
 #include <p101_posix/p101_unistd.h>
 #include <p101_unix/p101_getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 static volatile sig_atomic_t exit_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 #define TIMEOUT 10
-#define MAX_CLIENTS 10
-#define MAX_MSG_LENGTH 256
-#define MAX_CMD_LENGTH 32
-#define MAX_ARGS_LENGTH 128
-#define MAX_PATH_LENGTH 256
+#define MAX_REACTORS 64
+#define MAX_JOBS 4096
+#define FRAME_MAX_COMMAND (CHANNEL_WINDOW - FRAME_HEADER_SIZE)    // A connection's buffer fits channel 0's window and a frame of another channel
+#define MAX_TIMEOUT_SECONDS 86400
+#define COMMAND_KILL_GRACE_MS 2000        // Between SIGTERM and SIGKILL for a command past its deadline
+#define REAP_POLL_MS 50                   // How often a child without a pidfd is checked for exit
+#define OUTBOX_HIGH_WATER (256 * 1024)    // Queued output past which a connection's commands stop being read and relayed
 
-typedef struct
-{
-    int                client_socket;
-    struct sockaddr_in client_address;
-    pid_t              process_id;
-    char               cmd[MAX_CMD_LENGTH];
-    char               args[MAX_ARGS_LENGTH];
-    char               cmd_path[MAX_PATH_LENGTH];
-    char               msg[MAX_MSG_LENGTH];
-    char               output[MAX_MSG_LENGTH];
-} client_info;
+// A session's working directory only has to be usable as a directory handle
+#if defined(O_PATH)
+    #define SESSION_DIR_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+    #define SESSION_DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+struct builtin_command;
 
-typedef struct
+// One reactor: a listener, its sessions and the FSM that serves them
+typedef struct server_data
 {
-    int         server_socket;
-    client_info clients[MAX_CLIENTS];
-    fd_set      active_fds;
-    int         max_fd;
-    int         active_client;
+    int                           server_socket;
+    session_pool                  sessions;
+    event_loop                    events;
+    job_table                     jobs;
+    path_cache                    paths;
+    result_cache                  results;
+    int                           cache_ttl;    // Seconds read-only command output is cached for, 0 to disable
+    timer_wheel                   timers;
+    int                           command_timeout;    // Seconds a command may run, 0 for no limit
+    int                           idle_timeout;       // Seconds a session may stay silent, 0 for no limit
+    int                           active_client;
+    const struct builtin_command *active_builtin;    // Registry entry of the active client's command, NULL if external
+    bool                          single_session;    // This process serves one connection in process-per-connection mode
+    bool                          splice_output;     // Relay job output with splice(2) instead of through client->output
+    bool                          fast_paths;        // Serve common utilities in-process instead of spawning them
+    server_metrics                metrics;
+    struct server_data           *reactors;          // Every reactor in the process, this one included
+    int                           reactor_count;
+    pthread_t                     thread;
 } server_data;
 
+// What a timer in server_data.timers does when it fires
+enum timer_kind
+{
+    TIMER_IDLE,        // Token is a session
+    TIMER_DEADLINE,    // Token is a job
+    TIMER_KILL,        // Token is a job
+    TIMER_REAP         // Token is a job
+};
+
 enum application_states
 {
     WAIT_FOR_CMD = P101_FSM_USER_START,
@@ -0,0 +1,98 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "outbox.h"
+#include "protocol.h"
+#include "timer.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define MAX_CLIENTS 131072
+#define SESSION_CHUNK_SHIFT 8
+#define SESSION_CHUNK_SIZE (1u << SESSION_CHUNK_SHIFT)
+#define SESSION_MAX_CHUNKS (MAX_CLIENTS / SESSION_CHUNK_SIZE)
+#define SESSION_SPARE_IO 64    // Buffer sets kept for reuse instead of being freed
+#define MAX_SESSION_JOBS 8
+#define MAX_MSG_LENGTH 256
+#define MAX_CMD_LENGTH 32
+#define MAX_ARGS_LENGTH 128
+#define MAX_PATH_LENGTH 256
+#define OUTPUT_CHUNK 16384
+#define INPUT_BUFFER_SIZE 4096
+
+// Buffers a session only holds while it has a request in progress
+typedef struct session_io
+{
+    char               cmd[MAX_CMD_LENGTH];
+    char               args[MAX_ARGS_LENGTH];
+    char               cmd_path[MAX_PATH_LENGTH];
+    char               msg[MAX_MSG_LENGTH];
+    char               output[OUTPUT_CHUNK];
+    uint8_t            input[INPUT_BUFFER_SIZE];
+    char               sequence[MAX_MSG_LENGTH];    // Rest of a command list, from the operator after the running command
+    uint32_t           sequence_id;                 // The request the command list belongs to
+    struct session_io *next_spare;                  // Link in session_pool.spare_io while unused
+} session_io;
+
+// Sessions a connection has opened besides the one on channel 0
+typedef struct
+{
+    uint32_t sessions[MAX_CHANNELS];    // Session slot of each open channel
+    uint64_t open;                      // Bit per open channel
+} session_channels;
+
+// The per-session state the event loop touches on every wakeup. Channel 0's session holds the connection.
+typedef struct
+{
+    int               client_socket;             // 0 for a free slot, shared by every channel of a connection
+    int               cwd_fd;                    // The session's working directory
+    int               jobs[MAX_SESSION_JOBS];    // Running jobs in server_data.jobs
+    int               job_count;
+    int               next_job;    // Where output relaying resumes
+    uint32_t          request_id;
+    int               status;        // Exit status reported in the STATUS frame
+    size_t            output_len;    // Bytes of relayed command output, 0 for a text reply
+    size_t            input_len;
+    session_io       *io;            // NULL while the session is idle
+    timer_entry       idle_timer;    // Closes the session when nothing arrives for too long
+    uint32_t          owner;         // Slot of the session holding the connection
+    uint16_t          channel;
+    int64_t           output_credit;      // Output bytes the client still accepts, negative after a reply that couldn't wait
+    size_t            input_consumed;     // Command bytes taken off the channel but not yet credited back
+    session_channels *channels;           // The connection's other channels, NULL until one is opened
+    outbox            outbound;           // Frames the socket hasn't taken yet, only used on channel 0
+    bool              output_watched;     // The socket is watched for room to write
+    bool              flow_controlled;    // The channel was opened with credit
+    bool              greeted;            // The HELLO handshake has completed
+    bool              drained;            // The last recv emptied the socket
+    bool              reply_complete;     // The next send ends the request
+} client_info;
+
+// Session slots allocated a chunk at a time, so addresses and indexes never move
+typedef struct
+{
+    client_info *chunks[SESSION_MAX_CHUNKS];
+    uint32_t    *free_list;
+    uint32_t     chunk_count;
+    uint32_t     free_count;
+    uint32_t     capacity;    // Slots in the allocated chunks
+    session_io  *spare_io;
+    uint32_t     spare_count;
+} session_pool;
+
+void         session_pool_create(session_pool *pool);
+void         session_pool_destroy(session_pool *pool);
+client_info *session_acquire(session_pool *pool, uint32_t *index);
+void         session_release(session_pool *pool, uint32_t index);
+client_info *session_get(const session_pool *pool, uint32_t index);
+session_io  *session_attach_io(session_pool *pool, client_info *client);
+void         session_detach_io(session_pool *pool, client_info *client);
+void         session_parse_command(session_io *io);
+int          session_split_list(session_io *io);
+bool         session_next_command(session_io *io, int status);
+
+#endif    // SESSION_H
@@ -6,17 +6,30 @@
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define UNKNOWN_OPTION_MESSAGE_LEN 24
+#define UNKNOWN_OPTION_MESSAGE_LEN 32
 #define BASE_TEN 10
 #define EXIT_CODE 1
+#define MAX_OPTIONS 16
 
-void           parse_arguments(int argc, char *argv[], char **ip_address, char **port);
+// A program-specific command-line option, in addition to -h
+typedef struct
+{
+    char         flag;
+    const char  *argument;    // Name of the option's value, NULL for a switch
+    const char  *help;
+    const char **value;       // Receives the option's value
+    bool        *enabled;     // Set when a switch is given
+} program_option;
+
+void           parse_arguments(int argc, char *argv[], const program_option *options, size_t option_count, char **ip_address, char **port);
 void           handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port);
 void           convert_address(const char *address, struct sockaddr_storage *addr);
 int            socket_create(int domain, int type, int protocol);
@@ -0,0 +1,46 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define TIMER_TICK_MS 10
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1u << TIMER_LEVEL_BITS)    // Slots per level, one bit each in a 64-bit mask
+#define TIMER_LEVELS 4                          // About 46 hours at the coarsest level
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+
+// A timer embedded in the object it times, linked into a wheel slot while pending
+typedef struct timer_entry
+{
+    struct timer_entry *next;    // NULL while the timer isn't pending
+    struct timer_entry *prev;
+    uint64_t            expires;    // Tick the timer fires at
+    uint32_t            kind;       // What the owner does when it fires
+    uint32_t            token;      // Which object it belongs to
+    uint8_t             level;
+    uint8_t             slot;
+} timer_entry;
+
+// Hierarchical timer wheel: scheduling, cancelling and firing a timer are all O(1)
+typedef struct
+{
+    timer_entry slots[TIMER_LEVELS][TIMER_SLOTS];    // List heads
+    uint64_t    occupied[TIMER_LEVELS];              // Bit per slot with timers in it
+    timer_entry expired;                             // Timers that fired and haven't been popped
+    uint64_t    now;                                 // The last tick processed
+    uint64_t    origin_ms;                           // CLOCK_MONOTONIC time of tick 0
+} timer_wheel;
+
+void         timer_wheel_create(timer_wheel *wheel);
+void         timer_init(timer_entry *timer, uint32_t kind, uint32_t token);
+void         timer_schedule(timer_wheel *wheel, timer_entry *timer, uint64_t delay_ms);
+void         timer_cancel(timer_wheel *wheel, timer_entry *timer);
+bool         timer_pending(const timer_entry *timer);
+void         timer_wheel_advance(timer_wheel *wheel);
+timer_entry *timer_wheel_pop(timer_wheel *wheel);
+int          timer_wheel_timeout(const timer_wheel *wheel, int max_ms);
+
+#endif    // TIMER_H
@@ -0,0 +1,702 @@
+#include "builtin.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define DEFAULT_COUNT 1
+#define BENCH_TARGET_NANOS 500000000ULL    // Grow the iteration count until a run takes this long
+#define BENCH_MAX_ITERATIONS 1000000000ULL
+#define SESSION_FOOTPRINT (64 * 1024)    // Roughly the memory a session pins in the server
+#define SIMULATED_SESSIONS 1000
+#define NANOS_PER_SEC 1000000000ULL
+#define BASE_TEN 10
+
+enum bench_states
+{
+    BENCH_PING = P101_FSM_USER_START,
+    BENCH_PONG
+};
+
+// What the benchmarks share: a server with one session, as the FSM sees it
+typedef struct
+{
+    server_data   server;
+    client_info  *client;
+    const char   *program;    // Executable started by the launch benchmarks
+    int           output_fd;
+    int          *session_fds;
+    char        **session_buffers;
+    int           session_count;
+    uint64_t      remaining;    // Transitions left in the FSM benchmark
+} bench_fixture;
+
+typedef void (*bench_function)(bench_fixture *fixture, uint64_t iterations);
+typedef int (*launcher)(const char *path, char *const argv[], int output_fd, pid_t *pid);
+
+typedef struct
+{
+    const char    *name;
+    bench_function run;
+    int            sessions;    // Simulated sessions held while the benchmark runs
+} bench_case;
+
+static int              fixture_create(bench_fixture *fixture);
+static void             fixture_destroy(bench_fixture *fixture);
+static int              hold_sessions(bench_fixture *fixture, int count);
+static void             run_case(bench_fixture *fixture, const bench_case *bench);
+static uint64_t         now_nanos(void);
+static void             bench_parse_command(bench_fixture *fixture, uint64_t iterations);
+static void             bench_builtin_hit(bench_fixture *fixture, uint64_t iterations);
+static void             bench_builtin_miss(bench_fixture *fixture, uint64_t iterations);
+static void             bench_path_lookup(bench_fixture *fixture, uint64_t iterations);
+static void             bench_process_type(bench_fixture *fixture, uint64_t iterations);
+static void             bench_process_meow(bench_fixture *fixture, uint64_t iterations);
+static void             bench_fsm_transition(bench_fixture *fixture, uint64_t iterations);
+static p101_fsm_state_t fsm_bounce(const struct p101_env *env, struct p101_error *err, void *arg);
+static void             bench_fork_exec(bench_fixture *fixture, uint64_t iterations);
+static void             bench_spawn(bench_fixture *fixture, uint64_t iterations);
+static void             launch_repeatedly(bench_fixture *fixture, launcher launch, uint64_t iterations);
+static int              fork_command(const char *path, char *const argv[], int output_fd, pid_t *pid);
+static int              spawn_here(const char *path, char *const argv[], int output_fd, pid_t *pid);
+static void             raise_fd_limit(void);
+
+static const bench_case bench_cases[] = {
+    {"ParseCommand",               bench_parse_command,  0                 },
+    {"BuiltinLookupHit",           bench_builtin_hit,    0                 },
+    {"BuiltinLookupMiss",          bench_builtin_miss,   0                 },
+    {"PathLookup",                 bench_path_lookup,    0                 },
+    {"ProcessType",                bench_process_type,   0                 },
+    {"ProcessMeow",                bench_process_meow,   0                 },
+    {"FsmTransition",              bench_fsm_transition, 0                 },
+    {"ForkExec",                   bench_fork_exec,      0                 },
+    {"Spawn",                      bench_spawn,          0                 },
+    {"ForkExec/sessions=1000",     bench_fork_exec,      SIMULATED_SESSIONS},
+    {"Spawn/sessions=1000",        bench_spawn,          SIMULATED_SESSIONS},
+};
+
+#if defined(__GLIBC__)
+// Every allocation made through malloc and friends, counted by the wrappers below
+static uint64_t allocation_count = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+/*
+    Counts an allocation and forwards it to the C library.
+
+    @param
+    size: Bytes wanted
+
+    @return
+    The memory, or NULL
+*/
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+/*
+    Counts an allocation and forwards it to the C library.
+
+    @param
+    count: Number of elements
+    size: Bytes per element
+
+    @return
+    The zeroed memory, or NULL
+*/
+void *calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+/*
+    Counts an allocation and forwards it to the C library.
+
+    @param
+    ptr: The memory to resize, or NULL
+    size: Bytes wanted
+
+    @return
+    The memory, or NULL
+*/
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/*
+    Runs microbenchmarks of each stage of the request path and prints one line
+    per benchmark in the Go benchmark format, so results can be compared with
+    benchstat:
+
+        BenchmarkParseCommand    20000000    24.10 ns/op    0 allocs/op
+
+    Allocations are only counted with glibc; elsewhere the column is omitted.
+
+    usage: bench [filter] [count]
+*/
+int main(int argc, char *argv[])
+{
+    bench_fixture fixture;
+    const char   *filter;
+    long          count;
+    long          round;
+    size_t        i;
+
+    filter = argc > 1 ? argv[1] : "";
+    count  = argc > 2 ? strtol(argv[2], NULL, BASE_TEN) : DEFAULT_COUNT;
+    if(count <= 0)
+    {
+        fprintf(stderr, "Usage: %s [filter] [count]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    raise_fd_limit();
+    if(fixture_create(&fixture) == -1)
+    {
+        fixture_destroy(&fixture);
+        return EXIT_FAILURE;
+    }
+
+    // Repeated rounds give benchstat the samples it needs for its confidence intervals
+    for(round = 0; round < count; round++)
+    {
+        for(i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++)
+        {
+            if(strstr(bench_cases[i].name, filter) != NULL)
+            {
+                run_case(&fixture, &bench_cases[i]);
+            }
+        }
+    }
+
+    fixture_destroy(&fixture);
+    return EXIT_SUCCESS;
+}
+
+/*
+    Sets up a server with one session in the current directory, as the FSM has
+    it while serving a request.
+
+    @param
+    fixture: The fixture to initialise
+
+    @return
+    0 on success, -1 on failure
+*/
+static int fixture_create(bench_fixture *fixture)
+{
+    uint32_t index;
+
+    memset(fixture, 0, sizeof(*fixture));
+    fixture->output_fd         = -1;
+    fixture->server.fast_paths = true;
+    fixture->program           = access("/bin/true", X_OK) == 0 ? "/bin/true" : "/usr/bin/true";
+
+    session_pool_create(&fixture->server.sessions);
+    fixture->client = session_acquire(&fixture->server.sessions, &index);
+    if(fixture->client == NULL || session_attach_io(&fixture->server.sessions, fixture->client) == NULL)
+    {
+        perror("Unable to create a session");
+        return -1;
+    }
+
+    fixture->client->cwd_fd = open(".", SESSION_DIR_FLAGS);
+    fixture->output_fd      = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if(fixture->client->cwd_fd == -1 || fixture->output_fd == -1)
+    {
+        perror("Unable to open the session's files");
+        return -1;
+    }
+
+    if(path_cache_create(&fixture->server.paths) == -1 || builtin_registry_init() == -1)
+    {
+        fprintf(stderr, "Unable to index PATH or the builtins\n");
+        return -1;
+    }
+
+    fixture->session_fds     = (int *)calloc(SIMULATED_SESSIONS, sizeof(int));
+    fixture->session_buffers = (char **)calloc(SIMULATED_SESSIONS, sizeof(char *));
+    if(fixture->session_fds == NULL || fixture->session_buffers == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Frees everything fixture_create set up.
+
+    @param
+    fixture: The fixture
+*/
+static void fixture_destroy(bench_fixture *fixture)
+{
+    hold_sessions(fixture, 0);
+    free(fixture->session_fds);
+    free(fixture->session_buffers);
+
+    if(fixture->client != NULL && fixture->client->cwd_fd != -1)
+    {
+        close(fixture->client->cwd_fd);
+    }
+    if(fixture->output_fd != -1)
+    {
+        close(fixture->output_fd);
+    }
+
+    path_cache_destroy(&fixture->server.paths);
+    session_pool_destroy(&fixture->server.sessions);
+}
+
+/*
+    Grows or shrinks the set of simulated sessions. Each is an inheritable
+    socket and a dirtied buffer, which is what makes fork slower as the server grows.
+
+    @param
+    fixture: The fixture
+    count: The number of sessions wanted
+
+    @return
+    0 on success, -1 on failure
+*/
+static int hold_sessions(bench_fixture *fixture, int count)
+{
+    while(fixture->session_count > count)
+    {
+        fixture->session_count--;
+        close(fixture->session_fds[fixture->session_count]);
+        free(fixture->session_buffers[fixture->session_count]);
+    }
+
+    while(fixture->session_count < count)
+    {
+        int   fd;
+        char *buffer;
+
+        // Deliberately inheritable, like sockets returned by a plain accept()
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);    // NOLINT(android-cloexec-socket)
+        if(fd == -1)
+        {
+            return -1;
+        }
+
+        buffer = (char *)malloc(SESSION_FOOTPRINT);
+        if(buffer == NULL)
+        {
+            close(fd);
+            return -1;
+        }
+        memset(buffer, 1, SESSION_FOOTPRINT);
+
+        fixture->session_fds[fixture->session_count]     = fd;
+        fixture->session_buffers[fixture->session_count] = buffer;
+        fixture->session_count++;
+    }
+
+    return 0;
+}
+
+/*
+    Runs a benchmark with a growing number of iterations until one run takes
+    long enough to time reliably, then prints its result.
+
+    @param
+    fixture: The shared fixture
+    bench: The benchmark
+*/
+static void run_case(bench_fixture *fixture, const bench_case *bench)
+{
+    uint64_t iterations;
+    uint64_t elapsed;
+    uint64_t allocations;
+
+    if(hold_sessions(fixture, bench->sessions) == -1)
+    {
+        perror("Unable to create sessions");
+        return;
+    }
+
+    iterations = 1;
+    for(;;)
+    {
+        uint64_t start;
+        uint64_t next;
+
+#if defined(__GLIBC__)
+        allocations = __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
+#else
+        allocations = 0;
+#endif
+        start = now_nanos();
+        bench->run(fixture, iterations);
+        elapsed = now_nanos() - start;
+#if defined(__GLIBC__)
+        allocations = __atomic_load_n(&allocation_count, __ATOMIC_RELAXED) - allocations;
+#endif
+
+        if(elapsed >= BENCH_TARGET_NANOS || iterations >= BENCH_MAX_ITERATIONS)
+        {
+            break;
+        }
+
+        // Aim 20% past the target from the rate so far, growing at most 100x per step
+        next = elapsed == 0 ? iterations * 100 : (uint64_t)((double)BENCH_TARGET_NANOS * 1.2 * (double)iterations / (double)elapsed);
+        if(next > iterations * 100)
+        {
+            next = iterations * 100;
+        }
+        iterations = next > iterations ? next : iterations + 1;
+        if(iterations > BENCH_MAX_ITERATIONS)
+        {
+            iterations = BENCH_MAX_ITERATIONS;
+        }
+    }
+
+#if defined(__GLIBC__)
+    printf("Benchmark%s\t%10llu\t%12.2f ns/op\t%8.2f allocs/op\n", bench->name, (unsigned long long)iterations, (double)elapsed / (double)iterations, (double)allocations / (double)iterations);
+#else
+    printf("Benchmark%s\t%10llu\t%12.2f ns/op\n", bench->name, (unsigned long long)iterations, (double)elapsed / (double)iterations);
+#endif
+    fflush(stdout);
+}
+
+/*
+    Reads the monotonic clock.
+
+    @return
+    Nanoseconds on CLOCK_MONOTONIC
+*/
+static uint64_t now_nanos(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NANOS_PER_SEC) + (uint64_t)now.tv_nsec;
+}
+
+/*
+    Splits a typical command line into command and arguments, as PARSE_CMD does.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of operations
+*/
+static void bench_parse_command(bench_fixture *fixture, uint64_t iterations)
+{
+    uint64_t i;
+
+    snprintf(fixture->client->io->msg, MAX_MSG_LENGTH, "echo hello from the benchmark");
+    for(i = 0; i < iterations; i++)
+    {
+        session_parse_command(fixture->client->io);
+        __asm__ volatile("" : : "r"(fixture->client->io->args) : "memory");
+    }
+}
+
+/*
+    Resolves a builtin through the registry, as CHECK_CMD_TYPE does.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of operations
+*/
+static void bench_builtin_hit(bench_fixture *fixture, uint64_t iterations)
+{
+    uint64_t i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        const builtin_command *entry;
+
+        entry = builtin_lookup(&fixture->server, "echo");
+        __asm__ volatile("" : : "r"(entry) : "memory");
+    }
+}
+
+/*
+    Rejects an external command at the registry, as CHECK_CMD_TYPE does.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of operations
+*/
+static void bench_builtin_miss(bench_fixture *fixture, uint64_t iterations)
+{
+    uint64_t i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        const builtin_command *entry;
+
+        entry = builtin_lookup(&fixture->server, "uname");
+        __asm__ volatile("" : : "r"(entry) : "memory");
+    }
+}
+
+/*
+    Resolves an executable through the PATH index, as SEARCH_FOR_CMD does.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of operations
+*/
+static void bench_path_lookup(bench_fixture *fixture, uint64_t iterations)
+{
+    char     full_path[PATH_LEN];
+    uint64_t i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        if(path_cache_lookup(&fixture->server.paths, "uname", full_path, sizeof(full_path)) == -1)
+        {
+            full_path[0] = '\0';
+        }
+        __asm__ volatile("" : : "r"(full_path) : "memory");
+    }
+}
+
+/*
+    Runs the type builtin on an executable, which goes through the registry and PATH.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of operations
+*/
+static void bench_process_type(bench_fixture *fixture, uint64_t iterations)
+{
+    uint64_t i;
+
+    snprintf(fixture->client->io->args, MAX_ARGS_LENGTH, "uname");
+    for(i = 0; i < iterations; i++)
+    {
+        process_type(fixture->client, &fixture->server);
+    }
+}
+
+/*
+    Runs the meow builtin.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of operations
+*/
+static void bench_process_meow(bench_fixture *fixture, uint64_t iterations)
+{
+    uint64_t i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        process_meow(fixture->client, &fixture->server);
+    }
+}
+
+/*
+    Measures one FSM transition by bouncing between two states.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of transitions
+*/
+static void bench_fsm_transition(bench_fixture *fixture, uint64_t iterations)
+{
+    static struct p101_fsm_transition transitions[] = {
+        {P101_FSM_INIT, BENCH_PING,    fsm_bounce},
+        {BENCH_PING,    BENCH_PONG,    fsm_bounce},
+        {BENCH_PONG,    BENCH_PING,    fsm_bounce},
+        {BENCH_PING,    P101_FSM_EXIT, NULL      },
+        {BENCH_PONG,    P101_FSM_EXIT, NULL      }
+    };
+    struct p101_error    *error;
+    struct p101_env      *env;
+    struct p101_error    *fsm_error;
+    struct p101_env      *fsm_env;
+    struct p101_fsm_info *fsm;
+    p101_fsm_state_t      from_state;
+    p101_fsm_state_t      to_state;
+
+    error     = p101_error_create(false);
+    env       = error == NULL ? NULL : p101_env_create(error, true, NULL);
+    fsm_error = p101_error_create(false);
+    fsm_env   = error == NULL ? NULL : p101_env_create(error, true, NULL);
+    fsm       = env == NULL || fsm_env == NULL || fsm_error == NULL ? NULL : p101_fsm_info_create(env, error, "bench-fsm", fsm_env, fsm_error, NULL);
+
+    if(fsm != NULL)
+    {
+        fixture->remaining = iterations;
+        p101_fsm_run(fsm, &from_state, &to_state, fixture, transitions, sizeof(transitions));
+        p101_fsm_info_destroy(env, &fsm);
+    }
+
+    free(fsm_env);
+    free(env);
+    if(fsm_error != NULL)
+    {
+        p101_error_reset(fsm_error);
+        free(fsm_error);
+    }
+    if(error != NULL)
+    {
+        p101_error_reset(error);
+        free(error);
+    }
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/*
+    State handler of the FSM benchmark, alternating until the transitions run out.
+
+    @param
+    env: The program context
+    err: Used for error reporting
+    arg: The fixture
+
+    @return
+    The other state, or P101_FSM_EXIT when done
+*/
+static p101_fsm_state_t fsm_bounce(const struct p101_env *env, struct p101_error *err, void *arg)
+{
+    bench_fixture *fixture;
+
+    P101_TRACE(env);
+
+    fixture = (bench_fixture *)arg;
+    if(fixture->remaining <= 1)
+    {
+        return P101_FSM_EXIT;
+    }
+
+    fixture->remaining--;
+    return fixture->remaining % 2 == 0 ? BENCH_PING : BENCH_PONG;
+}
+
+#pragma GCC diagnostic pop
+
+/*
+    Starts and reaps a program with fork and execv, the way the server used to.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of launches
+*/
+static void bench_fork_exec(bench_fixture *fixture, uint64_t iterations)
+{
+    launch_repeatedly(fixture, fork_command, iterations);
+}
+
+/*
+    Starts and reaps a program with spawn_command, the way the server does.
+
+    @param
+    fixture: The shared fixture
+    iterations: Number of launches
+*/
+static void bench_spawn(bench_fixture *fixture, uint64_t iterations)
+{
+    launch_repeatedly(fixture, spawn_here, iterations);
+}
+
+/*
+    Starts and reaps a program repeatedly.
+
+    @param
+    fixture: The shared fixture
+    launch: The launcher under test
+    iterations: Number of launches
+*/
+static void launch_repeatedly(bench_fixture *fixture, launcher launch, uint64_t iterations)
+{
+    char    *argv[2];
+    uint64_t i;
+
+    argv[0] = (char *)(uintptr_t)fixture->program;
+    argv[1] = NULL;
+
+    for(i = 0; i < iterations; i++)
+    {
+        pid_t pid;
+
+        if(launch(fixture->program, argv, fixture->output_fd, &pid) != 0)
+        {
+            perror("launch");
+            break;
+        }
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/*
+    Starts a program the way the server used to: fork, redirect, execv.
+
+    @param
+    path: Full path of the executable
+    argv: NULL-terminated argument vector
+    output_fd: Descriptor the child's stdout and stderr are redirected to
+    pid: Receives the child's process id
+
+    @return
+    0 on success, or an errno value
+*/
+static int fork_command(const char *path, char *const argv[], int output_fd, pid_t *pid)
+{
+    *pid = fork();
+    if(*pid < 0)
+    {
+        return errno;
+    }
+
+    if(*pid == 0)
+    {
+        dup2(output_fd, STDOUT_FILENO);
+        dup2(output_fd, STDERR_FILENO);
+        execv(path, argv);
+        _exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+/*
+    Starts a program with spawn_command in the current directory.
+
+    @param
+    path: Full path of the executable
+    argv: NULL-terminated argument vector
+    output_fd: Descriptor the child's stdout and stderr are redirected to
+    pid: Receives the child's process id
+
+    @return
+    0 on success, or an errno value
+*/
+static int spawn_here(const char *path, char *const argv[], int output_fd, pid_t *pid)
+{
+    return spawn_command(path, argv, output_fd, -1, pid);
+}
+
+/*
+    Raises the soft descriptor limit so the simulated sessions fit.
+*/
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
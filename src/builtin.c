@@ -1,15 +1,164 @@
 #include "builtin.h"
+#include "fastpath.h"
+
+#define BUILTIN_MAX_SEEDS 65536
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t hash_name(const char *name, uint32_t seed);
+static int      directory_path(int dir_fd, char *buffer, size_t size);
+
+// Adding a builtin only takes an entry here
+static const builtin_command builtins[] = {
+    {"cd",    process_cd,    0                   },
+    {"pwd",   process_pwd,   0                   },
+    {"echo",  process_echo,  0                   },
+    {"type",  process_type,  0                   },
+    {"meow",  process_meow,  0                   },
+    {"stats", process_stats, 0                   },
+    {"exit",  NULL,          BUILTIN_STOPS_SERVER},
+    {"ls",    process_ls,    BUILTIN_FAST_PATH   },
+    {"cat",   process_cat,   BUILTIN_FAST_PATH   },
+    {"head",  process_head,  BUILTIN_FAST_PATH   },
+    {"wc",    process_wc,    BUILTIN_FAST_PATH   },
+    {"stat",  process_stat,  BUILTIN_FAST_PATH   },
+};
+
+// Perfect hash of the registry, written once by builtin_registry_init before any reactor runs
+static uint8_t  builtin_slots[BUILTIN_SLOTS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint32_t builtin_seed;                    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t   builtin_longest;                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+    Finds a hash seed under which every builtin lands in its own slot, so a
+    lookup is one hash and at most one string comparison.
+
+    @return
+    0 on success, -1 if no seed separates the names
+*/
+int builtin_registry_init(void)
+{
+    size_t   count;
+    uint32_t seed;
+
+    count = sizeof(builtins) / sizeof(builtins[0]);
+    if(count * 2 > BUILTIN_SLOTS)
+    {
+        return -1;
+    }
+
+    for(seed = 0; seed < BUILTIN_MAX_SEEDS; seed++)
+    {
+        size_t i;
+
+        memset(builtin_slots, 0, sizeof(builtin_slots));
+        builtin_longest = 0;
+
+        for(i = 0; i < count; i++)
+        {
+            uint32_t slot;
+
+            slot = hash_name(builtins[i].name, seed) & (BUILTIN_SLOTS - 1);
+            if(builtin_slots[slot] != 0)
+            {
+                break;
+            }
+
+            builtin_slots[slot] = (uint8_t)(i + 1);
+            if(strlen(builtins[i].name) > builtin_longest)
+            {
+                builtin_longest = strlen(builtins[i].name);
+            }
+        }
+
+        if(i == count)
+        {
+            builtin_seed = seed;
+            return 0;
+        }
+    }
+
+    return -1;
+}
 
 /*
-    Changes the current working directory for the server
+    Looks a command name up in the builtin registry.
 
     @param
-    client: Contains client input and holds the output message
+    server_state: The server, whose settings decide whether fast paths count as builtins
+    name: The command name
+
+    @return
+    The builtin, or NULL if the name is not a builtin
 */
+const builtin_command *builtin_lookup(const server_data *server_state, const char *name)
+{
+    const builtin_command *entry;
+    uint8_t                slot;
+
+    // Names longer than every builtin can't match, no need to hash them
+    if(strnlen(name, builtin_longest + 1) > builtin_longest)
+    {
+        return NULL;
+    }
+
+    slot = builtin_slots[hash_name(name, builtin_seed) & (BUILTIN_SLOTS - 1)];
+    if(slot == 0)
+    {
+        return NULL;
+    }
+
+    entry = &builtins[slot - 1];
+    if((entry->flags & BUILTIN_FAST_PATH) && !server_state->fast_paths)
+    {
+        return NULL;
+    }
+
+    return strcmp(entry->name, name) == 0 ? entry : NULL;
+}
+
+/*
+    Hashes a command name with 32-bit FNV-1a, perturbed by a seed.
+
+    @param
+    name: The command name
+    seed: Mixed into the offset basis
+
+    @return
+    The hash value
+*/
+static uint32_t hash_name(const char *name, uint32_t seed)
+{
+    uint32_t hash;
+
+    hash = FNV_OFFSET_BASIS ^ (seed * FNV_PRIME);
+    while(*name != '\0')
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/*
+    Changes the session's working directory. Relative paths are resolved against
+    the session's current directory; other sessions are not affected.
+
+    @param
+    client: Contains client input and holds the output message
+    server_state: The server owning the session (unused)
 
-void process_cd(client_info *client)
+    @return
+    BUILTIN_DONE
+*/
+int process_cd(client_info *client, server_data *server_state)
 {
-    const char *path = client->args;
+    const char *path = client->io->args;
+    int         dir_fd;
 
     // Default set to home
     if(path == NULL || *path == '\0')
@@ -21,36 +170,55 @@ void process_cd(client_info *client)
         }
     }
 
-    // Execute chdir
-    if(chdir(path) != 0)
+    // Open the new directory relative to the session's, it must be searchable like chdir requires
+    dir_fd = -1;
+    if(faccessat(client->cwd_fd, path, X_OK, 0) == 0)
+    {
+        dir_fd = openat(client->cwd_fd, path, SESSION_DIR_FLAGS);
+    }
+
+    if(dir_fd == -1)
     {
         perror("No such file or directory");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error using [cd]: No such file or directory\n");
-        return;
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error using [cd]: No such file or directory\n");
+        client->status = EXIT_FAILURE;
+        return BUILTIN_DONE;
     }
 
+    close(client->cwd_fd);
+    client->cwd_fd = dir_fd;
+
     // Success message
     // printf("Changing directory\n");
-    snprintf(client->output, MAX_MSG_LENGTH, "Changed directory to %s\n", path);
+    snprintf(client->io->output, MAX_MSG_LENGTH, "Changed directory to %s\n", path);
+
+    return BUILTIN_DONE;
 }
 
 /*
-    Retrieves and writes the server's current working directory
+    Retrieves and writes the session's current working directory
 
     @param
     client: Contains client input and holds the output message
+    server_state: The server owning the session (unused)
+
+    @return
+    BUILTIN_DONE
 */
-void process_pwd(client_info *client)
+int process_pwd(client_info *client, server_data *server_state)
 {
-    if(getcwd(client->output, MAX_MSG_LENGTH) != NULL)
+    if(directory_path(client->cwd_fd, client->io->output, MAX_MSG_LENGTH - 1) == 0)
     {
-        snprintf(client->output + strlen(client->output), MAX_MSG_LENGTH - strlen(client->output), "\n");
+        snprintf(client->io->output + strlen(client->io->output), MAX_MSG_LENGTH - strlen(client->io->output), "\n");
     }
     else
     {
         perror("Error retrieving current directory");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error using [pwd]: unable to retrieve current directory\n");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error using [pwd]: unable to retrieve current directory\n");
+        client->status = EXIT_FAILURE;
     }
+
+    return BUILTIN_DONE;
 }
 
 /*
@@ -58,17 +226,24 @@ void process_pwd(client_info *client)
 
     @param
     client: Contains client input and holds the output message
+    server_state: The server owning the session (unused)
+
+    @return
+    BUILTIN_DONE
 */
-void process_echo(client_info *client)
+int process_echo(client_info *client, server_data *server_state)
 {
-    if(*client->args == '\0')
+    if(*client->io->args == '\0')
     {
-        snprintf(client->output, MAX_MSG_LENGTH, "Error using [echo]: No message provided\n");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error using [echo]: No message provided\n");
+        client->status = EXIT_FAILURE;
     }
     else
     {
-        snprintf(client->output, MAX_MSG_LENGTH, "%s\n", client->args);
+        snprintf(client->io->output, MAX_MSG_LENGTH, "%s\n", client->io->args);
     }
+
+    return BUILTIN_DONE;
 }
 
 /*
@@ -76,75 +251,53 @@ void process_echo(client_info *client)
 
     @param
     client: Contains client input and holds the output message
+    server_state: The server owning the session, for its index of the executables on PATH
+
+    @return
+    BUILTIN_DONE
 */
-void process_type(client_info *client)
+int process_type(client_info *client, server_data *server_state)
 {
-    const char *path;
-    char       *path_copy;
-    const char *dir;
-    char       *saveptr;
-    const char *arg;
-    const char *builtins[] = {"cd", "pwd", "echo", "exit", "type", "meow"};
+    char                   full_path[PATH_LEN];
+    const char            *arg;
+    const builtin_command *entry;
 
-    arg = client->args;
+    arg = client->io->args;
 
     // Check for missing argument
     if(arg == NULL || *arg == '\0')
     {
-        snprintf(client->output, MAX_MSG_LENGTH, "Error using [type]: No command provided\n");
-        return;
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error using [type]: No command provided\n");
+        client->status = EXIT_FAILURE;
+        return BUILTIN_DONE;
     }
 
-    // Built-in commands
-    for(int i = 0; i < NUM_BUILT_INS; i++)
+    // Built-in commands, fast paths still report the executable they stand in for
+    entry = builtin_lookup(server_state, arg);
+    if(entry != NULL && !(entry->flags & BUILTIN_FAST_PATH))
     {
-        if(strcmp(arg, builtins[i]) == 0)
-        {
-            snprintf(client->output, MAX_MSG_LENGTH, "%s is a shellkitty builtin\n", arg);
-            return;
-        }
+        snprintf(client->io->output, MAX_MSG_LENGTH, "%s is a shellkitty builtin\n", arg);
+        return BUILTIN_DONE;
     }
 
     // Check if command is in PATH
-    path = getenv("PATH");
-    if(path == NULL)
+    if(path_cache_lookup(&server_state->paths, arg, full_path, sizeof(full_path)) == 0)
     {
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: PATH not set\n");
-        return;
-    }
+        // Clear buffer
+        client->io->output[0] = '\0';
 
-    // copy PATH since strtok modifies it
-    path_copy = strdup(path);
-    if(path_copy == NULL)
-    {
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Memory allocation failed\n");
-        return;
+        // Append in chunks
+        strncat(client->io->output, arg, MAX_MSG_LENGTH - strlen(client->io->output) - 1);
+        strncat(client->io->output, " is ", MAX_MSG_LENGTH - strlen(client->io->output) - 1);
+        strncat(client->io->output, full_path, MAX_MSG_LENGTH - strlen(client->io->output) - 1);
+        strncat(client->io->output, "\n", MAX_MSG_LENGTH - strlen(client->io->output) - 1);
+        return BUILTIN_DONE;
     }
 
-    dir = strtok_r(path_copy, ":", &saveptr);
-    while(dir != NULL)
-    {
-        char full_path[PATH_LEN];
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir, arg);
-        if(access(full_path, X_OK) == 0)
-        {
-            // Clear buffer
-            client->output[0] = '\0';
-
-            // Append in chunks
-            strncat(client->output, arg, MAX_MSG_LENGTH - strlen(client->output) - 1);
-            strncat(client->output, " is ", MAX_MSG_LENGTH - strlen(client->output) - 1);
-            strncat(client->output, full_path, MAX_MSG_LENGTH - strlen(client->output) - 1);
-            strncat(client->output, "\n", MAX_MSG_LENGTH - strlen(client->output) - 1);
-
-            free(path_copy);
-            return;
-        }
-        dir = strtok_r(NULL, ":", &saveptr);
-    }
+    snprintf(client->io->output, MAX_MSG_LENGTH, "%s not found\n", arg);
+    client->status = EXIT_FAILURE;
 
-    snprintf(client->output, MAX_MSG_LENGTH, "%s not found\n", arg);
-    free(path_copy);
+    return BUILTIN_DONE;
 }
 
 /*
@@ -152,8 +305,12 @@ void process_type(client_info *client)
 
     @param
     client: Contains client input and holds the output message
+    server_state: The server owning the session (unused)
+
+    @return
+    BUILTIN_DONE
 */
-void process_meow(client_info *client)
+int process_meow(client_info *client, server_data *server_state)
 {
     // Output string buffer
     char buffer[MAX_MSG_LENGTH] = "meow";
@@ -199,5 +356,78 @@ void process_meow(client_info *client)
     }
 
     strncat(buffer, "\n", MAX_MSG_LENGTH - strlen(buffer) - 1);
-    snprintf(client->output, MAX_MSG_LENGTH, "%s", buffer);
+    snprintf(client->io->output, MAX_MSG_LENGTH, "%s", buffer);
+
+    return BUILTIN_DONE;
+}
+
+/*
+    Reports the metrics of every reactor in the Prometheus text format.
+
+    @param
+    client: Holds the output message
+    server_state: The server owning the session
+
+    @return
+    BUILTIN_DONE
+*/
+int process_stats(client_info *client, server_data *server_state)
+{
+    server_metrics total;
+
+    metrics_collect(server_state->reactors, server_state->reactor_count, &total);
+    if(metrics_format(&total, client->io->output, OUTPUT_CHUNK) == -1)
+    {
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Metrics do not fit in one reply\n");
+        client->status = EXIT_FAILURE;
+    }
+
+    return BUILTIN_DONE;
+}
+
+#pragma GCC diagnostic pop
+
+/*
+    Finds the absolute path of an open directory.
+
+    @param
+    dir_fd: The directory
+    buffer: Receives the NUL-terminated path
+    size: Capacity of buffer
+
+    @return
+    0 on success, -1 on failure
+*/
+static int directory_path(int dir_fd, char *buffer, size_t size)
+{
+#if defined(__linux__)
+    char    link[PROC_FD_PATH_LEN];
+    ssize_t length;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    length = readlink(link, buffer, size - 1);
+    if(length == -1)
+    {
+        return -1;
+    }
+
+    buffer[length] = '\0';
+    return 0;
+#elif defined(F_GETPATH)
+    char path[PATH_MAX];
+
+    if(fcntl(dir_fd, F_GETPATH, path) == -1)
+    {
+        return -1;
+    }
+
+    snprintf(buffer, size, "%s", path);
+    return 0;
+#else
+    (void)dir_fd;
+    (void)buffer;
+    (void)size;
+    errno = ENOTSUP;
+    return -1;
+#endif
 }
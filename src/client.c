@@ -3,95 +3,97 @@
 
 int main(int argc, char *argv[])
 {
-    char input[MAX_INPUT];       // Buffer to store user input
-    char response[MAX_INPUT];    // Buffer for server response
-
     char                   *address;
     char                   *port_str;
     in_port_t               port;
     int                     sockfd;
     struct sockaddr_storage addr;
-
-    address  = NULL;
-    port_str = NULL;
+    client_state            state;
+    const char             *script_path;
+    bool                    batch;
+    bool                    stop_on_failure;
+    int                     exit_code;
+
+    const program_option options[] = {
+        {'b', NULL,   "Run commands from stdin without a prompt, exiting with the first failed status", NULL,         &batch          },
+        {'f', "file", "Run the commands in a file, as -b does for stdin",                                &script_path, NULL            },
+        {'e', NULL,   "Wait for each command to finish and stop at the first failure",                   NULL,         &stop_on_failure},
+    };
+
+    address         = NULL;
+    port_str        = NULL;
+    script_path     = NULL;
+    batch           = false;
+    stop_on_failure = false;
 
     // Set up network socket
-    parse_arguments(argc, argv, &address, &port_str);
+    parse_arguments(argc, argv, options, sizeof(options) / sizeof(options[0]), &address, &port_str);
     handle_arguments(argv[0], address, port_str, &port);
-    convert_address(address, &addr);
-    sockfd = socket_create(addr.ss_family, SOCK_STREAM, 0);
-
-    // printf("[DEBUG] Attempting to connect to server...\n");
-    socket_connect(sockfd, &addr, port);
-    // printf("[DEBUG] Successfully connected to server.\n");
 
-    setup_signal_handler();
+    memset(&state, 0, sizeof(state));
+    state.input_fd        = STDIN_FILENO;
+    state.input_open      = true;
+    state.batch           = batch || script_path != NULL;
+    state.stop_on_failure = stop_on_failure;
+    state.window          = state.batch ? BATCH_IN_FLIGHT : MAX_IN_FLIGHT;
 
-    while(!(exit_flag))
+    // Nothing may be sent ahead of a command that could still fail
+    if(stop_on_failure)
     {
-        ssize_t len;
-        ssize_t bytes_read;
-        ssize_t bytes_written;
-
-        // Display the shell prompt
-        printf("shellkitty$ ");
-        fflush(stdout);
-
-        len = read(STDIN_FILENO, input, MAX_INPUT - 1);
-        if(len <= 0)
-        {
-            if(len < 0 && errno == EINTR)
-            {
-                // Interrupted by signal
-                continue;
-            }
-
-            perror("Read error or EOF");
-            break;
-        }
+        state.window = 1;
+    }
 
-        // Remove trailing newline character safely
-        if(input[len - 1] == '\n')
+    if(script_path != NULL)
+    {
+        state.input_fd = open(script_path, O_RDONLY | O_CLOEXEC);
+        if(state.input_fd == -1)
         {
-            input[len - 1] = '\0';
-            len--;
+            perror(script_path);
+            return EXIT_FAILURE;
         }
+    }
 
-        // Ignore empty input
-        if(len == 0)
-        {
-            continue;
-        }
+    convert_address(address, &addr);
+    sockfd = socket_create(addr.ss_family, SOCK_STREAM, 0);
 
-        // **Send user input to server**
+    // printf("[DEBUG] Attempting to connect to server...\n");
+    socket_connect(sockfd, &addr, port);
+    // printf("[DEBUG] Successfully connected to server.\n");
 
-        bytes_written = write(sockfd, input, (size_t)len);
-        if(bytes_written == -1)
-        {
-            perror("Error sending command to server");
-            break;
-        }
+    setup_signal_handler();
 
-        // **Receive and print the response from the server**
-        bytes_read = read(sockfd, response, sizeof(response) - 1);
+    exit_code    = EXIT_FAILURE;
+    state.sockfd = sockfd;
+    if(handshake(sockfd) == -1)
+    {
+        goto cleanup;
+    }
 
-        if(bytes_read == 0)
-        {
-            printf("Server disconnected. Exiting...\n");
-            break;
-        }
-        if(bytes_read < 0)
-        {
-            printf("Read failed");
-            break;
-        }
+    state.input       = (char *)malloc(INPUT_CHUNK);
+    state.send_buffer = (uint8_t *)malloc(SEND_BUFFER_SIZE);
+    state.recv_buffer = (uint8_t *)malloc(RECV_BUFFER_SIZE);
+    if(state.input == NULL || state.send_buffer == NULL || state.recv_buffer == NULL)
+    {
+        perror("Unable to allocate client buffers");
+        goto cleanup;
+    }
 
-        response[bytes_read] = '\0';    // Null-terminate response
-        printf("%s\n", response);
+    // A batch ends unsuccessfully if it was cut short or any of its commands failed
+    if(run_session(&state) == 0 || !state.batch)
+    {
+        exit_code = state.batch ? state.first_failure : EXIT_SUCCESS;
     }
 
+cleanup:
+    free(state.input);
+    free(state.send_buffer);
+    free(state.recv_buffer);
+    if(state.input_fd != STDIN_FILENO)
+    {
+        close(state.input_fd);
+    }
     close(sockfd);
-    return EXIT_SUCCESS;
+    return exit_code;
 }
 
 /*
@@ -151,6 +153,502 @@ static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t
     // printf("Connected to: %s:%u\n", addr_str, port);
 }
 
+/*
+    Exchanges HELLO frames with the server and checks that both sides speak the
+    same protocol version.
+
+    @param
+    sockfd: The connected socket
+
+    @return
+    0 on success, -1 on failure
+*/
+static int handshake(int sockfd)
+{
+    uint8_t      version[sizeof(uint32_t)];
+    frame_header header;
+
+    frame_encode_u32(version, PROTOCOL_VERSION);
+    if(frame_send(sockfd, FRAME_HELLO, 0, 0, 0, version, sizeof(version)) == -1)
+    {
+        perror("Error sending handshake to server");
+        return -1;
+    }
+
+    if(frame_recv(sockfd, &header, version, sizeof(version)) == -1 || header.type != FRAME_HELLO || header.length != sizeof(version))
+    {
+        fprintf(stderr, "Server did not complete the handshake\n");
+        return -1;
+    }
+
+    if(frame_decode_u32(version) != PROTOCOL_VERSION)
+    {
+        fprintf(stderr, "Server speaks protocol version %u, expected %u\n", frame_decode_u32(version), PROTOCOL_VERSION);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Runs the connection until the input is exhausted and every command sent has
+    been answered. Commands are sent as soon as they are read, without waiting
+    for earlier replies, and replies are printed as they arrive.
+
+    @param
+    state: The client connection state
+
+    @return
+    0 once everything has been answered, -1 if the session was cut short
+*/
+static int run_session(client_state *state)
+{
+    while(!exit_flag && (state->input_open || state->input_pos < state->input_len || state->in_flight > 0 || state->send_pos < state->send_len))
+    {
+        struct pollfd fds[2];
+        nfds_t        nfds;
+
+        // Display the shell prompt once everything read so far has been answered
+        if(!state->batch && !state->prompted && state->input_open && state->in_flight == 0 && state->line_len == 0 && state->input_pos == state->input_len)
+        {
+            printf("shellkitty$ ");
+            fflush(stdout);
+            state->prompted = true;
+        }
+
+        fds[0].fd     = state->sockfd;
+        fds[0].events = POLLIN;
+        if(state->send_pos < state->send_len)
+        {
+            fds[0].events |= POLLOUT;
+        }
+        nfds = 1;
+
+        // More input is only read once the last read has been turned into requests
+        if(state->input_open && state->input_pos == state->input_len && state->in_flight < state->window)
+        {
+            fds[1].fd     = state->input_fd;
+            fds[1].events = POLLIN;
+            nfds          = 2;
+        }
+
+        if(poll(fds, nfds, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                // Interrupted by signal
+                continue;
+            }
+
+            perror("poll");
+            return -1;
+        }
+
+        // **Receive and print responses from the server**
+        if(fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            if(receive_frames(state) == -1)
+            {
+                return -1;
+            }
+        }
+
+        // **Send user input to server**
+        if(nfds == 2 && fds[1].revents != 0 && read_input(state) == -1)
+        {
+            return -1;
+        }
+
+        // Answers free up the window for lines that are already read
+        if(send_lines(state) == -1 || flush_requests(state) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return exit_flag ? -1 : 0;
+}
+
+/*
+    Reads the next chunk of commands. Reading stops at EOF, and a final line
+    without a newline is sent as it is.
+
+    @param
+    state: The client connection state
+
+    @return
+    0 on success, -1 on a read error
+*/
+static int read_input(client_state *state)
+{
+    ssize_t len;
+
+    len = read(state->input_fd, state->input, INPUT_CHUNK);
+    if(len < 0 && errno == EINTR)
+    {
+        return 0;
+    }
+
+    if(len < 0)
+    {
+        perror("Read error");
+        return -1;
+    }
+
+    state->prompted = false;
+    if(len == 0)
+    {
+        state->input_open = false;
+        if(state->line_len > 0)
+        {
+            queue_line(state);
+        }
+        return 0;
+    }
+
+    state->input_pos = 0;
+    state->input_len = (size_t)len;
+
+    return 0;
+}
+
+/*
+    Splits the input read so far into lines and queues each one as a COMMAND
+    frame, stopping while the window of unanswered commands is full or the send
+    buffer can't take another frame.
+
+    @param
+    state: The client connection state
+
+    @return
+    0 on success, -1 if the server could not be written to
+*/
+static int send_lines(client_state *state)
+{
+    while(state->input_pos < state->input_len && state->in_flight < state->window)
+    {
+        char c;
+
+        if(SEND_BUFFER_SIZE - state->send_len < FRAME_HEADER_SIZE + sizeof(state->line))
+        {
+            if(flush_requests(state) == -1)
+            {
+                return -1;
+            }
+
+            if(SEND_BUFFER_SIZE - state->send_len < FRAME_HEADER_SIZE + sizeof(state->line))
+            {
+                break;
+            }
+        }
+
+        // Overlong lines are sent in pieces, like a single read used to
+        c = state->input[state->input_pos++];
+        if(c != '\n' && state->line_len < sizeof(state->line))
+        {
+            state->line[state->line_len++] = c;
+            if(state->line_len < sizeof(state->line))
+            {
+                continue;
+            }
+        }
+
+        queue_line(state);
+    }
+
+    return 0;
+}
+
+/*
+    Appends the assembled line to the send buffer as a COMMAND frame. Empty lines
+    are dropped, and a trailing '&' marks the command as safe to run concurrently
+    with the ones before it.
+
+    @param
+    state: The client connection state
+*/
+static void queue_line(client_state *state)
+{
+    size_t  length;
+    uint8_t flags;
+
+    length          = state->line_len;
+    state->line_len = 0;
+    flags           = 0;
+
+    while(length > 0 && (state->line[length - 1] == ' ' || state->line[length - 1] == '\r'))
+    {
+        length--;
+    }
+
+    if(length > 0 && state->line[length - 1] == '&')
+    {
+        flags = FRAME_FLAG_CONCURRENT;
+        length--;
+        while(length > 0 && state->line[length - 1] == ' ')
+        {
+            length--;
+        }
+    }
+
+    // Ignore empty input
+    if(length == 0)
+    {
+        return;
+    }
+
+    state->next_request_id++;
+    frame_encode_header(state->send_buffer + state->send_len, FRAME_COMMAND, flags, 0, state->next_request_id, (uint32_t)length);
+    memcpy(state->send_buffer + state->send_len + FRAME_HEADER_SIZE, state->line, length);
+    state->send_len += FRAME_HEADER_SIZE + length;
+    state->in_flight++;
+}
+
+/*
+    Writes as much of the send buffer as the socket takes without blocking, so
+    a slow server never stops the client from reading its replies.
+
+    @param
+    state: The client connection state
+
+    @return
+    0 on success, -1 if the server could not be written to
+*/
+static int flush_requests(client_state *state)
+{
+    while(state->send_pos < state->send_len)
+    {
+        ssize_t bytes_sent;
+
+        bytes_sent = send(state->sockfd, state->send_buffer + state->send_pos, state->send_len - state->send_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(bytes_sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN)
+            {
+                return 0;
+            }
+
+            perror("Error sending command to server");
+            return -1;
+        }
+
+        state->send_pos += (size_t)bytes_sent;
+    }
+
+    state->send_pos = 0;
+    state->send_len = 0;
+
+    return 0;
+}
+
+/*
+    Reads everything the server has sent so far and handles the complete frames
+    in it. A partial frame stays at the start of the buffer until the rest arrives.
+
+    @param
+    state: The client connection state
+
+    @return
+    0 on success, -1 if the connection failed
+*/
+static int receive_frames(client_state *state)
+{
+    while(true)
+    {
+        ssize_t bytes_read;
+
+        bytes_read = recv(state->sockfd, state->recv_buffer + state->recv_len, RECV_BUFFER_SIZE - state->recv_len, MSG_DONTWAIT);
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_read == -1 && errno == EAGAIN)
+        {
+            return 0;
+        }
+
+        if(bytes_read <= 0)
+        {
+            if(bytes_read == 0)
+            {
+                printf("Server disconnected. Exiting...\n");
+            }
+            else
+            {
+                perror("Read failed");
+            }
+            return -1;
+        }
+
+        state->recv_len += (size_t)bytes_read;
+        if(process_frames(state) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+/*
+    Prints the output of every complete frame in the receive buffer with a single
+    writev, then settles their STATUS frames. Output of pipelined requests is
+    written in the order the server sends it.
+
+    @param
+    state: The client connection state
+
+    @return
+    0 on success, -1 if a frame is malformed or the output can't be written
+*/
+static int process_frames(client_state *state)
+{
+    struct iovec iov[OUTPUT_IOV_MAX];
+    int32_t      statuses[OUTPUT_IOV_MAX];
+    int          iovcnt;
+    int          status_count;
+    int          i;
+    size_t       offset;
+
+    iovcnt       = 0;
+    status_count = 0;
+    offset       = 0;
+
+    while(state->recv_len - offset >= FRAME_HEADER_SIZE && iovcnt < OUTPUT_IOV_MAX && status_count < OUTPUT_IOV_MAX)
+    {
+        frame_header header;
+
+        frame_decode_header(state->recv_buffer + offset, &header);
+        if(header.length > FRAME_MAX_PAYLOAD)
+        {
+            fprintf(stderr, "Server sent an oversized frame\n");
+            return -1;
+        }
+
+        if(state->recv_len - offset < FRAME_HEADER_SIZE + header.length)
+        {
+            break;
+        }
+
+        if(header.type == FRAME_OUTPUT && header.length > 0)
+        {
+            iov[iovcnt].iov_base = state->recv_buffer + offset + FRAME_HEADER_SIZE;
+            iov[iovcnt].iov_len  = header.length;
+            iovcnt++;
+        }
+        else if(header.type == FRAME_STATUS && header.length == sizeof(uint32_t))
+        {
+            statuses[status_count++] = (int32_t)frame_decode_u32(state->recv_buffer + offset + FRAME_HEADER_SIZE);
+        }
+
+        offset += FRAME_HEADER_SIZE + header.length;
+    }
+
+    if(write_output(iov, iovcnt) == -1)
+    {
+        perror("Unable to write output");
+        return -1;
+    }
+
+    for(i = 0; i < status_count; i++)
+    {
+        record_status(state, statuses[i]);
+    }
+
+    // Keep the start of an incomplete frame for the next read
+    memmove(state->recv_buffer, state->recv_buffer + offset, state->recv_len - offset);
+    state->recv_len -= offset;
+
+    // Frames left over from a full iovec array are handled right away
+    if(iovcnt == OUTPUT_IOV_MAX || status_count == OUTPUT_IOV_MAX)
+    {
+        return process_frames(state);
+    }
+
+    return 0;
+}
+
+/*
+    Writes output payloads to stdout, retrying after short writes.
+
+    @param
+    iov: The payloads, advanced past whatever was written
+    iovcnt: Number of entries in iov
+
+    @return
+    0 on success, -1 on failure
+*/
+static int write_output(struct iovec *iov, int iovcnt)
+{
+    while(iovcnt > 0)
+    {
+        ssize_t written;
+
+        written = writev(STDOUT_FILENO, iov, iovcnt);
+        if(written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        // Skip past whatever was written
+        while(iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if(iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Settles the oldest unanswered command with the exit status the server sent.
+
+    @param
+    state: The client connection state
+    status: The command's exit status
+*/
+static void record_status(client_state *state, int32_t status)
+{
+    if(state->in_flight == 0)
+    {
+        return;
+    }
+
+    state->in_flight--;
+    state->prompted = false;
+    if(status == 0 || state->first_failure != 0)
+    {
+        return;
+    }
+
+    state->first_failure = status > 0 && status <= UINT8_MAX ? status : EXIT_FAILURE;
+
+    // Lines not yet sent are dropped
+    if(state->stop_on_failure)
+    {
+        state->input_open = false;
+        state->input_pos  = state->input_len;
+        state->line_len   = 0;
+    }
+}
+
 /*
     Sets up a signal handler for graceful shutdown on SIGINT.
 */
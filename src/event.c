@@ -0,0 +1,421 @@
+#include "event.h"
+
+static int create_wake_pipe(int fds[2]);
+
+/*
+    Creates the event backend and its ready list.
+
+    @param
+    loop: The event loop to initialise
+    capacity: The number of distinct tokens the ready list must hold
+
+    @return
+    0 on success, -1 on failure
+*/
+int event_loop_create(event_loop *loop, uint32_t capacity)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->wake_fds[0] = -1;
+    loop->wake_fds[1] = -1;
+
+    loop->ready    = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+    loop->queued   = (uint8_t *)calloc(capacity, sizeof(uint8_t));
+    loop->capacity = capacity;
+
+    if(loop->ready == NULL || loop->queued == NULL)
+    {
+        free(loop->ready);
+        free(loop->queued);
+        return -1;
+    }
+
+#if defined(__linux__)
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->fd == -1)
+    {
+        free(loop->ready);
+        free(loop->queued);
+        return -1;
+    }
+#else
+    loop->fd = -1;
+#endif
+
+    // The wake pipe is watched like any other descriptor
+    if(create_wake_pipe(loop->wake_fds) == -1 || event_add(loop, loop->wake_fds[0], EVENT_WAKE, 0) == -1)
+    {
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Releases the event backend and its ready list.
+
+    @param
+    loop: The event loop to destroy
+*/
+void event_loop_destroy(event_loop *loop)
+{
+    if(loop->fd >= 0)
+    {
+        close(loop->fd);
+    }
+
+    if(loop->wake_fds[0] >= 0)
+    {
+        close(loop->wake_fds[0]);
+        close(loop->wake_fds[1]);
+    }
+
+#if !defined(__linux__)
+    free(loop->pollfds);
+    free(loop->records);
+#endif
+    free(loop->ready);
+    free(loop->queued);
+    memset(loop, 0, sizeof(*loop));
+    loop->fd          = -1;
+    loop->wake_fds[0] = -1;
+    loop->wake_fds[1] = -1;
+}
+
+/*
+    Registers a file descriptor once for edge-triggered read notifications.
+
+    @param
+    loop: The event loop
+    fd: The file descriptor to watch
+    kind: What the descriptor represents (listener, client, ...)
+    token: Caller-defined identifier returned with each event
+
+    @return
+    0 on success, -1 on failure
+*/
+int event_add(event_loop *loop, int fd, uint32_t kind, uint32_t token)
+{
+#if defined(__linux__)
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = ((uint64_t)kind << 32) | token;
+
+    return epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev);
+#else
+    if(loop->nfds == loop->max_fds)
+    {
+        nfds_t         max_fds;
+        struct pollfd *pollfds;
+        event_record  *records;
+
+        max_fds = loop->max_fds == 0 ? EVENT_BATCH : loop->max_fds * 2;
+        pollfds = (struct pollfd *)realloc(loop->pollfds, max_fds * sizeof(struct pollfd));
+        if(pollfds == NULL)
+        {
+            return -1;
+        }
+        loop->pollfds = pollfds;
+
+        records = (event_record *)realloc(loop->records, max_fds * sizeof(event_record));
+        if(records == NULL)
+        {
+            return -1;
+        }
+        loop->records = records;
+        loop->max_fds = max_fds;
+    }
+
+    loop->pollfds[loop->nfds].fd      = fd;
+    loop->pollfds[loop->nfds].events  = POLLIN;
+    loop->pollfds[loop->nfds].revents = 0;
+    loop->records[loop->nfds].kind    = kind;
+    loop->records[loop->nfds].token   = token;
+    loop->records[loop->nfds].events  = 0;
+    loop->nfds++;
+
+    return 0;
+#endif
+}
+
+/*
+    Removes a file descriptor from the event loop.
+
+    @param
+    loop: The event loop
+    fd: The file descriptor to stop watching
+
+    @return
+    0 on success, -1 on failure
+*/
+int event_del(event_loop *loop, int fd)
+{
+#if defined(__linux__)
+    return epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    nfds_t i;
+
+    for(i = 0; i < loop->nfds; i++)
+    {
+        if(loop->pollfds[i].fd == fd)
+        {
+            loop->nfds--;
+            loop->pollfds[i] = loop->pollfds[loop->nfds];
+            loop->records[i] = loop->records[loop->nfds];
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+#endif
+}
+
+/*
+    Starts or stops notifications that a registered descriptor has room to
+    write. Enabling them reports a descriptor that is already writable at once.
+
+    @param
+    loop: The event loop
+    fd: The registered file descriptor
+    kind: What the descriptor represents, as it was registered
+    token: The identifier it was registered with
+    enable: true to be told when the descriptor is writable
+
+    @return
+    0 on success, -1 on failure
+*/
+int event_watch_output(event_loop *loop, int fd, uint32_t kind, uint32_t token, bool enable)
+{
+#if defined(__linux__)
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLET | (enable ? EPOLLOUT : 0);
+    ev.data.u64 = ((uint64_t)kind << 32) | token;
+
+    return epoll_ctl(loop->fd, EPOLL_CTL_MOD, fd, &ev);
+#else
+    nfds_t i;
+
+    (void)kind;
+    (void)token;
+    for(i = 0; i < loop->nfds; i++)
+    {
+        if(loop->pollfds[i].fd == fd)
+        {
+            loop->pollfds[i].events = (short)(POLLIN | (enable ? POLLOUT : 0));
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+#endif
+}
+
+/*
+    Waits for readiness on any registered descriptor.
+
+    @param
+    loop: The event loop
+    records: Output array for the events that fired
+    max_records: Capacity of the records array
+    timeout_ms: How long to wait, -1 to wait forever
+
+    @return
+    The number of records filled in, 0 on timeout, -1 on error
+*/
+int event_wait(event_loop *loop, event_record *records, int max_records, int timeout_ms)
+{
+#if defined(__linux__)
+    struct epoll_event events[EVENT_BATCH];
+    int                count;
+    int                i;
+
+    if(max_records > EVENT_BATCH)
+    {
+        max_records = EVENT_BATCH;
+    }
+
+    count = epoll_wait(loop->fd, events, max_records, timeout_ms);
+
+    for(i = 0; i < count; i++)
+    {
+        records[i].kind   = (uint32_t)(events[i].data.u64 >> 32);
+        records[i].token  = (uint32_t)(events[i].data.u64 & UINT32_MAX);
+        records[i].events = 0;
+
+        if(events[i].events & EPOLLIN)
+        {
+            records[i].events |= EVENT_IN;
+        }
+        if(events[i].events & EPOLLOUT)
+        {
+            records[i].events |= EVENT_OUT;
+        }
+        if(events[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+        {
+            records[i].events |= EVENT_HUP;
+        }
+    }
+
+    return count;
+#else
+    int    count;
+    nfds_t i;
+
+    count = poll(loop->pollfds, loop->nfds, timeout_ms);
+    if(count <= 0)
+    {
+        return count;
+    }
+
+    count = 0;
+    for(i = 0; i < loop->nfds && count < max_records; i++)
+    {
+        short revents = loop->pollfds[i].revents;
+
+        if(revents == 0)
+        {
+            continue;
+        }
+
+        records[count]        = loop->records[i];
+        records[count].events = 0;
+        if(revents & POLLIN)
+        {
+            records[count].events |= EVENT_IN;
+        }
+        if(revents & POLLOUT)
+        {
+            records[count].events |= EVENT_OUT;
+        }
+        if(revents & (POLLHUP | POLLERR))
+        {
+            records[count].events |= EVENT_HUP;
+        }
+        count++;
+    }
+
+    return count;
+#endif
+}
+
+/*
+    Appends a token to the ready list unless it is already queued.
+
+    @param
+    loop: The event loop
+    token: The token that has pending work
+*/
+void event_ready_push(event_loop *loop, uint32_t token)
+{
+    if(token >= loop->capacity || loop->queued[token])
+    {
+        return;
+    }
+
+    loop->ready[(loop->head + loop->count) % loop->capacity] = token;
+    loop->queued[token]                                       = 1;
+    loop->count++;
+}
+
+/*
+    Removes the oldest token from the ready list.
+
+    @param
+    loop: The event loop
+    token: Receives the token
+
+    @return
+    true if a token was available, false if the ready list is empty
+*/
+bool event_ready_pop(event_loop *loop, uint32_t *token)
+{
+    if(loop->count == 0)
+    {
+        return false;
+    }
+
+    *token               = loop->ready[loop->head];
+    loop->queued[*token] = 0;
+    loop->head           = (loop->head + 1) % loop->capacity;
+    loop->count--;
+
+    return true;
+}
+
+/*
+    Interrupts a wait on the event loop. Safe to call from any thread.
+
+    @param
+    loop: The event loop to wake
+*/
+void event_wake(event_loop *loop)
+{
+    const char byte = 0;
+    ssize_t    bytes_written;
+
+    // EAGAIN is fine, a full pipe already guarantees a wake-up
+    do
+    {
+        bytes_written = write(loop->wake_fds[1], &byte, sizeof(byte));
+    } while(bytes_written == -1 && errno == EINTR);
+}
+
+/*
+    Consumes pending wake-ups once the loop has noticed them.
+
+    @param
+    loop: The event loop that was woken
+*/
+void event_wake_drain(event_loop *loop)
+{
+    char    buffer[EVENT_BATCH];
+    ssize_t bytes_read;
+
+    do
+    {
+        bytes_read = read(loop->wake_fds[0], buffer, sizeof(buffer));
+    } while(bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+}
+
+/*
+    Creates a non-blocking, close-on-exec pipe for wake-ups.
+
+    @param
+    fds: Receives the read and write ends
+
+    @return
+    0 on success, -1 on failure
+*/
+static int create_wake_pipe(int fds[2])
+{
+#if defined(__linux__)
+    return pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+#else
+    int i;
+
+    if(pipe(fds) == -1)    // NOLINT(android-cloexec-pipe)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < 2; i++)
+    {
+        if(fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1 || fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK) == -1)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            fds[0] = -1;
+            fds[1] = -1;
+            return -1;
+        }
+    }
+
+    return 0;
+#endif
+}
@@ -0,0 +1,1829 @@
+#include "fastpath.h"
+
+#define DECIMAL 10
+#define PERMISSION_BITS 07777
+#define MODE_STRING_LEN 11
+#define FAST_PATH_DATE_LEN 32
+#define FAST_PATH_ZONE_LEN 8
+
+// Which entries ls shows
+enum ls_show
+{
+    SHOW_VISIBLE,        // Names not starting with '.'
+    SHOW_ALMOST_ALL,     // Everything except . and ..
+    SHOW_ALL             // Everything
+};
+
+#if defined(__linux__)
+// One record as returned by getdents64(2)
+struct kernel_dirent
+{
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+#endif
+
+// Command output collected in the session's output buffer and sent in OUTPUT frames
+typedef struct
+{
+    client_info    *client;
+    outbox         *outbound;    // The connection's queue, frames the socket can't take wait there
+    server_metrics *metrics;     // Counts the bytes sent
+    size_t          length;     // Bytes buffered in client->io->output
+    bool            failed;     // The connection broke, nothing more is sent
+} fast_output;
+
+// Names read from directories, stored back to back in one arena
+typedef struct
+{
+    char        *arena;
+    size_t       arena_used;
+    size_t       arena_size;
+    size_t      *offsets;
+    const char **names;    // Filled in by name_list_resolve once reading is done
+    size_t       count;
+    size_t       capacity;
+} name_list;
+
+// What head prints of one file
+typedef struct
+{
+    uintmax_t lines;     // Line limit, or 0 in byte mode
+    size_t    length;    // Bytes of the file to print
+} head_scan;
+
+// Counts wc collects for one file
+typedef struct
+{
+    uintmax_t lines;
+    uintmax_t words;
+    bool      in_word;
+    bool      unsure;    // Holds bytes whose word semantics depend on the locale
+} wc_scan;
+
+// Everything stat prints about one operand
+typedef struct
+{
+    struct stat     st;
+    struct timespec birth;
+    bool            has_birth;
+    char            target[PATH_MAX];    // Symbolic link target, empty otherwise
+} file_status;
+
+typedef void (*mapping_scanner)(const uint8_t *data, size_t length, void *context);
+
+static int         split_args(char *args, char **argv);
+static int         open_operand(const client_info *client, const char *name, struct stat *st);
+static void        close_operands(const int *fds, int count);
+static bool        parse_count(const char *text, uintmax_t *value);
+static bool        printable_name(const char *name);
+static int         compare_names(const void *a, const void *b);
+static int         name_list_add(name_list *list, const char *name);
+static int         name_list_resolve(name_list *list);
+static void        name_list_free(name_list *list);
+static int         read_directory(name_list *list, int dir_fd, enum ls_show show);
+static bool        entry_visible(const char *name, enum ls_show show);
+static int         scan_mapping(int fd, size_t length, mapping_scanner scanner, void *context);
+static void        scan_head(const uint8_t *data, size_t length, void *context);
+static void        scan_wc(const uint8_t *data, size_t length, void *context);
+static void        sigbus_handler(int signum);
+static int         collect_status(const client_info *client, const char *name, bool follow, file_status *status);
+static void        write_status(fast_output *out, const char *name, const file_status *status);
+static int         write_status_format(fast_output *out, const char *name, const file_status *status, const char *format);
+static const char *file_type(const struct stat *st);
+static void        mode_string(mode_t mode, char *buffer);
+static void        format_time(const struct timespec *time, char *buffer, size_t size);
+static void        user_name(uid_t uid, char *buffer, size_t size);
+static void        group_name(gid_t gid, char *buffer, size_t size);
+static void        output_init(fast_output *out, client_info *client, server_data *server_state);
+static void        output_bytes(fast_output *out, const void *data, size_t size);
+static void        output_format(fast_output *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void        output_file(fast_output *out, int fd, size_t length);
+static void        output_flush(fast_output *out);
+static void        output_abort(fast_output *out);
+static void        output_finish(fast_output *out);
+
+// Collation of the environment's locale, so ls sorts like the external ls would
+static locale_t collation = (locale_t)0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Where a SIGBUS raised while reading a mapped file returns to
+static _Thread_local sigjmp_buf *mapping_fault = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+    Prepares the fast paths: loads the collation order of the environment's
+    locale and installs the handler that turns a mapped file shrinking under
+    us into a fallback instead of a crash. Call before any reactor runs.
+
+    @return
+    0 on success, -1 on failure
+*/
+int fast_path_init(void)
+{
+    struct sigaction sa;
+
+    collation = newlocale(LC_COLLATE_MASK, "", (locale_t)0);
+    tzset();
+
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigbus_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sa.sa_flags = SA_NODEFER;
+
+    return sigaction(SIGBUS, &sa, NULL);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/*
+    Lists directories in-process with getdents64(2). Supports -a, -A and -1
+    with the one-name-per-line layout ls uses when writing to a pipe.
+
+    @param
+    client: Contains client input and holds the output
+    server_state: The server owning the session
+
+    @return
+    BUILTIN_DONE, or BUILTIN_EXTERNAL for options, errors or directory sizes the fast path doesn't handle
+*/
+int process_ls(client_info *client, server_data *server_state)
+{
+    char         args[MAX_ARGS_LENGTH];
+    char        *argv[FAST_PATH_MAX_ARGS];
+    const char  *files[FAST_PATH_MAX_OPERANDS];
+    const char  *dirs[FAST_PATH_MAX_OPERANDS];
+    name_list    listings[FAST_PATH_MAX_OPERANDS];
+    fast_output  out;
+    enum ls_show show;
+    bool         options_done;
+    int          argc;
+    int          operand_count;
+    int          file_count;
+    int          dir_count;
+    int          listed;
+    int          result;
+    int          i;
+
+    snprintf(args, sizeof(args), "%s", client->io->args);
+    argc = split_args(args, argv);
+    if(argc == -1)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    show          = SHOW_VISIBLE;
+    options_done  = false;
+    operand_count = 0;
+    file_count    = 0;
+    dir_count     = 0;
+
+    for(i = 0; i < argc; i++)
+    {
+        struct stat st;
+        const char *flag;
+
+        if(!options_done && strcmp(argv[i], "--") == 0)
+        {
+            options_done = true;
+            continue;
+        }
+
+        if(!options_done && argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            for(flag = argv[i] + 1; *flag != '\0'; flag++)
+            {
+                if(*flag == 'a')
+                {
+                    show = SHOW_ALL;
+                }
+                else if(*flag == 'A')
+                {
+                    show = SHOW_ALMOST_ALL;
+                }
+                else if(*flag != '1')
+                {
+                    return BUILTIN_EXTERNAL;
+                }
+            }
+            continue;
+        }
+
+        // Error messages and their ordering are left to the real ls
+        if(operand_count == FAST_PATH_MAX_OPERANDS || fstatat(client->cwd_fd, argv[i], &st, 0) == -1)
+        {
+            return BUILTIN_EXTERNAL;
+        }
+
+        operand_count++;
+        if(S_ISDIR(st.st_mode))
+        {
+            dirs[dir_count++] = argv[i];
+        }
+        else
+        {
+            files[file_count++] = argv[i];
+        }
+    }
+
+    if(operand_count == 0)
+    {
+        dirs[dir_count++] = ".";
+    }
+
+    qsort(files, (size_t)file_count, sizeof(files[0]), compare_names);
+    qsort(dirs, (size_t)dir_count, sizeof(dirs[0]), compare_names);
+
+    // Read everything first so a failure can still fall back before any output
+    result = BUILTIN_DONE;
+    memset(listings, 0, sizeof(listings));
+    for(listed = 0; listed < dir_count; listed++)
+    {
+        int dir_fd;
+
+        dir_fd = openat(client->cwd_fd, dirs[listed], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir_fd == -1)
+        {
+            result = BUILTIN_EXTERNAL;
+            break;
+        }
+
+        if(read_directory(&listings[listed], dir_fd, show) == -1 || name_list_resolve(&listings[listed]) == -1)
+        {
+            close(dir_fd);
+            name_list_free(&listings[listed]);
+            result = BUILTIN_EXTERNAL;
+            break;
+        }
+
+        close(dir_fd);
+        qsort(listings[listed].names, listings[listed].count, sizeof(listings[listed].names[0]), compare_names);
+    }
+
+    if(result == BUILTIN_DONE)
+    {
+        output_init(&out, client, server_state);
+
+        for(i = 0; i < file_count; i++)
+        {
+            output_bytes(&out, files[i], strlen(files[i]));
+            output_bytes(&out, "\n", 1);
+        }
+
+        for(i = 0; i < dir_count; i++)
+        {
+            size_t entry;
+
+            if(i > 0 || file_count > 0)
+            {
+                output_bytes(&out, "\n", 1);
+            }
+
+            if(operand_count > 1)
+            {
+                output_format(&out, "%s:\n", dirs[i]);
+            }
+
+            for(entry = 0; entry < listings[i].count; entry++)
+            {
+                output_bytes(&out, listings[i].names[entry], strlen(listings[i].names[entry]));
+                output_bytes(&out, "\n", 1);
+            }
+        }
+
+        output_finish(&out);
+    }
+
+    for(i = 0; i < listed; i++)
+    {
+        name_list_free(&listings[i]);
+    }
+
+    return result;
+}
+
+/*
+    Concatenates regular files to the client with sendfile(2).
+
+    @param
+    client: Contains client input and holds the output
+    server_state: The server owning the session
+
+    @return
+    BUILTIN_DONE, or BUILTIN_EXTERNAL for options, standard input, special files or large inputs
+*/
+int process_cat(client_info *client, server_data *server_state)
+{
+    char        args[MAX_ARGS_LENGTH];
+    char       *argv[FAST_PATH_MAX_ARGS];
+    int         fds[FAST_PATH_MAX_OPERANDS];
+    size_t      sizes[FAST_PATH_MAX_OPERANDS];
+    fast_output out;
+    size_t      total;
+    int         argc;
+    int         i;
+
+    snprintf(args, sizeof(args), "%s", client->io->args);
+    argc = split_args(args, argv);
+    if(argc <= 0 || argc > FAST_PATH_MAX_OPERANDS)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    total = 0;
+    for(i = 0; i < argc; i++)
+    {
+        struct stat st;
+
+        fds[i] = argv[i][0] == '-' ? -1 : open_operand(client, argv[i], &st);
+        if(fds[i] == -1 || (uintmax_t)st.st_size > FAST_PATH_MAX_INPUT - total)
+        {
+            close_operands(fds, fds[i] == -1 ? i : i + 1);
+            return BUILTIN_EXTERNAL;
+        }
+
+        sizes[i] = (size_t)st.st_size;
+        total += sizes[i];
+    }
+
+    output_init(&out, client, server_state);
+    for(i = 0; i < argc; i++)
+    {
+        output_file(&out, fds[i], sizes[i]);
+    }
+    output_finish(&out);
+    close_operands(fds, argc);
+
+    return BUILTIN_DONE;
+}
+
+/*
+    Prints the start of regular files. The cut-off is found by scanning a
+    mapping of the file and the bytes are sent with sendfile(2). Supports
+    -n N, -c N, the obsolete -N form, -q and -v.
+
+    @param
+    client: Contains client input and holds the output
+    server_state: The server owning the session
+
+    @return
+    BUILTIN_DONE, or BUILTIN_EXTERNAL for other options, standard input, special files or large outputs
+*/
+int process_head(client_info *client, server_data *server_state)
+{
+    char        args[MAX_ARGS_LENGTH];
+    char       *argv[FAST_PATH_MAX_ARGS];
+    const char *names[FAST_PATH_MAX_OPERANDS];
+    int         fds[FAST_PATH_MAX_OPERANDS];
+    head_scan   scans[FAST_PATH_MAX_OPERANDS];
+    fast_output out;
+    uintmax_t   count;
+    bool        byte_mode;
+    bool        quiet;
+    bool        verbose;
+    bool        options_done;
+    size_t      total;
+    int         argc;
+    int         file_count;
+    int         i;
+
+    snprintf(args, sizeof(args), "%s", client->io->args);
+    argc = split_args(args, argv);
+    if(argc == -1)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    count        = HEAD_DEFAULT_LINES;
+    byte_mode    = false;
+    quiet        = false;
+    verbose      = false;
+    options_done = false;
+    file_count   = 0;
+
+    for(i = 0; i < argc; i++)
+    {
+        const char *arg;
+
+        arg = argv[i];
+        if(!options_done && strcmp(arg, "--") == 0)
+        {
+            options_done = true;
+        }
+        else if(!options_done && (strcmp(arg, "-n") == 0 || strcmp(arg, "-c") == 0))
+        {
+            byte_mode = arg[1] == 'c';
+            if(i + 1 == argc || !parse_count(argv[++i], &count))
+            {
+                return BUILTIN_EXTERNAL;
+            }
+        }
+        else if(!options_done && (strncmp(arg, "-n", 2) == 0 || strncmp(arg, "-c", 2) == 0))
+        {
+            byte_mode = arg[1] == 'c';
+            if(!parse_count(arg + 2, &count))
+            {
+                return BUILTIN_EXTERNAL;
+            }
+        }
+        else if(!options_done && i == 0 && arg[0] == '-' && parse_count(arg + 1, &count))
+        {
+            byte_mode = false;
+        }
+        else if(!options_done && (strcmp(arg, "-q") == 0 || strcmp(arg, "-v") == 0))
+        {
+            quiet   = arg[1] == 'q';
+            verbose = arg[1] == 'v';
+        }
+        else if(!options_done && arg[0] == '-')
+        {
+            return BUILTIN_EXTERNAL;
+        }
+        else if(file_count < FAST_PATH_MAX_OPERANDS)
+        {
+            names[file_count++] = arg;
+        }
+        else
+        {
+            return BUILTIN_EXTERNAL;
+        }
+    }
+
+    if(file_count == 0)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    // Work out every cut-off before anything is sent
+    total = 0;
+    for(i = 0; i < file_count; i++)
+    {
+        struct stat st;
+
+        fds[i] = open_operand(client, names[i], &st);
+        if(fds[i] == -1)
+        {
+            close_operands(fds, i);
+            return BUILTIN_EXTERNAL;
+        }
+
+        scans[i].lines  = byte_mode ? 0 : count;
+        scans[i].length = (size_t)st.st_size;
+        if(byte_mode && count < scans[i].length)
+        {
+            scans[i].length = (size_t)count;
+        }
+        else if(!byte_mode && scans[i].length > 0 && scan_mapping(fds[i], scans[i].length, scan_head, &scans[i]) == -1)
+        {
+            close_operands(fds, i + 1);
+            return BUILTIN_EXTERNAL;
+        }
+
+        if(scans[i].length > FAST_PATH_MAX_INPUT - total)
+        {
+            close_operands(fds, i + 1);
+            return BUILTIN_EXTERNAL;
+        }
+        total += scans[i].length;
+    }
+
+    output_init(&out, client, server_state);
+    for(i = 0; i < file_count; i++)
+    {
+        if(verbose || (file_count > 1 && !quiet))
+        {
+            output_format(&out, "%s==> %s <==\n", i > 0 ? "\n" : "", names[i]);
+        }
+        output_file(&out, fds[i], scans[i].length);
+    }
+    output_finish(&out);
+    close_operands(fds, file_count);
+
+    return BUILTIN_DONE;
+}
+
+/*
+    Counts lines, words and bytes of regular files by scanning a mapping of
+    each. Supports -l, -w and -c with the column widths wc uses.
+
+    @param
+    client: Contains client input and holds the output
+    server_state: The server owning the session
+
+    @return
+    BUILTIN_DONE, or BUILTIN_EXTERNAL for other options, standard input, special files, large
+    inputs or text whose words depend on the locale
+*/
+int process_wc(client_info *client, server_data *server_state)
+{
+    char        args[MAX_ARGS_LENGTH];
+    char       *argv[FAST_PATH_MAX_ARGS];
+    const char *names[FAST_PATH_MAX_OPERANDS];
+    wc_scan     scans[FAST_PATH_MAX_OPERANDS];
+    uintmax_t   sizes[FAST_PATH_MAX_OPERANDS];
+    uintmax_t   totals[3];
+    fast_output out;
+    bool        show_lines;
+    bool        show_words;
+    bool        show_bytes;
+    bool        options_done;
+    uintmax_t   total_size;
+    int         width;
+    int         argc;
+    int         file_count;
+    int         i;
+
+    snprintf(args, sizeof(args), "%s", client->io->args);
+    argc = split_args(args, argv);
+    if(argc == -1)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    show_lines   = false;
+    show_words   = false;
+    show_bytes   = false;
+    options_done = false;
+    file_count   = 0;
+
+    for(i = 0; i < argc; i++)
+    {
+        const char *flag;
+
+        if(!options_done && strcmp(argv[i], "--") == 0)
+        {
+            options_done = true;
+            continue;
+        }
+
+        if(!options_done && argv[i][0] == '-')
+        {
+            for(flag = argv[i] + 1; *flag != '\0'; flag++)
+            {
+                show_lines = show_lines || *flag == 'l';
+                show_words = show_words || *flag == 'w';
+                show_bytes = show_bytes || *flag == 'c';
+                if(*flag != 'l' && *flag != 'w' && *flag != 'c')
+                {
+                    return BUILTIN_EXTERNAL;
+                }
+            }
+
+            // A lone "-" is standard input
+            if(argv[i][1] == '\0')
+            {
+                return BUILTIN_EXTERNAL;
+            }
+            continue;
+        }
+
+        if(file_count == FAST_PATH_MAX_OPERANDS)
+        {
+            return BUILTIN_EXTERNAL;
+        }
+        names[file_count++] = argv[i];
+    }
+
+    if(file_count == 0)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    if(!show_lines && !show_words && !show_bytes)
+    {
+        show_lines = true;
+        show_words = true;
+        show_bytes = true;
+    }
+
+    // Count everything before anything is sent
+    total_size = 0;
+    for(i = 0; i < file_count; i++)
+    {
+        struct stat st;
+        int         fd;
+
+        fd = open_operand(client, names[i], &st);
+        if(fd == -1)
+        {
+            return BUILTIN_EXTERNAL;
+        }
+
+        memset(&scans[i], 0, sizeof(scans[i]));
+        sizes[i] = (uintmax_t)st.st_size;
+        if(sizes[i] > FAST_PATH_MAX_INPUT - total_size || ((show_lines || show_words) && sizes[i] > 0 && scan_mapping(fd, (size_t)sizes[i], scan_wc, &scans[i]) == -1))
+        {
+            close(fd);
+            return BUILTIN_EXTERNAL;
+        }
+        close(fd);
+
+        if(show_words && scans[i].unsure)
+        {
+            return BUILTIN_EXTERNAL;
+        }
+        total_size += sizes[i];
+    }
+
+    // Columns are as wide as the combined size, a single count of a single file isn't padded
+    width = 1;
+    if(file_count > 1 || (show_lines + show_words + show_bytes) > 1)
+    {
+        uintmax_t remaining;
+
+        for(remaining = total_size; remaining >= DECIMAL; remaining /= DECIMAL)
+        {
+            width++;
+        }
+    }
+
+    memset(totals, 0, sizeof(totals));
+    output_init(&out, client, server_state);
+    for(i = 0; i <= file_count; i++)
+    {
+        uintmax_t   counts[3];
+        const char *separator;
+        int         field;
+
+        if(i == file_count && file_count == 1)
+        {
+            break;
+        }
+
+        if(i < file_count)
+        {
+            counts[0] = scans[i].lines;
+            counts[1] = scans[i].words;
+            counts[2] = sizes[i];
+            for(field = 0; field < 3; field++)
+            {
+                totals[field] += counts[field];
+            }
+        }
+        else
+        {
+            memcpy(counts, totals, sizeof(counts));
+        }
+
+        separator = "";
+        for(field = 0; field < 3; field++)
+        {
+            if((field == 0 && show_lines) || (field == 1 && show_words) || (field == 2 && show_bytes))
+            {
+                output_format(&out, "%s%*ju", separator, width, counts[field]);
+                separator = " ";
+            }
+        }
+        output_format(&out, " %s\n", i < file_count ? names[i] : "total");
+    }
+    output_finish(&out);
+
+    return BUILTIN_DONE;
+}
+
+/*
+    Describes files in-process, in the default stat layout or with -c and the
+    common format directives. Supports -L.
+
+    @param
+    client: Contains client input and holds the output
+    server_state: The server owning the session
+
+    @return
+    BUILTIN_DONE, or BUILTIN_EXTERNAL for other options, missing files, devices or unusual names
+*/
+int process_stat(client_info *client, server_data *server_state)
+{
+    char         args[MAX_ARGS_LENGTH];
+    char        *argv[FAST_PATH_MAX_ARGS];
+    const char  *names[FAST_PATH_MAX_OPERANDS];
+    file_status *statuses;
+    fast_output  out;
+    const char  *format;
+    bool         follow;
+    bool         options_done;
+    int          argc;
+    int          file_count;
+    int          result;
+    int          i;
+
+    snprintf(args, sizeof(args), "%s", client->io->args);
+    argc = split_args(args, argv);
+
+    // Quoting styles change how names are printed
+    if(argc == -1 || getenv("QUOTING_STYLE") != NULL)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    format       = NULL;
+    follow       = false;
+    options_done = false;
+    file_count   = 0;
+
+    for(i = 0; i < argc; i++)
+    {
+        const char *arg;
+
+        arg = argv[i];
+        if(!options_done && strcmp(arg, "--") == 0)
+        {
+            options_done = true;
+        }
+        else if(!options_done && strcmp(arg, "-L") == 0)
+        {
+            follow = true;
+        }
+        else if(!options_done && strcmp(arg, "-c") == 0 && i + 1 < argc)
+        {
+            format = argv[++i];
+        }
+        else if(!options_done && strncmp(arg, "-c", 2) == 0 && arg[2] != '\0')
+        {
+            format = arg + 2;
+        }
+        else if((!options_done && arg[0] == '-') || file_count == FAST_PATH_MAX_OPERANDS)
+        {
+            return BUILTIN_EXTERNAL;
+        }
+        else
+        {
+            names[file_count++] = arg;
+        }
+    }
+
+    if(file_count == 0)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    statuses = (file_status *)malloc((size_t)file_count * sizeof(file_status));
+    if(statuses == NULL)
+    {
+        return BUILTIN_EXTERNAL;
+    }
+
+    result = BUILTIN_DONE;
+    for(i = 0; i < file_count && result == BUILTIN_DONE; i++)
+    {
+        if(!printable_name(names[i]) || collect_status(client, names[i], follow, &statuses[i]) == -1)
+        {
+            result = BUILTIN_EXTERNAL;
+        }
+    }
+
+    // Format directives are checked before anything is sent
+    output_init(&out, client, server_state);
+    if(result == BUILTIN_DONE && format != NULL && write_status_format(NULL, names[0], &statuses[0], format) == -1)
+    {
+        result = BUILTIN_EXTERNAL;
+    }
+
+    for(i = 0; i < file_count && result == BUILTIN_DONE; i++)
+    {
+        if(format != NULL)
+        {
+            write_status_format(&out, names[i], &statuses[i], format);
+        }
+        else
+        {
+            write_status(&out, names[i], &statuses[i]);
+        }
+    }
+
+    if(result == BUILTIN_DONE)
+    {
+        output_finish(&out);
+    }
+
+    free(statuses);
+    return result;
+}
+
+#pragma GCC diagnostic pop
+
+/*
+    Splits a copy of the argument string on spaces, like execute_command does.
+
+    @param
+    args: The copy to split, modified in place
+    argv: Receives the arguments
+
+    @return
+    The number of arguments, or -1 if there are too many
+*/
+static int split_args(char *args, char **argv)
+{
+    char *token;
+    char *saveptr;
+    int   argc;
+
+    argc  = 0;
+    token = strtok_r(args, " ", &saveptr);
+    while(token != NULL)
+    {
+        if(argc == FAST_PATH_MAX_ARGS - 1)
+        {
+            return -1;
+        }
+
+        argv[argc++] = token;
+        token        = strtok_r(NULL, " ", &saveptr);
+    }
+    argv[argc] = NULL;
+
+    return argc;
+}
+
+/*
+    Opens a regular file relative to the session's directory. FIFOs and devices
+    are rejected without blocking on them. So are files whose size doesn't tell
+    how much they hold: procfs files report 0 and sysfs files a whole page, and
+    the output is sized from st_size. Empty files are left to the external
+    command along with them.
+
+    @param
+    client: The session
+    name: The file operand
+    st: Receives the file's status
+
+    @return
+    The open file, or -1 if it can't be opened or its size can't be trusted
+*/
+static int open_operand(const client_info *client, const char *name, struct stat *st)
+{
+    int fd;
+#if defined(__linux__)
+    struct statfs fs;
+#endif
+
+    fd = openat(client->cwd_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if(fd == -1)
+    {
+        return -1;
+    }
+
+    if(fstat(fd, st) == -1 || !S_ISREG(st->st_mode) || st->st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+#if defined(__linux__)
+    if(fstatfs(fd, &fs) == -1 || fs.f_type == PROC_SUPER_MAGIC || fs.f_type == SYSFS_MAGIC)
+    {
+        close(fd);
+        return -1;
+    }
+#endif
+
+    return fd;
+}
+
+/*
+    Closes the files opened for a command.
+
+    @param
+    fds: The open files
+    count: The number of files
+*/
+static void close_operands(const int *fds, int count)
+{
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+/*
+    Parses a plain decimal count, without sign or size suffix.
+
+    @param
+    text: The digits
+    value: Receives the count
+
+    @return
+    true if text is a count
+*/
+static bool parse_count(const char *text, uintmax_t *value)
+{
+    char     *endptr;
+    uintmax_t parsed;
+
+    if(*text < '0' || *text > '9')
+    {
+        return false;
+    }
+
+    errno  = 0;
+    parsed = strtoumax(text, &endptr, DECIMAL);
+    if(errno != 0 || *endptr != '\0')
+    {
+        return false;
+    }
+
+    *value = parsed;
+    return true;
+}
+
+/*
+    Checks that a name is printed the same quoted or not.
+
+    @param
+    name: The name
+
+    @return
+    true if the name only holds printable ASCII
+*/
+static bool printable_name(const char *name)
+{
+    for(; *name != '\0'; name++)
+    {
+        if((unsigned char)*name < ' ' || (unsigned char)*name > '~')
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Orders names the way ls does, by the collation of the environment's locale.
+
+    @param
+    a: Pointer to the first name
+    b: Pointer to the second name
+
+    @return
+    Negative, zero or positive like strcmp
+*/
+static int compare_names(const void *a, const void *b)
+{
+    const char *first;
+    const char *second;
+
+    first  = *(const char *const *)a;
+    second = *(const char *const *)b;
+
+    if(collation == (locale_t)0)
+    {
+        return strcmp(first, second);
+    }
+
+    return strcoll_l(first, second, collation);
+}
+
+/*
+    Appends a name to a list.
+
+    @param
+    list: The list
+    name: The name to copy
+
+    @return
+    0 on success, -1 if the list is full or out of memory
+*/
+static int name_list_add(name_list *list, const char *name)
+{
+    size_t length;
+
+    if(list->count == FAST_PATH_MAX_ENTRIES)
+    {
+        return -1;
+    }
+
+    length = strlen(name) + 1;
+    if(list->arena_used + length > list->arena_size)
+    {
+        size_t size;
+        char  *arena;
+
+        size  = list->arena_size == 0 ? FAST_PATH_DIRENT_BUFFER : list->arena_size * 2;
+        size  = size < list->arena_used + length ? list->arena_used + length : size;
+        arena = (char *)realloc(list->arena, size);
+        if(arena == NULL)
+        {
+            return -1;
+        }
+        list->arena      = arena;
+        list->arena_size = size;
+    }
+
+    if(list->count == list->capacity)
+    {
+        size_t  capacity;
+        size_t *offsets;
+
+        capacity = list->capacity == 0 ? FAST_PATH_MAX_OPERANDS : list->capacity * 2;
+        offsets  = (size_t *)realloc(list->offsets, capacity * sizeof(size_t));
+        if(offsets == NULL)
+        {
+            return -1;
+        }
+        list->offsets  = offsets;
+        list->capacity = capacity;
+    }
+
+    memcpy(list->arena + list->arena_used, name, length);
+    list->offsets[list->count++] = list->arena_used;
+    list->arena_used += length;
+
+    return 0;
+}
+
+/*
+    Turns the stored offsets into name pointers once the arena stops moving.
+
+    @param
+    list: The list
+
+    @return
+    0 on success, -1 if out of memory
+*/
+static int name_list_resolve(name_list *list)
+{
+    size_t i;
+
+    list->names = (const char **)malloc((list->count + 1) * sizeof(char *));
+    if(list->names == NULL)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < list->count; i++)
+    {
+        list->names[i] = list->arena + list->offsets[i];
+    }
+
+    return 0;
+}
+
+/*
+    Frees a list.
+
+    @param
+    list: The list
+*/
+static void name_list_free(name_list *list)
+{
+    free(list->arena);
+    free(list->offsets);
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
+
+/*
+    Reads the names in a directory.
+
+    @param
+    list: Receives the names
+    dir_fd: The open directory
+    show: Which entries to keep
+
+    @return
+    0 on success, -1 on failure or if the directory is too large for the fast path
+*/
+static int read_directory(name_list *list, int dir_fd, enum ls_show show)
+{
+#if defined(__linux__)
+    char buffer[FAST_PATH_DIRENT_BUFFER] __attribute__((aligned(__alignof__(struct kernel_dirent))));
+
+    for(;;)
+    {
+        long bytes_read;
+        long offset;
+
+        bytes_read = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_read <= 0)
+        {
+            return (int)bytes_read;
+        }
+
+        for(offset = 0; offset < bytes_read;)
+        {
+            const struct kernel_dirent *entry;
+
+            entry = (const struct kernel_dirent *)(void *)(buffer + offset);
+            if(entry_visible(entry->d_name, show) && name_list_add(list, entry->d_name) == -1)
+            {
+                return -1;
+            }
+
+            offset += entry->d_reclen;
+        }
+    }
+#else
+    DIR                 *stream;
+    const struct dirent *entry;
+    int                  stream_fd;
+
+    // closedir closes the descriptor it was given
+    stream_fd = dup(dir_fd);
+    stream    = stream_fd == -1 ? NULL : fdopendir(stream_fd);
+    if(stream == NULL)
+    {
+        if(stream_fd != -1)
+        {
+            close(stream_fd);
+        }
+        return -1;
+    }
+
+    while((entry = readdir(stream)) != NULL)
+    {
+        if(entry_visible(entry->d_name, show) && name_list_add(list, entry->d_name) == -1)
+        {
+            closedir(stream);
+            return -1;
+        }
+    }
+
+    closedir(stream);
+    return 0;
+#endif
+}
+
+/*
+    Decides whether ls shows a directory entry.
+
+    @param
+    name: The entry's name
+    show: Which entries to show
+
+    @return
+    true if the entry is listed
+*/
+static bool entry_visible(const char *name, enum ls_show show)
+{
+    if(name[0] != '.' || show == SHOW_ALL)
+    {
+        return true;
+    }
+
+    return show == SHOW_ALMOST_ALL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/*
+    Maps a file and runs a scanner over it. A file that shrinks while it is
+    being read raises SIGBUS, which is caught and reported as a failure.
+
+    @param
+    fd: The open file
+    length: The file's size, greater than 0
+    scanner: Called once with the mapped bytes
+    context: Passed to the scanner
+
+    @return
+    0 on success, -1 on failure
+*/
+static int scan_mapping(int fd, size_t length, mapping_scanner scanner, void *context)
+{
+    sigjmp_buf fault;
+    void      *data;
+
+    data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    if(sigsetjmp(fault, 1) != 0)
+    {
+        mapping_fault = NULL;
+        munmap(data, length);
+        return -1;
+    }
+
+    mapping_fault = &fault;
+    madvise(data, length, MADV_SEQUENTIAL);
+    scanner((const uint8_t *)data, length, context);
+    mapping_fault = NULL;
+
+    munmap(data, length);
+    return 0;
+}
+
+/*
+    Finds where the first lines of a file end.
+
+    @param
+    data: The file's bytes
+    length: The file's size
+    context: The head_scan, whose length is set to the end of the last wanted line
+*/
+static void scan_head(const uint8_t *data, size_t length, void *context)
+{
+    head_scan     *scan;
+    const uint8_t *position;
+    uintmax_t      lines;
+
+    scan     = (head_scan *)context;
+    position = data;
+    for(lines = 0; lines < scan->lines; lines++)
+    {
+        const uint8_t *newline;
+
+        newline = (const uint8_t *)memchr(position, '\n', length - (size_t)(position - data));
+        if(newline == NULL)
+        {
+            return;
+        }
+        position = newline + 1;
+    }
+
+    scan->length = (size_t)(position - data);
+}
+
+/*
+    Counts newlines and words. Words are runs of printable characters between
+    whitespace; bytes outside printable ASCII mark the scan as locale dependent.
+
+    @param
+    data: The file's bytes
+    length: The file's size
+    context: The wc_scan to update
+*/
+static void scan_wc(const uint8_t *data, size_t length, void *context)
+{
+    wc_scan *scan;
+    size_t   i;
+
+    scan = (wc_scan *)context;
+    for(i = 0; i < length; i++)
+    {
+        uint8_t c;
+
+        c = data[i];
+        if(c == '\n')
+        {
+            scan->lines++;
+            scan->in_word = false;
+        }
+        else if(c == ' ' || (c >= '\t' && c <= '\r'))
+        {
+            scan->in_word = false;
+        }
+        else if(c > ' ' && c <= '~')
+        {
+            scan->words += !scan->in_word;
+            scan->in_word = true;
+        }
+        else
+        {
+            scan->unsure = true;
+        }
+    }
+}
+
+/*
+    Returns to scan_mapping when a mapped file can no longer be read. A SIGBUS
+    anywhere else still terminates the server.
+
+    @param
+    signum: Signal number to handle
+*/
+static void sigbus_handler(int signum)
+{
+    if(mapping_fault != NULL)
+    {
+        siglongjmp(*mapping_fault, 1);
+    }
+
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+/*
+    Gathers what stat prints about a file.
+
+    @param
+    client: The session
+    name: The file operand
+    follow: Describe the target of a symbolic link instead of the link
+    status: Receives the file's details
+
+    @return
+    0 on success, -1 on failure or for file types the fast path doesn't describe
+*/
+static int collect_status(const client_info *client, const char *name, bool follow, file_status *status)
+{
+    int flags;
+
+    flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+    memset(status, 0, sizeof(*status));
+
+    if(fstatat(client->cwd_fd, name, &status->st, flags) == -1 || S_ISCHR(status->st.st_mode) || S_ISBLK(status->st.st_mode))
+    {
+        return -1;
+    }
+
+#if defined(__linux__) && defined(STATX_BTIME)
+    {
+        struct statx extended;
+
+        if(statx(client->cwd_fd, name, flags, STATX_BTIME, &extended) == 0 && (extended.stx_mask & STATX_BTIME))
+        {
+            status->birth.tv_sec  = extended.stx_btime.tv_sec;
+            status->birth.tv_nsec = extended.stx_btime.tv_nsec;
+            status->has_birth     = true;
+        }
+    }
+#endif
+
+    if(S_ISLNK(status->st.st_mode))
+    {
+        ssize_t length;
+
+        length = readlinkat(client->cwd_fd, name, status->target, sizeof(status->target) - 1);
+        if(length == -1)
+        {
+            return -1;
+        }
+
+        status->target[length] = '\0';
+        if(!printable_name(status->target))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Writes the default stat layout for one file.
+
+    @param
+    out: The command output
+    name: The file operand
+    status: The file's details
+*/
+static void write_status(fast_output *out, const char *name, const file_status *status)
+{
+    char mode[MODE_STRING_LEN];
+    char user[FAST_PATH_NSS_BUFFER];
+    char group[FAST_PATH_NSS_BUFFER];
+    char access_time[FAST_PATH_TIME_LEN];
+    char modify_time[FAST_PATH_TIME_LEN];
+    char change_time[FAST_PATH_TIME_LEN];
+    char birth_time[FAST_PATH_TIME_LEN];
+    char size[FAST_PATH_TIME_LEN];
+
+    mode_string(status->st.st_mode, mode);
+    user_name(status->st.st_uid, user, sizeof(user));
+    group_name(status->st.st_gid, group, sizeof(group));
+    format_time(&status->st.st_atim, access_time, sizeof(access_time));
+    format_time(&status->st.st_mtim, modify_time, sizeof(modify_time));
+    format_time(&status->st.st_ctim, change_time, sizeof(change_time));
+    snprintf(birth_time, sizeof(birth_time), "-");
+    if(status->has_birth)
+    {
+        format_time(&status->birth, birth_time, sizeof(birth_time));
+    }
+    snprintf(size, sizeof(size), "%jd", (intmax_t)status->st.st_size);
+
+    if(status->target[0] != '\0')
+    {
+        output_format(out, "  File: %s -> %s\n", name, status->target);
+    }
+    else
+    {
+        output_format(out, "  File: %s\n", name);
+    }
+
+    output_format(out, "  Size: %-10s\tBlocks: %-10jd IO Block: %-6jd %s\n", size, (intmax_t)status->st.st_blocks, (intmax_t)status->st.st_blksize, file_type(&status->st));
+    output_format(out, "Device: %u,%u\tInode: %-11ju Links: %ju\n", (unsigned int)major(status->st.st_dev), (unsigned int)minor(status->st.st_dev), (uintmax_t)status->st.st_ino, (uintmax_t)status->st.st_nlink);
+    output_format(out,
+                  "Access: (%04o/%s)  Uid: (%5ju/%8s)   Gid: (%5ju/%8s)\n",
+                  (unsigned int)(status->st.st_mode & PERMISSION_BITS),
+                  mode,
+                  (uintmax_t)status->st.st_uid,
+                  user,
+                  (uintmax_t)status->st.st_gid,
+                  group);
+    output_format(out, "Access: %s\nModify: %s\nChange: %s\n Birth: %s\n", access_time, modify_time, change_time, birth_time);
+}
+
+/*
+    Writes one file's details in a stat -c format. With no output the format is
+    only checked.
+
+    @param
+    out: The command output, or NULL to validate the format
+    name: The file operand
+    status: The file's details
+    format: The format with %n %s %a %A %b %B %F %u %U %g %G %h %i %o %x %y %z %X %Y %Z %%
+
+    @return
+    0 on success, -1 if the format uses anything else
+*/
+static int write_status_format(fast_output *out, const char *name, const file_status *status, const char *format)
+{
+    const char *c;
+
+    for(c = format; *c != '\0'; c++)
+    {
+        char buffer[FAST_PATH_NSS_BUFFER];
+
+        if(*c != '%')
+        {
+            buffer[0] = *c;
+            buffer[1] = '\0';
+        }
+        else
+        {
+            switch(*++c)
+            {
+                case 'n':
+                    snprintf(buffer, sizeof(buffer), "%s", name);
+                    break;
+                case 's':
+                    snprintf(buffer, sizeof(buffer), "%jd", (intmax_t)status->st.st_size);
+                    break;
+                case 'a':
+                    snprintf(buffer, sizeof(buffer), "%o", (unsigned int)(status->st.st_mode & PERMISSION_BITS));
+                    break;
+                case 'A':
+                    mode_string(status->st.st_mode, buffer);
+                    break;
+                case 'b':
+                    snprintf(buffer, sizeof(buffer), "%jd", (intmax_t)status->st.st_blocks);
+                    break;
+                case 'B':
+                    snprintf(buffer, sizeof(buffer), "512");
+                    break;
+                case 'F':
+                    snprintf(buffer, sizeof(buffer), "%s", file_type(&status->st));
+                    break;
+                case 'u':
+                    snprintf(buffer, sizeof(buffer), "%ju", (uintmax_t)status->st.st_uid);
+                    break;
+                case 'U':
+                    user_name(status->st.st_uid, buffer, sizeof(buffer));
+                    break;
+                case 'g':
+                    snprintf(buffer, sizeof(buffer), "%ju", (uintmax_t)status->st.st_gid);
+                    break;
+                case 'G':
+                    group_name(status->st.st_gid, buffer, sizeof(buffer));
+                    break;
+                case 'h':
+                    snprintf(buffer, sizeof(buffer), "%ju", (uintmax_t)status->st.st_nlink);
+                    break;
+                case 'i':
+                    snprintf(buffer, sizeof(buffer), "%ju", (uintmax_t)status->st.st_ino);
+                    break;
+                case 'o':
+                    snprintf(buffer, sizeof(buffer), "%jd", (intmax_t)status->st.st_blksize);
+                    break;
+                case 'x':
+                    format_time(&status->st.st_atim, buffer, sizeof(buffer));
+                    break;
+                case 'y':
+                    format_time(&status->st.st_mtim, buffer, sizeof(buffer));
+                    break;
+                case 'z':
+                    format_time(&status->st.st_ctim, buffer, sizeof(buffer));
+                    break;
+                case 'X':
+                    snprintf(buffer, sizeof(buffer), "%jd", (intmax_t)status->st.st_atim.tv_sec);
+                    break;
+                case 'Y':
+                    snprintf(buffer, sizeof(buffer), "%jd", (intmax_t)status->st.st_mtim.tv_sec);
+                    break;
+                case 'Z':
+                    snprintf(buffer, sizeof(buffer), "%jd", (intmax_t)status->st.st_ctim.tv_sec);
+                    break;
+                case '%':
+                    snprintf(buffer, sizeof(buffer), "%%");
+                    break;
+                default:
+                    return -1;
+            }
+        }
+
+        if(out != NULL)
+        {
+            output_bytes(out, buffer, strlen(buffer));
+        }
+    }
+
+    if(out != NULL)
+    {
+        output_bytes(out, "\n", 1);
+    }
+
+    return 0;
+}
+
+/*
+    Names a file's type the way stat does.
+
+    @param
+    st: The file's status
+
+    @return
+    The type description
+*/
+static const char *file_type(const struct stat *st)
+{
+    if(S_ISREG(st->st_mode))
+    {
+        return st->st_size == 0 ? "regular empty file" : "regular file";
+    }
+    if(S_ISDIR(st->st_mode))
+    {
+        return "directory";
+    }
+    if(S_ISLNK(st->st_mode))
+    {
+        return "symbolic link";
+    }
+    if(S_ISFIFO(st->st_mode))
+    {
+        return "fifo";
+    }
+    if(S_ISSOCK(st->st_mode))
+    {
+        return "socket";
+    }
+
+    return "weird file";
+}
+
+/*
+    Writes a mode as the ten-character string ls and stat print.
+
+    @param
+    mode: The file mode
+    buffer: Receives the string, at least MODE_STRING_LEN bytes
+*/
+static void mode_string(mode_t mode, char *buffer)
+{
+    buffer[0]  = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : S_ISCHR(mode) ? 'c' : S_ISBLK(mode) ? 'b' : '-';
+    buffer[1]  = (mode & S_IRUSR) ? 'r' : '-';
+    buffer[2]  = (mode & S_IWUSR) ? 'w' : '-';
+    buffer[3]  = (mode & S_ISUID) ? ((mode & S_IXUSR) ? 's' : 'S') : ((mode & S_IXUSR) ? 'x' : '-');
+    buffer[4]  = (mode & S_IRGRP) ? 'r' : '-';
+    buffer[5]  = (mode & S_IWGRP) ? 'w' : '-';
+    buffer[6]  = (mode & S_ISGID) ? ((mode & S_IXGRP) ? 's' : 'S') : ((mode & S_IXGRP) ? 'x' : '-');
+    buffer[7]  = (mode & S_IROTH) ? 'r' : '-';
+    buffer[8]  = (mode & S_IWOTH) ? 'w' : '-';
+    buffer[9]  = (mode & S_ISVTX) ? ((mode & S_IXOTH) ? 't' : 'T') : ((mode & S_IXOTH) ? 'x' : '-');
+    buffer[10] = '\0';
+}
+
+/*
+    Formats a timestamp like stat: local time with nanoseconds and the UTC offset.
+
+    @param
+    time: The timestamp
+    buffer: Receives the text
+    size: Capacity of buffer
+*/
+static void format_time(const struct timespec *time, char *buffer, size_t size)
+{
+    struct tm local;
+    char      date[FAST_PATH_DATE_LEN];
+    char      zone[FAST_PATH_ZONE_LEN];
+
+    if(localtime_r(&time->tv_sec, &local) == NULL)
+    {
+        snprintf(buffer, size, "%jd", (intmax_t)time->tv_sec);
+        return;
+    }
+
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+    strftime(zone, sizeof(zone), "%z", &local);
+    snprintf(buffer, size, "%s.%09ld %s", date, time->tv_nsec, zone);
+}
+
+/*
+    Looks up a user name, falling back to UNKNOWN like stat.
+
+    @param
+    uid: The user id
+    buffer: Receives the name
+    size: Capacity of buffer
+*/
+static void user_name(uid_t uid, char *buffer, size_t size)
+{
+    struct passwd  entry;
+    struct passwd *result;
+    char           storage[FAST_PATH_NSS_BUFFER];
+
+    if(getpwuid_r(uid, &entry, storage, sizeof(storage), &result) == 0 && result != NULL)
+    {
+        snprintf(buffer, size, "%s", entry.pw_name);
+        return;
+    }
+
+    snprintf(buffer, size, "UNKNOWN");
+}
+
+/*
+    Looks up a group name, falling back to UNKNOWN like stat.
+
+    @param
+    gid: The group id
+    buffer: Receives the name
+    size: Capacity of buffer
+*/
+static void group_name(gid_t gid, char *buffer, size_t size)
+{
+    struct group  entry;
+    struct group *result;
+    char          storage[FAST_PATH_NSS_BUFFER];
+
+    if(getgrgid_r(gid, &entry, storage, sizeof(storage), &result) == 0 && result != NULL)
+    {
+        snprintf(buffer, size, "%s", entry.gr_name);
+        return;
+    }
+
+    snprintf(buffer, size, "UNKNOWN");
+}
+
+/*
+    Starts collecting a command's output in the session's output buffer.
+
+    @param
+    out: The command output
+    client: The session the output is for
+    server_state: The reactor serving the session
+*/
+static void output_init(fast_output *out, client_info *client, server_data *server_state)
+{
+    out->client   = client;
+    out->outbound = &session_get(&server_state->sessions, client->owner)->outbound;
+    out->metrics  = &server_state->metrics;
+    out->length   = 0;
+    out->failed   = false;
+}
+
+/*
+    Appends bytes to the output, sending full buffers as OUTPUT frames.
+
+    @param
+    out: The command output
+    data: The bytes
+    size: The number of bytes
+*/
+static void output_bytes(fast_output *out, const void *data, size_t size)
+{
+    const uint8_t *bytes;
+
+    bytes = (const uint8_t *)data;
+    while(size > 0 && !out->failed)
+    {
+        size_t chunk;
+
+        if(out->length == OUTPUT_CHUNK)
+        {
+            output_flush(out);
+            continue;
+        }
+
+        chunk = OUTPUT_CHUNK - out->length;
+        chunk = chunk < size ? chunk : size;
+        memcpy(out->client->io->output + out->length, bytes, chunk);
+        out->length += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+}
+
+/*
+    Appends formatted text to the output.
+
+    @param
+    out: The command output
+    format: printf format
+*/
+static void output_format(fast_output *out, const char *format, ...)
+{
+    char    line[PATH_MAX + FAST_PATH_NSS_BUFFER];
+    va_list list;
+    int     length;
+
+    va_start(list, format);
+    length = vsnprintf(line, sizeof(line), format, list);
+    va_end(list);
+
+    if(length < 0 || (size_t)length >= sizeof(line))
+    {
+        output_abort(out);
+        return;
+    }
+
+    output_bytes(out, line, (size_t)length);
+}
+
+/*
+    Sends the start of a file as OUTPUT frames with sendfile(2), after any text
+    that is already buffered. What the socket can't take yet is queued as a
+    range of the file, so the file isn't copied.
+
+    @param
+    out: The command output
+    fd: The open file
+    length: The number of bytes to send from the start of the file
+*/
+static void output_file(fast_output *out, int fd, size_t length)
+{
+    off_t offset;
+
+    output_flush(out);
+
+    offset = 0;
+    while(length > 0 && !out->failed)
+    {
+        size_t chunk;
+
+        chunk = length < FRAME_MAX_PAYLOAD ? length : FRAME_MAX_PAYLOAD;
+        if(outbox_sendfile(out->outbound, out->client->client_socket, fd, offset, FRAME_OUTPUT, out->client->channel, out->client->request_id, (uint32_t)chunk) == -1)
+        {
+            output_abort(out);
+            return;
+        }
+
+        metrics_add(&out->metrics->bytes_out, FRAME_HEADER_SIZE + chunk);
+        out->client->output_credit -= (int64_t)chunk;
+        offset += (off_t)chunk;
+        length -= chunk;
+    }
+}
+
+/*
+    Sends the buffered output as one OUTPUT frame.
+
+    @param
+    out: The command output
+*/
+static void output_flush(fast_output *out)
+{
+    if(out->length == 0 || out->failed)
+    {
+        return;
+    }
+
+    if(outbox_send(out->outbound, out->client->client_socket, FRAME_OUTPUT, 0, out->client->channel, out->client->request_id, out->client->io->output, (uint32_t)out->length) == -1)
+    {
+        output_abort(out);
+        return;
+    }
+
+    metrics_add(&out->metrics->bytes_out, FRAME_HEADER_SIZE + out->length);
+    out->client->output_credit -= (int64_t)out->length;
+    out->length = 0;
+}
+
+/*
+    Gives up on the output after the connection broke. The socket is shut down
+    because a partial frame may be on the wire, so send_output closes the session.
+
+    @param
+    out: The command output
+*/
+static void output_abort(fast_output *out)
+{
+    if(!out->failed)
+    {
+        perror("Unable to send command output");
+        shutdown(out->client->client_socket, SHUT_RDWR);
+    }
+
+    out->failed = true;
+    out->length = 0;
+}
+
+/*
+    Leaves the last part of the output for send_output, which sends it with the STATUS frame.
+
+    @param
+    out: The command output
+*/
+static void output_finish(fast_output *out)
+{
+    out->client->output_len = out->length;
+    if(out->length == 0)
+    {
+        out->client->io->output[0] = '\0';
+    }
+}
@@ -0,0 +1,262 @@
+#include "job.h"
+
+/*
+    Allocates a job table with every slot on the free list.
+
+    @param
+    table: The job table to initialise
+    capacity: The maximum number of concurrently running jobs
+
+    @return
+    0 on success, -1 on failure
+*/
+int job_table_create(job_table *table, int capacity)
+{
+    int i;
+
+    memset(table, 0, sizeof(*table));
+
+    table->jobs      = (job_info *)calloc((size_t)capacity, sizeof(job_info));
+    table->free_list = (int *)calloc((size_t)capacity, sizeof(int));
+    if(table->jobs == NULL || table->free_list == NULL)
+    {
+        free(table->jobs);
+        free(table->free_list);
+        table->jobs      = NULL;
+        table->free_list = NULL;
+        return -1;
+    }
+
+    table->capacity   = capacity;
+    table->free_count = capacity;
+
+    // Hand out low slots first
+    for(i = 0; i < capacity; i++)
+    {
+        table->free_list[i] = capacity - 1 - i;
+    }
+
+    return 0;
+}
+
+/*
+    Frees the job table. Running children are not touched.
+
+    @param
+    table: The job table to destroy
+*/
+void job_table_destroy(job_table *table)
+{
+    free(table->jobs);
+    free(table->free_list);
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+    Takes a free slot from the job table.
+
+    @param
+    table: The job table
+    index: Receives the slot number
+
+    @return
+    The reset job, or NULL if the table is full
+*/
+job_info *job_acquire(job_table *table, int *index)
+{
+    job_info *job;
+
+    if(table->free_count == 0)
+    {
+        return NULL;
+    }
+
+    *index = table->free_list[--table->free_count];
+    job    = &table->jobs[*index];
+
+    memset(job, 0, sizeof(*job));
+    job->pidfd     = -1;
+    job->output_fd = -1;
+    job->client    = -1;
+    job->in_use    = true;
+
+    return job;
+}
+
+/*
+    Returns a slot to the job table, dropping any output captured for the
+    result cache. Descriptors must already be closed.
+
+    @param
+    table: The job table
+    index: The slot to free
+*/
+void job_release(job_table *table, int index)
+{
+    if(index < 0 || index >= table->capacity || !table->jobs[index].in_use)
+    {
+        return;
+    }
+
+    free(table->jobs[index].capture);
+    table->jobs[index].capture            = NULL;
+    table->jobs[index].in_use             = false;
+    table->free_list[table->free_count++] = index;
+}
+
+/*
+    Opens a descriptor that becomes readable when the child exits.
+
+    @param
+    job: The job whose child should be watched
+
+    @return
+    The pidfd, or -1 if the platform cannot provide one
+*/
+int job_watch_exit(job_info *job)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    job->pidfd = (int)syscall(SYS_pidfd_open, job->pid, 0);
+#else
+    job->pidfd = -1;
+#endif
+
+    return job->pidfd;
+}
+
+/*
+    Collects the child's exit status. A pipeline has exited once its last stage,
+    whose status is the job's, and every earlier stage have.
+
+    @param
+    job: The job to reap
+    wait: Block until the child exits instead of polling
+
+    @return
+    true if the child has exited, false if it is still running
+*/
+bool job_reap(job_info *job, bool wait)
+{
+    pid_t result;
+    int   i;
+
+    if(job->exited)
+    {
+        return true;
+    }
+
+    i = 0;
+    while(i < job->stage_count)
+    {
+        do
+        {
+            result = waitpid(job->stages[i], NULL, wait ? 0 : WNOHANG);
+        } while(result == -1 && errno == EINTR);
+
+        if(result == job->stages[i] || (result == -1 && errno == ECHILD))
+        {
+            job->stages[i] = job->stages[--job->stage_count];
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    if(!job->reaped)
+    {
+        do
+        {
+            result = waitpid(job->pid, &job->status, wait ? 0 : WNOHANG);
+        } while(result == -1 && errno == EINTR);
+
+        job->reaped = result == job->pid || (result == -1 && errno == ECHILD);
+    }
+
+    job->exited = job->reaped && job->stage_count == 0;
+    return job->exited;
+}
+
+/*
+    Sends a signal to a job's process group, reaching whatever the command
+    started as well as the command itself.
+
+    @param
+    job: The job to signal
+    signal: The signal to send
+*/
+void job_signal(const job_info *job, int signal)
+{
+    if(kill(-job->pid, signal) == -1 && errno == ESRCH && !job->exited)
+    {
+        kill(job->pid, signal);
+    }
+}
+
+/*
+    Checks whether a job has both exited and had its output drained.
+
+    @param
+    job: The job to check
+
+    @return
+    true when nothing more will be produced by the job
+*/
+bool job_is_done(const job_info *job)
+{
+    return job->exited && job->output_fd == -1;
+}
+
+/*
+    Reads the next chunk of a job's output. Running out of data clears the job's
+    readable flag until the event loop reports the pipe again.
+
+    @param
+    job: The job to read from
+    buffer: Destination for the output
+    size: Capacity of buffer
+
+    @return
+    The number of bytes read, 0 at EOF, -1 on error or when no data is ready
+*/
+ssize_t job_read_output(job_info *job, void *buffer, size_t size)
+{
+    ssize_t bytes_read;
+
+    do
+    {
+        bytes_read = read(job->output_fd, buffer, size);
+    } while(bytes_read == -1 && errno == EINTR);
+
+    if(bytes_read > 0)
+    {
+        job->bytes_out += (size_t)bytes_read;
+    }
+    else if(bytes_read == -1 && errno == EAGAIN)
+    {
+        job->readable = false;
+    }
+
+    return bytes_read;
+}
+
+/*
+    Reports how much output is waiting in a job's pipe.
+
+    @param
+    job: The job to check
+
+    @return
+    The number of bytes that can be read without blocking, 0 if unknown
+*/
+size_t job_output_available(const job_info *job)
+{
+    int available;
+
+    if(job->output_fd == -1 || ioctl(job->output_fd, FIONREAD, &available) == -1 || available < 0)
+    {
+        return 0;
+    }
+
+    return (size_t)available;
+}
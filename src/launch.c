@@ -0,0 +1,623 @@
+#include "launch.h"
+
+#if !defined(__GLIBC__) || !defined(_GNU_SOURCE)
+extern char **environ;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,readability-redundant-declaration)
+#endif
+
+// glibc 2.34 added a file action that closes every descriptor above a bound with close_range
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+    #define HAVE_SPAWN_CLOSEFROM
+#endif
+
+// Starting the child in a directory given by descriptor needs glibc 2.29 or macOS 10.15
+#if(defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) || defined(__APPLE__)
+    #define HAVE_SPAWN_FCHDIR
+#endif
+
+#define REDIRECT_MODE 0666    // Files created by > are left to the umask, as a shell does
+
+// What pipeline_parse reads from a command line
+enum pipeline_token
+{
+    TOKEN_END,
+    TOKEN_WORD,
+    TOKEN_PIPE,
+    TOKEN_INPUT,
+    TOKEN_OUTPUT,
+    TOKEN_APPEND
+};
+
+static int             spawn_stage(const char *path, char *const argv[], const int fds[3], int dir_fd, pid_t group, pid_t *pid);
+static int             next_token(char **cursor, char **word);
+static pipeline_stage *add_stage(pipeline *pl);
+static int             open_redirect(int dir_fd, const char *path, int flags);
+static int             create_pipe(int pipe_fds[2]);
+#if !defined(HAVE_SPAWN_FCHDIR)
+static int fork_command(const char *path, char *const argv[], const int fds[3], int dir_fd, pid_t group, pid_t *pid);
+#endif
+
+/*
+    Starts a program with its stdout and stderr sent to output_fd. The child leads
+    a new process group, so everything it starts can be signalled with it.
+
+    @param
+    path: Full path of the executable
+    argv: NULL-terminated argument vector, argv[0] included
+    output_fd: Descriptor the child's stdout and stderr are redirected to
+    dir_fd: Directory the child starts in, -1 to inherit the server's
+    pid: Receives the child's process id
+
+    @return
+    0 on success, or an errno value (ENOENT or EACCES when the program cannot be executed)
+*/
+int spawn_command(const char *path, char *const argv[], int output_fd, int dir_fd, pid_t *pid)
+{
+    int fds[3];
+
+    fds[STDIN_FILENO]  = -1;
+    fds[STDOUT_FILENO] = output_fd;
+    fds[STDERR_FILENO] = output_fd;
+
+    return spawn_stage(path, argv, fds, dir_fd, 0, pid);
+}
+
+/*
+    Checks whether a command line needs the pipeline parser.
+
+    @param
+    line: The command line
+
+    @return
+    true if the line contains |, < or >
+*/
+bool pipeline_is_compound(const char *line)
+{
+    return strpbrk(line, "|<>") != NULL;
+}
+
+/*
+    Splits a command line into the programs of a pipeline and their redirections.
+    Operators don't need spaces around them. The line is cut into words in place
+    and must outlive the pipeline.
+
+    @param
+    line: The command line, modified
+    pl: Receives the stages
+    error: Receives the message for the client when the line is malformed
+
+    @return
+    0 on success, -1 on a syntax error
+*/
+int pipeline_parse(char *line, pipeline *pl, const char **error)
+{
+    pipeline_stage *stage;
+    char           *cursor;
+    char           *word;
+    char           *word_end;
+    int             argc;
+    int             kind;
+    int             redirect;
+
+    pl->stage_count = 0;
+    stage           = add_stage(pl);
+    argc            = 0;
+    redirect        = TOKEN_END;
+    cursor          = line;
+    word_end        = NULL;
+
+    do
+    {
+        kind = next_token(&cursor, &word);
+
+        // A word can only be terminated once the operator that may directly follow it has been read
+        if(word_end != NULL)
+        {
+            *word_end = '\0';
+            word_end  = NULL;
+        }
+
+        if(kind == TOKEN_WORD)
+        {
+            word_end = cursor;
+        }
+
+        if(redirect != TOKEN_END)
+        {
+            if(kind != TOKEN_WORD)
+            {
+                *error = "Error: Missing file name after redirection\n";
+                return -1;
+            }
+
+            if(redirect == TOKEN_INPUT)
+            {
+                stage->input_path = word;
+            }
+            else
+            {
+                stage->output_path = word;
+                stage->append      = redirect == TOKEN_APPEND;
+            }
+            redirect = TOKEN_END;
+        }
+        else if(kind == TOKEN_WORD)
+        {
+            if(argc == MAX_STAGE_ARGS)
+            {
+                *error = "Error: Too many arguments\n";
+                return -1;
+            }
+            stage->argv[argc++] = word;
+        }
+        else if(kind == TOKEN_PIPE || kind == TOKEN_END)
+        {
+            if(argc == 0)
+            {
+                *error = "Error: Missing command in pipeline\n";
+                return -1;
+            }
+
+            if(kind == TOKEN_PIPE)
+            {
+                if(pl->stage_count == MAX_PIPELINE_STAGES)
+                {
+                    *error = "Error: Too many commands in pipeline\n";
+                    return -1;
+                }
+                stage = add_stage(pl);
+                argc  = 0;
+            }
+        }
+        else
+        {
+            redirect = kind;
+        }
+    } while(kind != TOKEN_END);
+
+    return 0;
+}
+
+/*
+    Opens the files a pipeline's stages are redirected to, relative to the
+    directory the pipeline runs in. Nothing is left open on failure.
+
+    @param
+    pl: The pipeline, its stages receive the descriptors
+    dir_fd: Directory relative paths are resolved in, -1 for the server's
+    failed: Receives the path that couldn't be opened
+
+    @return
+    0 on success, or an errno value
+*/
+int pipeline_open_redirects(pipeline *pl, int dir_fd, const char **failed)
+{
+    int i;
+
+    for(i = 0; i < pl->stage_count; i++)
+    {
+        pipeline_stage *stage;
+
+        stage = &pl->stages[i];
+        if(stage->input_path != NULL)
+        {
+            stage->input_fd = open_redirect(dir_fd, stage->input_path, O_RDONLY);
+            if(stage->input_fd == -1)
+            {
+                *failed = stage->input_path;
+                break;
+            }
+        }
+
+        if(stage->output_path != NULL)
+        {
+            stage->output_fd = open_redirect(dir_fd, stage->output_path, O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC));
+            if(stage->output_fd == -1)
+            {
+                *failed = stage->output_path;
+                break;
+            }
+        }
+    }
+
+    if(i < pl->stage_count)
+    {
+        int saved_errno;
+
+        saved_errno = errno;
+        pipeline_close_redirects(pl);
+        return saved_errno;
+    }
+
+    return 0;
+}
+
+/*
+    Closes the server's copies of a pipeline's redirected files.
+
+    @param
+    pl: The pipeline
+*/
+void pipeline_close_redirects(pipeline *pl)
+{
+    int i;
+
+    for(i = 0; i < pl->stage_count; i++)
+    {
+        if(pl->stages[i].input_fd != -1)
+        {
+            close(pl->stages[i].input_fd);
+            pl->stages[i].input_fd = -1;
+        }
+
+        if(pl->stages[i].output_fd != -1)
+        {
+            close(pl->stages[i].output_fd);
+            pl->stages[i].output_fd = -1;
+        }
+    }
+}
+
+/*
+    Starts every program of a pipeline, each stage's stdout connected to the next
+    one's stdin by a pipe, unless a redirection replaces it. The last stage's stdout
+    and every stage's stderr go to output_fd. The stages share one process group,
+    led by the last stage, so signalling the last stage's group reaches all of them.
+
+    @param
+    pl: The pipeline, with every path resolved and its redirections open
+    output_fd: Descriptor the pipeline's output is sent to
+    dir_fd: Directory the stages start in, -1 to inherit the server's
+    pids: Receives each stage's process id
+
+    @return
+    0 on success, or an errno value. No stage is left running on failure.
+*/
+int spawn_pipeline(const pipeline *pl, int output_fd, int dir_fd, pid_t *pids)
+{
+    int pipes[MAX_PIPELINE_STAGES - 1][2];
+    int last;
+    int created;
+    int started;
+    int result;
+    int i;
+
+    last    = pl->stage_count - 1;
+    started = pl->stage_count;
+    result  = 0;
+    for(created = 0; created < last; created++)
+    {
+        if(create_pipe(pipes[created]) == -1)
+        {
+            result = errno;
+            break;
+        }
+    }
+
+    // Every pipe exists before anything starts, so the group leader can be started first
+    for(i = last; result == 0 && i >= 0; i--)
+    {
+        const pipeline_stage *stage;
+        int                   fds[3];
+
+        stage              = &pl->stages[i];
+        fds[STDIN_FILENO]  = stage->input_fd != -1 ? stage->input_fd : (i > 0 ? pipes[i - 1][0] : -1);
+        fds[STDOUT_FILENO] = stage->output_fd != -1 ? stage->output_fd : (i < last ? pipes[i][1] : output_fd);
+        fds[STDERR_FILENO] = output_fd;
+
+        result = spawn_stage(stage->path, stage->argv, fds, dir_fd, i == last ? 0 : pids[last], &pids[i]);
+        if(result == 0)
+        {
+            started = i;
+        }
+    }
+
+    // Stages already started are killed and collected
+    for(i = started; result != 0 && i <= last; i++)
+    {
+        pid_t reaped;
+
+        kill(pids[i], SIGKILL);
+        do
+        {
+            reaped = waitpid(pids[i], NULL, 0);
+        } while(reaped == -1 && errno == EINTR);
+    }
+
+    while(created > 0)
+    {
+        created--;
+        close(pipes[created][0]);
+        close(pipes[created][1]);
+    }
+
+    return result;
+}
+
+/*
+    Starts one program with the given standard descriptors. posix_spawn lets the
+    C library use vfork semantics, so the cost of starting a command does not grow
+    with the server's memory and descriptor tables. Every descriptor above stderr
+    is closed in the child, even one that is missing FD_CLOEXEC.
+
+    @param
+    path: Full path of the executable
+    argv: NULL-terminated argument vector, argv[0] included
+    fds: The child's stdin, stdout and stderr, stdin may be -1 to inherit the server's
+    dir_fd: Directory the child starts in, -1 to inherit the server's
+    group: Process group to join, 0 to lead a new one
+    pid: Receives the child's process id
+
+    @return
+    0 on success, or an errno value (ENOENT or EACCES when the program cannot be executed)
+*/
+static int spawn_stage(const char *path, char *const argv[], const int fds[3], int dir_fd, pid_t group, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attr;
+    sigset_t                   defaults;
+    int                        result;
+
+#if !defined(HAVE_SPAWN_FCHDIR)
+    if(dir_fd != -1)
+    {
+        return fork_command(path, argv, fds, dir_fd, group, pid);
+    }
+#endif
+
+    result = posix_spawn_file_actions_init(&actions);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    // Redirect stdin when asked to, and stdout and stderr
+    result = 0;
+    if(fds[STDIN_FILENO] != -1)
+    {
+        result = posix_spawn_file_actions_adddup2(&actions, fds[STDIN_FILENO], STDIN_FILENO);
+    }
+    if(result == 0)
+    {
+        result = posix_spawn_file_actions_adddup2(&actions, fds[STDOUT_FILENO], STDOUT_FILENO);
+    }
+    if(result == 0)
+    {
+        result = posix_spawn_file_actions_adddup2(&actions, fds[STDERR_FILENO], STDERR_FILENO);
+    }
+
+#if defined(HAVE_SPAWN_FCHDIR)
+    if(result == 0 && dir_fd != -1)
+    {
+        result = posix_spawn_file_actions_addfchdir_np(&actions, dir_fd);
+    }
+#endif
+
+#if defined(HAVE_SPAWN_CLOSEFROM)
+    if(result == 0)
+    {
+        result = posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+    }
+#endif
+
+    if(result != 0)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        return result;
+    }
+
+    // The server ignores SIGPIPE, commands must not inherit that
+    result = posix_spawnattr_init(&attr);
+    if(result == 0)
+    {
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGPIPE);
+        result = posix_spawnattr_setsigdefault(&attr, &defaults);
+        if(result == 0)
+        {
+            result = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+        }
+        if(result == 0)
+        {
+            result = posix_spawnattr_setpgroup(&attr, group);
+        }
+        if(result == 0)
+        {
+            result = posix_spawn(pid, path, &actions, &attr, argv, environ);
+        }
+        posix_spawnattr_destroy(&attr);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    return result;
+}
+
+/*
+    Marks a descriptor close-on-exec.
+
+    @param
+    fd: The file descriptor to update
+
+    @return
+    0 on success, -1 on failure
+*/
+int set_cloexec(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFD);
+    if(flags == -1)
+    {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+/*
+    Reads the next word or operator of a command line.
+
+    @param
+    cursor: Where to start reading, moved past the token
+    word: Receives the start of the token
+
+    @return
+    The kind of token, TOKEN_END at the end of the line
+*/
+static int next_token(char **cursor, char **word)
+{
+    char *start;
+
+    start = *cursor + strspn(*cursor, " \t");
+    *word = start;
+
+    switch(*start)
+    {
+        case '\0':
+            *cursor = start;
+            return TOKEN_END;
+        case '|':
+            *cursor = start + 1;
+            return TOKEN_PIPE;
+        case '<':
+            *cursor = start + 1;
+            return TOKEN_INPUT;
+        case '>':
+            *cursor = start[1] == '>' ? start + 2 : start + 1;
+            return start[1] == '>' ? TOKEN_APPEND : TOKEN_OUTPUT;
+        default:
+            *cursor = start + strcspn(start, " \t|<>");
+            return TOKEN_WORD;
+    }
+}
+
+/*
+    Appends an empty stage to a pipeline.
+
+    @param
+    pl: The pipeline, with room for another stage
+
+    @return
+    The new stage
+*/
+static pipeline_stage *add_stage(pipeline *pl)
+{
+    pipeline_stage *stage;
+
+    stage = &pl->stages[pl->stage_count++];
+    memset(stage, 0, sizeof(*stage));
+    stage->input_fd  = -1;
+    stage->output_fd = -1;
+
+    return stage;
+}
+
+/*
+    Opens a redirected file for a child. A FIFO without a peer fails instead of
+    blocking the reactor, and the child gets a blocking descriptor either way.
+
+    @param
+    dir_fd: Directory a relative path is resolved in, -1 for the server's
+    path: The file
+    flags: Access mode and creation flags
+
+    @return
+    The descriptor, or -1 with errno set
+*/
+static int open_redirect(int dir_fd, const char *path, int flags)
+{
+    int fd;
+    int status_flags;
+
+    fd = openat(dir_fd == -1 ? AT_FDCWD : dir_fd, path, flags | O_CLOEXEC | O_NOCTTY | O_NONBLOCK, REDIRECT_MODE);
+    if(fd == -1)
+    {
+        return -1;
+    }
+
+    status_flags = fcntl(fd, F_GETFL);
+    if(status_flags == -1 || fcntl(fd, F_SETFL, status_flags & ~O_NONBLOCK) == -1)
+    {
+        int saved_errno;
+
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+    Creates a pipe that isn't inherited by any other child.
+
+    @param
+    pipe_fds: Receives the read and write ends
+
+    @return
+    0 on success, -1 with errno set
+*/
+static int create_pipe(int pipe_fds[2])
+{
+#if defined(__linux__)
+    return pipe2(pipe_fds, O_CLOEXEC);
+#else
+    if(pipe(pipe_fds) == -1)    // NOLINT(android-cloexec-pipe)
+    {
+        return -1;
+    }
+
+    if(set_cloexec(pipe_fds[0]) == -1 || set_cloexec(pipe_fds[1]) == -1)
+    {
+        int saved_errno;
+
+        saved_errno = errno;
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+#if !defined(HAVE_SPAWN_FCHDIR)
+/*
+    Starts a program in another directory where posix_spawn cannot change directory.
+
+    @param
+    path: Full path of the executable
+    argv: NULL-terminated argument vector, argv[0] included
+    fds: The child's stdin, stdout and stderr, stdin may be -1 to inherit the server's
+    dir_fd: Directory the child starts in
+    group: Process group to join, 0 to lead a new one
+    pid: Receives the child's process id
+
+    @return
+    0 on success, or an errno value
+*/
+static int fork_command(const char *path, char *const argv[], const int fds[3], int dir_fd, pid_t group, pid_t *pid)
+{
+    *pid = fork();
+    if(*pid < 0)
+    {
+        return errno;
+    }
+
+    if(*pid == 0)
+    {
+        if(setpgid(0, group) == -1 || (fds[STDIN_FILENO] != -1 && dup2(fds[STDIN_FILENO], STDIN_FILENO) == -1) || dup2(fds[STDOUT_FILENO], STDOUT_FILENO) == -1 || dup2(fds[STDERR_FILENO], STDERR_FILENO) == -1 || fchdir(dir_fd) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+
+        signal(SIGPIPE, SIG_DFL);
+
+        execv(path, argv);
+        _exit(errno == ENOENT ? CMD_NOT_FOUND : CMD_NOT_EXECUTABLE);
+    }
+
+    return 0;
+}
+#endif
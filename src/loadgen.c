@@ -0,0 +1,887 @@
+#include "loadgen.h"
+#include "setup.h"
+
+/*
+    Opens many connections to the server and sends a weighted mix of commands
+    at a fixed rate, whether or not earlier requests have been answered. Each
+    latency is measured from the moment a request was due, so a stalled server
+    shows up as latency instead of as a lower request rate.
+
+    usage: loadgen [-c connections] [-r rate] [-d seconds] [-m mix] <ip> <port>
+*/
+int main(int argc, char *argv[])
+{
+    char                   *address;
+    char                   *port_str;
+    in_port_t               port;
+    struct sockaddr_storage addr;
+    loadgen_state          *state;
+    const char             *connections_str;
+    const char             *rate_str;
+    const char             *duration_str;
+    const char             *mix;
+    uint64_t                connection_count;
+    uint64_t                start;
+    int                     exit_code;
+    int                     i;
+    const program_option    options[] = {
+        {'c', "connections", "Number of concurrent connections (default 100)",           &connections_str, NULL},
+        {'r', "rate",        "Requests per second across all connections (default 1000)", &rate_str,        NULL},
+        {'d', "seconds",     "How long to send requests for (default 10)",               &duration_str,    NULL},
+        {'m', "mix",         "Weighted commands, e.g. \"6:echo hello,2:pwd,2:uname -a\"", &mix,             NULL},
+    };
+
+    address         = NULL;
+    port_str        = NULL;
+    connections_str = NULL;
+    rate_str        = NULL;
+    duration_str    = NULL;
+    mix             = LOADGEN_DEFAULT_MIX;
+    exit_code       = EXIT_FAILURE;
+
+    parse_arguments(argc, argv, options, sizeof(options) / sizeof(options[0]), &address, &port_str);
+    handle_arguments(argv[0], address, port_str, &port);
+    convert_address(address, &addr);
+
+    // Large enough to be worth allocating, the histograms alone are tens of kilobytes each
+    state = (loadgen_state *)calloc(1, sizeof(loadgen_state));
+    if(state == NULL)
+    {
+        perror("Unable to allocate state");
+        return EXIT_FAILURE;
+    }
+
+    connection_count = LOADGEN_DEFAULT_CONNECTIONS;
+    state->rate      = LOADGEN_DEFAULT_RATE;
+    state->duration  = LOADGEN_DEFAULT_DURATION;
+    state->random    = (uint32_t)getpid() | 1u;
+    if(parse_positive(connections_str, "number of connections", LOADGEN_MAX_CONNECTIONS, &connection_count) == -1 || parse_positive(rate_str, "rate", UINT32_MAX, &state->rate) == -1 ||
+       parse_positive(duration_str, "duration", UINT32_MAX, &state->duration) == -1 || parse_mix(state, mix) == -1)
+    {
+        free(state);
+        return EXIT_FAILURE;
+    }
+
+    state->connection_count = (int)connection_count;
+    state->connections      = (loadgen_connection *)calloc(connection_count, sizeof(loadgen_connection));
+    if(state->connections == NULL || event_loop_create(&state->events, (uint32_t)connection_count) == -1)
+    {
+        perror("Unable to allocate connections");
+        free(state->connections);
+        free(state);
+        return EXIT_FAILURE;
+    }
+
+    setup_signal_handler();
+    raise_fd_limit();
+
+    if(open_connections(state, &addr, port) == 0 && await_greetings(state) == 0)
+    {
+        printf("Sending %llu requests/s over %d connections for %llu s\n", (unsigned long long)state->rate, state->connection_count, (unsigned long long)state->duration);
+        fflush(stdout);
+
+        start = now_nanos();
+        if(run_load(state) == 0)
+        {
+            print_report(state, now_nanos() - start);
+            exit_code = EXIT_SUCCESS;
+        }
+    }
+
+    for(i = 0; i < state->connection_count; i++)
+    {
+        if(state->connections[i].open)
+        {
+            close(state->connections[i].sockfd);
+        }
+    }
+
+    event_loop_destroy(&state->events);
+    free(state->connections);
+    free(state);
+
+    return exit_code;
+}
+
+/*
+    Parses the command mix: comma-separated commands, each optionally prefixed
+    with a weight and a colon.
+
+    @param
+    state: Receives the commands
+    mix: The mix, e.g. "6:echo hello,2:pwd,uname"
+
+    @return
+    0 on success, -1 if the mix is invalid
+*/
+static int parse_mix(loadgen_state *state, const char *mix)
+{
+    const char *entry;
+
+    entry = mix;
+    while(*entry != '\0')
+    {
+        loadgen_command *command;
+        const char      *end;
+        const char      *line;
+        char            *weight_end;
+        unsigned long    weight;
+
+        if(state->command_count == LOADGEN_MAX_COMMANDS)
+        {
+            fprintf(stderr, "The mix can hold at most %d commands\n", LOADGEN_MAX_COMMANDS);
+            return -1;
+        }
+
+        end = strchr(entry, ',');
+        if(end == NULL)
+        {
+            end = entry + strlen(entry);
+        }
+
+        // A leading number followed by ':' is the weight
+        line   = entry;
+        weight = strtoul(entry, &weight_end, BASE_TEN);
+        if(weight_end != entry && weight_end < end && *weight_end == ':')
+        {
+            line = weight_end + 1;
+        }
+        else
+        {
+            weight = 1;
+        }
+
+        command = &state->commands[state->command_count];
+        if(end == line || (size_t)(end - line) >= sizeof(command->line) || weight == 0 || weight > UINT16_MAX)
+        {
+            fprintf(stderr, "Invalid mix entry: %.*s\n", (int)(end - entry), entry);
+            return -1;
+        }
+
+        memcpy(command->line, line, (size_t)(end - line));
+        command->length = (uint32_t)(end - line);
+        command->weight = (uint32_t)weight;
+        state->total_weight += command->weight;
+        state->command_count++;
+
+        entry = *end == ',' ? end + 1 : end;
+    }
+
+    if(state->command_count == 0)
+    {
+        fprintf(stderr, "The mix has no commands\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Parses an optional positive number.
+
+    @param
+    text: The number, or NULL to keep the default
+    name: What the number is, for the error message
+    max: The largest allowed value
+    value: Receives the number
+
+    @return
+    0 on success, -1 if the number is invalid
+*/
+static int parse_positive(const char *text, const char *name, uint64_t max, uint64_t *value)
+{
+    char              *endptr;
+    unsigned long long parsed;
+
+    if(text == NULL)
+    {
+        return 0;
+    }
+
+    errno  = 0;
+    parsed = strtoull(text, &endptr, BASE_TEN);
+    if(errno != 0 || *endptr != '\0' || *text == '-' || parsed < 1 || parsed > max)
+    {
+        fprintf(stderr, "The %s must be between 1 and %llu\n", name, (unsigned long long)max);
+        return -1;
+    }
+
+    *value = parsed;
+    return 0;
+}
+
+/*
+    Connects every connection and sends its HELLO frame. Replies are received
+    by the event loop.
+
+    @param
+    state: The load generator
+    addr: The server address
+    port: The server port
+
+    @return
+    0 on success, -1 on failure
+*/
+static int open_connections(loadgen_state *state, const struct sockaddr_storage *addr, in_port_t port)
+{
+    struct sockaddr_storage target;
+    socklen_t               addr_len;
+    uint8_t                 version[sizeof(uint32_t)];
+    int                     i;
+
+    target = *addr;
+    if(target.ss_family == AF_INET)
+    {
+        ((struct sockaddr_in *)&target)->sin_port = htons(port);
+        addr_len                                  = sizeof(struct sockaddr_in);
+    }
+    else
+    {
+        ((struct sockaddr_in6 *)&target)->sin6_port = htons(port);
+        addr_len                                    = sizeof(struct sockaddr_in6);
+    }
+
+    frame_encode_u32(version, PROTOCOL_VERSION);
+
+    for(i = 0; i < state->connection_count && !exit_flag; i++)
+    {
+        loadgen_connection *connection;
+
+        connection         = &state->connections[i];
+        connection->sockfd = socket(target.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(connection->sockfd == -1)
+        {
+            fprintf(stderr, "Unable to create connection %d: %s\n", i, strerror(errno));
+            return -1;
+        }
+
+        if(connect(connection->sockfd, (struct sockaddr *)&target, addr_len) == -1)
+        {
+            fprintf(stderr, "Unable to open connection %d: %s\n", i, strerror(errno));
+            close(connection->sockfd);
+            return -1;
+        }
+        connection->open = true;
+
+        // Sends stay blocking, a pipeline of small frames never fills the socket buffer
+        if(event_add(&state->events, connection->sockfd, 0, (uint32_t)i) == -1 || frame_send(connection->sockfd, FRAME_HELLO, 0, 0, 0, version, sizeof(version)) == -1)
+        {
+            fprintf(stderr, "Unable to greet the server on connection %d: %s\n", i, strerror(errno));
+            return -1;
+        }
+    }
+
+    return exit_flag ? -1 : 0;
+}
+
+/*
+    Waits until the server has answered every HELLO.
+
+    @param
+    state: The load generator
+
+    @return
+    0 once every connection is greeted, -1 on failure or timeout
+*/
+static int await_greetings(loadgen_state *state)
+{
+    uint64_t deadline;
+    int      greeted;
+    int      i;
+
+    deadline = now_nanos() + (LOADGEN_DRAIN_SECONDS * NANOS_PER_SEC);
+    for(;;)
+    {
+        event_record records[EVENT_BATCH];
+        int          count;
+
+        greeted = 0;
+        for(i = 0; i < state->connection_count; i++)
+        {
+            greeted += state->connections[i].greeted;
+        }
+
+        if(greeted == state->connection_count)
+        {
+            return 0;
+        }
+
+        if(exit_flag || now_nanos() >= deadline || state->lost > 0)
+        {
+            fprintf(stderr, "Only %d of %d connections completed the handshake\n", greeted, state->connection_count);
+            return -1;
+        }
+
+        count = event_wait(&state->events, records, EVENT_BATCH, (int)(NANOS_PER_SEC / NANOS_PER_MILLI / 10));
+        for(i = 0; i < count; i++)
+        {
+            receive_frames(state, &state->connections[records[i].token]);
+        }
+    }
+}
+
+/*
+    Sends requests on schedule for the configured duration, then waits for the
+    outstanding ones to be answered.
+
+    @param
+    state: The load generator
+
+    @return
+    0 on success, -1 if the event loop failed
+*/
+static int run_load(loadgen_state *state)
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t total;
+    uint64_t drain_end;
+    uint64_t outstanding;
+
+    start = now_nanos();
+    end   = start + (state->duration * NANOS_PER_SEC);
+    total = state->rate * state->duration;
+
+    // Open loop: request k is due at start + k / rate no matter how the server is keeping up
+    for(;;)
+    {
+        event_record records[EVENT_BATCH];
+        uint64_t     now;
+        uint64_t     due;
+        int          timeout;
+        int          count;
+        int          i;
+
+        now = now_nanos();
+        due = start + (uint64_t)(((double)state->issued * (double)NANOS_PER_SEC) / (double)state->rate);
+        while(!exit_flag && state->issued < total && due <= now && issue_request(state, due))
+        {
+            due = start + (uint64_t)(((double)state->issued * (double)NANOS_PER_SEC) / (double)state->rate);
+        }
+
+        outstanding = state->issued - state->completed - state->lost;
+        if(exit_flag || ((state->issued == total || now >= end) && outstanding == 0))
+        {
+            break;
+        }
+
+        drain_end = (end > due ? end : due) + (LOADGEN_DRAIN_SECONDS * NANOS_PER_SEC);
+        if(now >= drain_end)
+        {
+            fprintf(stderr, "Gave up waiting for %llu requests\n", (unsigned long long)outstanding);
+            break;
+        }
+
+        // Sleep until the next request is due, spinning for the last millisecond
+        timeout = (int)(NANOS_PER_SEC / NANOS_PER_MILLI / 10);
+        if(state->issued < total && now < end)
+        {
+            timeout = due > now ? (int)((due - now) / NANOS_PER_MILLI) : 0;
+        }
+
+        count = event_wait(&state->events, records, EVENT_BATCH, timeout);
+        if(count == -1 && errno != EINTR)
+        {
+            perror("event_wait");
+            return -1;
+        }
+
+        for(i = 0; i < count; i++)
+        {
+            receive_frames(state, &state->connections[records[i].token]);
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Sends the next request on the next connection that has room in its pipeline.
+
+    @param
+    state: The load generator
+    due: When the request was due
+
+    @return
+    true if the request was sent, false if every connection is saturated
+*/
+static bool issue_request(loadgen_state *state, uint64_t due)
+{
+    int n;
+
+    for(n = 0; n < state->connection_count; n++)
+    {
+        loadgen_connection *connection;
+        int                 command;
+        uint32_t            tail;
+
+        connection             = &state->connections[state->next_connection];
+        state->next_connection = (state->next_connection + 1) % (uint32_t)state->connection_count;
+        if(!connection->open || connection->in_flight == LOADGEN_PIPELINE)
+        {
+            continue;
+        }
+
+        command = pick_command(state);
+        connection->next_request_id++;
+        if(frame_send(connection->sockfd, FRAME_COMMAND, 0, 0, connection->next_request_id, state->commands[command].line, state->commands[command].length) == -1)
+        {
+            close_connection(state, connection);
+            continue;
+        }
+
+        tail                      = (connection->head + connection->in_flight) & (LOADGEN_PIPELINE - 1);
+        connection->sent_at[tail] = due;
+        connection->command[tail] = (uint8_t)command;
+        connection->in_flight++;
+        state->issued++;
+
+        return true;
+    }
+
+    return false;
+}
+
+/*
+    Reads everything a connection has received.
+
+    @param
+    state: The load generator
+    connection: The connection that became readable
+
+    @return
+    0 on success, -1 if the connection was closed
+*/
+static int receive_frames(loadgen_state *state, loadgen_connection *connection)
+{
+    static uint8_t buffer[LOADGEN_RECV_BUFFER];
+
+    while(connection->open)
+    {
+        ssize_t bytes_read;
+
+        bytes_read = recv(connection->sockfd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if(bytes_read > 0)
+        {
+            process_bytes(state, connection, buffer, (size_t)bytes_read);
+            continue;
+        }
+
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_read == -1 && errno == EAGAIN)
+        {
+            return 0;
+        }
+
+        close_connection(state, connection);
+    }
+
+    return -1;
+}
+
+/*
+    Walks received bytes frame by frame. Output payloads are skipped, only
+    HELLO and STATUS frames matter to the measurement.
+
+    @param
+    state: The load generator
+    connection: The connection the bytes arrived on
+    data: The bytes
+    length: The number of bytes
+*/
+static void process_bytes(loadgen_state *state, loadgen_connection *connection, const uint8_t *data, size_t length)
+{
+    while(length > 0 && connection->open)
+    {
+        frame_header header;
+        size_t       needed;
+        size_t       chunk;
+
+        if(connection->skip > 0)
+        {
+            chunk = length < connection->skip ? length : connection->skip;
+            connection->skip -= (uint32_t)chunk;
+            data += chunk;
+            length -= chunk;
+            continue;
+        }
+
+        // A STATUS frame is only complete with its payload
+        needed = FRAME_HEADER_SIZE;
+        if(connection->pending_len >= FRAME_HEADER_SIZE && connection->pending[0] == FRAME_STATUS)
+        {
+            needed += sizeof(uint32_t);
+        }
+
+        chunk = needed - connection->pending_len;
+        chunk = length < chunk ? length : chunk;
+        memcpy(connection->pending + connection->pending_len, data, chunk);
+        connection->pending_len += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if(connection->pending_len < needed || (needed == FRAME_HEADER_SIZE && connection->pending[0] == FRAME_STATUS))
+        {
+            continue;
+        }
+
+        frame_decode_header(connection->pending, &header);
+        connection->pending_len = 0;
+
+        if(header.type == FRAME_STATUS)
+        {
+            complete_request(state, connection, (int32_t)frame_decode_u32(connection->pending + FRAME_HEADER_SIZE));
+            continue;
+        }
+
+        if(header.type == FRAME_HELLO)
+        {
+            connection->greeted = true;
+        }
+
+        if(header.length > FRAME_MAX_PAYLOAD)
+        {
+            close_connection(state, connection);
+            return;
+        }
+        connection->skip = header.length;
+    }
+}
+
+/*
+    Records the latency of the oldest outstanding request on a connection.
+
+    @param
+    state: The load generator
+    connection: The connection the STATUS frame arrived on
+    status: The command's exit status
+*/
+static void complete_request(loadgen_state *state, loadgen_connection *connection, int32_t status)
+{
+    loadgen_command *command;
+    uint64_t         latency;
+    uint64_t         now;
+
+    if(connection->in_flight == 0)
+    {
+        return;
+    }
+
+    now     = now_nanos();
+    command = &state->commands[connection->command[connection->head]];
+    latency = now > connection->sent_at[connection->head] ? now - connection->sent_at[connection->head] : 0;
+
+    connection->head = (connection->head + 1) & (LOADGEN_PIPELINE - 1);
+    connection->in_flight--;
+
+    histogram_record(&state->latency, latency);
+    histogram_record(&command->latency, latency);
+    command->completed++;
+    state->completed++;
+
+    if(status != 0)
+    {
+        command->failed++;
+        state->failed++;
+    }
+}
+
+/*
+    Closes a connection, counting its outstanding requests as lost.
+
+    @param
+    state: The load generator
+    connection: The connection to close
+*/
+static void close_connection(loadgen_state *state, loadgen_connection *connection)
+{
+    if(!connection->open)
+    {
+        return;
+    }
+
+    fprintf(stderr, "Server closed a connection with %u requests outstanding\n", connection->in_flight);
+    event_del(&state->events, connection->sockfd);
+    close(connection->sockfd);
+    state->lost += connection->in_flight;
+    connection->in_flight = 0;
+    connection->open      = false;
+}
+
+/*
+    Chooses a command from the mix by weight.
+
+    @param
+    state: The load generator
+
+    @return
+    Index of the command
+*/
+static int pick_command(loadgen_state *state)
+{
+    uint32_t pick;
+    int      i;
+
+    // xorshift32, the mix only needs to be even, not unpredictable
+    state->random ^= state->random << 13;
+    state->random ^= state->random >> 17;
+    state->random ^= state->random << 5;
+
+    pick = state->random % state->total_weight;
+    for(i = 0; i < state->command_count - 1; i++)
+    {
+        if(pick < state->commands[i].weight)
+        {
+            break;
+        }
+        pick -= state->commands[i].weight;
+    }
+
+    return i;
+}
+
+/*
+    Reads the monotonic clock.
+
+    @return
+    Nanoseconds on CLOCK_MONOTONIC
+*/
+static uint64_t now_nanos(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NANOS_PER_SEC) + (uint64_t)now.tv_nsec;
+}
+
+/*
+    Adds a latency to a histogram. Values below HISTOGRAM_SUB_COUNT get a bucket
+    each, every power of two above that is split into HISTOGRAM_HALF_COUNT buckets.
+
+    @param
+    histogram: The histogram
+    value: The latency in nanoseconds
+*/
+static void histogram_record(latency_histogram *histogram, uint64_t value)
+{
+    uint32_t index;
+    uint32_t shift;
+
+    index = (uint32_t)value;
+    if(value >= HISTOGRAM_SUB_COUNT)
+    {
+        shift = (uint32_t)(63 - __builtin_clzll(value)) - (HISTOGRAM_SUB_BITS - 1);
+        if(shift > HISTOGRAM_MAX_SHIFT)
+        {
+            shift = HISTOGRAM_MAX_SHIFT;
+            value = ((uint64_t)HISTOGRAM_SUB_COUNT << shift) - 1;
+        }
+        index = HISTOGRAM_SUB_COUNT + ((shift - 1) * HISTOGRAM_HALF_COUNT) + (uint32_t)(value >> shift) - HISTOGRAM_HALF_COUNT;
+    }
+
+    histogram->counts[index]++;
+    histogram->total++;
+    histogram->sum += value;
+    if(value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+/*
+    Finds the latency at a percentile.
+
+    @param
+    histogram: The histogram
+    percentile: Between 0 and 100
+
+    @return
+    The highest latency in the bucket the percentile falls in, in nanoseconds
+*/
+static uint64_t histogram_value_at(const latency_histogram *histogram, double percentile)
+{
+    uint64_t wanted;
+    uint64_t seen;
+    uint32_t i;
+
+    wanted = (uint64_t)((percentile / 100.0 * (double)histogram->total) + 0.5);
+    if(wanted == 0)
+    {
+        wanted = 1;
+    }
+
+    seen = 0;
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if(seen >= wanted)
+        {
+            uint64_t value;
+
+            value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+/*
+    Gives the highest value a bucket holds.
+
+    @param
+    index: The bucket
+
+    @return
+    The value in nanoseconds
+*/
+static uint64_t bucket_value(uint32_t index)
+{
+    uint32_t shift;
+    uint64_t sub_bucket;
+
+    if(index < HISTOGRAM_SUB_COUNT)
+    {
+        return index;
+    }
+
+    shift      = ((index - HISTOGRAM_SUB_COUNT) / HISTOGRAM_HALF_COUNT) + 1;
+    sub_bucket = ((index - HISTOGRAM_SUB_COUNT) % HISTOGRAM_HALF_COUNT) + HISTOGRAM_HALF_COUNT;
+
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+/*
+    Prints throughput, the latency percentiles of each command and the
+    percentile distribution of all requests.
+
+    @param
+    state: The load generator
+    elapsed: Nanoseconds from the first request to the last reply
+*/
+static void print_report(const loadgen_state *state, uint64_t elapsed)
+{
+    double seconds;
+    int    i;
+
+    seconds = (double)elapsed / (double)NANOS_PER_SEC;
+
+    printf("\nRequests: %llu sent, %llu completed, %llu failed, %llu lost in %.2f s\n",
+           (unsigned long long)state->issued,
+           (unsigned long long)state->completed,
+           (unsigned long long)state->failed,
+           (unsigned long long)state->lost,
+           seconds);
+    printf("Throughput: %.1f requests/s (target %llu)\n\n", seconds > 0 ? (double)state->completed / seconds : 0.0, (unsigned long long)state->rate);
+
+    printf("%-32s %10s %10s %10s %10s %10s %10s\n", "command", "count", "p50 us", "p99 us", "p99.9 us", "max us", "failed");
+    for(i = 0; i < state->command_count; i++)
+    {
+        const loadgen_command *command;
+
+        command = &state->commands[i];
+        printf("%-32.32s %10llu %10.1f %10.1f %10.1f %10.1f %10llu\n",
+               command->line,
+               (unsigned long long)command->completed,
+               (double)histogram_value_at(&command->latency, 50.0) / NANOS_PER_MICRO,
+               (double)histogram_value_at(&command->latency, 99.0) / NANOS_PER_MICRO,
+               (double)histogram_value_at(&command->latency, 99.9) / NANOS_PER_MICRO,
+               (double)command->latency.max / NANOS_PER_MICRO,
+               (unsigned long long)command->failed);
+    }
+
+    if(state->latency.total > 0)
+    {
+        printf("\n");
+        print_distribution(&state->latency);
+    }
+}
+
+/*
+    Prints a percentile distribution in the layout of HdrHistogram's
+    outputPercentileDistribution, with a fixed number of rows per halving of
+    the distance to 100%.
+
+    @param
+    histogram: The histogram
+*/
+static void print_distribution(const latency_histogram *histogram)
+{
+    double remaining;
+
+    printf("%12s %14s %10s %14s\n\n", "Value(us)", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    // Stop once the rows are finer than a single request
+    for(remaining = 100.0; remaining * (double)histogram->total >= 100.0; remaining /= 2)
+    {
+        int tick;
+
+        for(tick = 0; tick < LOADGEN_PERCENTILE_TICKS; tick++)
+        {
+            double percentile;
+
+            percentile = 100.0 - remaining + (remaining / 2 * tick / LOADGEN_PERCENTILE_TICKS);
+            printf("%12.3f %14.12f %10llu %14.2f\n",
+                   (double)histogram_value_at(histogram, percentile) / NANOS_PER_MICRO,
+                   percentile / 100.0,
+                   (unsigned long long)((percentile / 100.0 * (double)histogram->total) + 0.5),
+                   100.0 / (100.0 - percentile));
+        }
+    }
+
+    printf("%12.3f %14.12f %10llu %14s\n", (double)histogram->max / NANOS_PER_MICRO, 1.0, (unsigned long long)histogram->total, "inf");
+    printf("#[Mean    = %12.3f, Max     = %12.3f]\n", (double)histogram->sum / (double)histogram->total / NANOS_PER_MICRO, (double)histogram->max / NANOS_PER_MICRO);
+    printf("#[Total count    = %12llu]\n", (unsigned long long)histogram->total);
+}
+
+/*
+    Raises the soft descriptor limit to the hard limit, every connection is a descriptor.
+*/
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/*
+    Sets up a signal handler that stops the run early and still prints the report.
+*/
+static void setup_signal_handler(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigint_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sigaction(SIGINT, &sa, NULL);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/*
+    Handles SIGINT by setting a flag to end the run.
+
+    @param
+    signum: The received signal number
+*/
+static void sigint_handler(int signum)
+{
+    exit_flag = EXIT_CODE;
+}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,441 @@
+#include "logger.h"
+
+#define NANOS_PER_SEC 1000000000L
+#define NANOS_PER_MILLI 1000000L
+
+// One formatted message
+typedef struct
+{
+    uint32_t length;
+    int      level;
+    char     text[LOGGER_LINE_MAX];
+} logger_record;
+
+// Messages of one thread on their way to the flusher. The thread only moves
+// head and the flusher only moves tail, so neither ever waits for the other.
+typedef struct
+{
+    uint32_t      head;    // Next record the thread writes
+    uint64_t      dropped;
+    logger_record records[LOGGER_RING_RECORDS];
+    uint32_t      tail;    // Next record the flusher reads, kept away from head's cache line
+} logger_ring;
+
+// Output collected for one stream before it is written
+typedef struct
+{
+    int    fd;
+    size_t length;
+    char   data[LOGGER_BATCH_SIZE];
+} logger_batch;
+
+static logger_ring *thread_ring_get(void);
+static void        *flusher_thread(void *arg);
+static void         drain_rings(void);
+static void         batch_add(logger_batch *batch, const char *data, size_t length);
+static void         batch_flush(logger_batch *batch);
+
+int logger_threshold = LOG_LEVEL_OFF;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static logger_ring *rings[LOGGER_MAX_RINGS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint32_t     ring_count;                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t     unregistered_drops;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t     reported_drops;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static _Thread_local logger_ring *thread_ring;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static _Thread_local bool         thread_ring_failed;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// The flusher holds drain_lock while it reads the rings, logger_fork takes it to hand the child empty rings
+static pthread_mutex_t drain_lock   = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_cond_t  flusher_wake = PTHREAD_COND_INITIALIZER;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_t       flusher;                                     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static bool            flusher_running;                             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static bool            flusher_stopping;                            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static logger_batch    out_batch;                                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static logger_batch    err_batch;                                   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Names accepted by logger_parse_level, indexed by level
+static const char *const level_names[] = {"error", "warn", "info", "debug"};
+
+/*
+    Converts a level name given on the command line.
+
+    @param
+    name: error, warn, info or debug
+    level: Receives the level
+
+    @return
+    0 on success, -1 if the name is not a level
+*/
+int logger_parse_level(const char *name, enum logger_level *level)
+{
+    size_t i;
+
+    for(i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+    {
+        if(strcmp(level_names[i], name) == 0)
+        {
+            *level = (enum logger_level)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Starts the flusher thread and begins keeping messages up to a level.
+    Info and debug messages go to stdout, warnings and errors to stderr.
+
+    @param
+    level: The most verbose level kept
+
+    @return
+    0 on success, -1 on failure
+*/
+int logger_start(enum logger_level level)
+{
+    out_batch.fd     = STDOUT_FILENO;
+    out_batch.length = 0;
+    err_batch.fd     = STDERR_FILENO;
+    err_batch.length = 0;
+
+    flusher_stopping = false;
+    if(pthread_create(&flusher, NULL, flusher_thread, NULL) != 0)
+    {
+        return -1;
+    }
+
+    flusher_running = true;
+    __atomic_store_n(&logger_threshold, (int)level, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+    Writes every message that is still queued and stops the flusher. Messages
+    logged after this are discarded.
+*/
+void logger_stop(void)
+{
+    uint32_t count;
+    uint32_t i;
+
+    __atomic_store_n(&logger_threshold, LOG_LEVEL_OFF, __ATOMIC_RELAXED);
+    if(!flusher_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&drain_lock);
+    flusher_stopping = true;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_join(flusher, NULL);
+    flusher_running = false;
+
+    // Every other thread that logged has finished by now
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    count = count < LOGGER_MAX_RINGS ? count : LOGGER_MAX_RINGS;
+    for(i = 0; i < count; i++)
+    {
+        free(rings[i]);
+        rings[i] = NULL;
+    }
+    ring_count  = 0;
+    thread_ring = NULL;
+}
+
+/*
+    Queues a message for the flusher. The calling thread never blocks: when its
+    ring is full the message is dropped and counted. Use LOG_AT instead of
+    calling this directly, so disabled levels are skipped before formatting.
+
+    @param
+    level: Severity of the message
+    format: printf format, the message should end with a newline
+*/
+void logger_write(enum logger_level level, const char *format, ...)
+{
+    logger_ring   *ring;
+    logger_record *record;
+    va_list        list;
+    uint32_t       head;
+    int            length;
+
+    ring = thread_ring_get();
+    if(ring == NULL)
+    {
+        __atomic_add_fetch(&unregistered_drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    head = ring->head;
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOGGER_RING_RECORDS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[head & (LOGGER_RING_RECORDS - 1)];
+    va_start(list, format);
+    length = vsnprintf(record->text, sizeof(record->text), format, list);
+    va_end(list);
+
+    if(length < 0)
+    {
+        return;
+    }
+
+    // A truncated message still ends its line
+    if((size_t)length >= sizeof(record->text))
+    {
+        length                   = (int)sizeof(record->text) - 1;
+        record->text[length - 1] = '\n';
+    }
+
+    record->length = (uint32_t)length;
+    record->level  = (int)level;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Counts the messages dropped because a ring was full.
+
+    @return
+    Messages dropped since the logger started
+*/
+uint64_t logger_dropped(void)
+{
+    uint64_t dropped;
+    uint32_t count;
+    uint32_t i;
+
+    dropped = __atomic_load_n(&unregistered_drops, __ATOMIC_RELAXED);
+    count   = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    count   = count < LOGGER_MAX_RINGS ? count : LOGGER_MAX_RINGS;
+    for(i = 0; i < count; i++)
+    {
+        const logger_ring *ring;
+
+        ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if(ring != NULL)
+        {
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        }
+    }
+
+    return dropped;
+}
+
+/*
+    Finds the calling thread's ring, creating it on the thread's first message.
+
+    @return
+    The ring, or NULL if the thread can't have one
+*/
+static logger_ring *thread_ring_get(void)
+{
+    uint32_t index;
+
+    if(thread_ring != NULL || thread_ring_failed)
+    {
+        return thread_ring;
+    }
+
+    index = __atomic_fetch_add(&ring_count, 1, __ATOMIC_ACQ_REL);
+    if(index >= LOGGER_MAX_RINGS)
+    {
+        thread_ring_failed = true;
+        return NULL;
+    }
+
+    thread_ring = (logger_ring *)calloc(1, sizeof(logger_ring));
+    if(thread_ring == NULL)
+    {
+        thread_ring_failed = true;
+        return NULL;
+    }
+
+    // The flusher skips the slot until the ring is published
+    __atomic_store_n(&rings[index], thread_ring, __ATOMIC_RELEASE);
+
+    return thread_ring;
+}
+
+/*
+    Writes queued messages in batches until the logger is stopped.
+
+    @param
+    arg: Unused
+
+    @return
+    NULL
+*/
+static void *flusher_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&drain_lock);
+    while(!flusher_stopping)
+    {
+        struct timespec deadline;
+
+        drain_rings();
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOGGER_FLUSH_INTERVAL_MS * NANOS_PER_MILLI;
+        if(deadline.tv_nsec >= NANOS_PER_SEC)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= NANOS_PER_SEC;
+        }
+        pthread_cond_timedwait(&flusher_wake, &drain_lock, &deadline);
+    }
+
+    drain_rings();
+    pthread_mutex_unlock(&drain_lock);
+
+    return NULL;
+}
+
+/*
+    Moves every queued message into the stream batches and writes them out.
+    Called with drain_lock held.
+*/
+static void drain_rings(void)
+{
+    uint32_t count;
+    uint32_t i;
+    uint64_t dropped;
+
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    count = count < LOGGER_MAX_RINGS ? count : LOGGER_MAX_RINGS;
+    for(i = 0; i < count; i++)
+    {
+        logger_ring *ring;
+        uint32_t     tail;
+        uint32_t     head;
+
+        ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if(ring == NULL)
+        {
+            continue;
+        }
+
+        tail = ring->tail;
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for(; tail != head; tail++)
+        {
+            const logger_record *record;
+
+            record = &ring->records[tail & (LOGGER_RING_RECORDS - 1)];
+            batch_add(record->level <= LOG_LEVEL_WARN ? &err_batch : &out_batch, record->text, record->length);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    dropped = logger_dropped();
+    if(dropped != reported_drops)
+    {
+        char line[LOGGER_LINE_MAX];
+        int  length;
+
+        length = snprintf(line, sizeof(line), "[log] %llu messages dropped\n", (unsigned long long)(dropped - reported_drops));
+        batch_add(&err_batch, line, (size_t)length);
+        reported_drops = dropped;
+    }
+
+    batch_flush(&out_batch);
+    batch_flush(&err_batch);
+}
+
+/*
+    Appends a message to a batch, writing the batch out first when it is full.
+
+    @param
+    batch: The stream's batch
+    data: The message
+    length: Bytes in the message
+*/
+static void batch_add(logger_batch *batch, const char *data, size_t length)
+{
+    if(length > sizeof(batch->data) - batch->length)
+    {
+        batch_flush(batch);
+    }
+
+    memcpy(batch->data + batch->length, data, length);
+    batch->length += length;
+}
+
+/*
+    Writes a batch to its stream. Output the stream won't take is discarded.
+
+    @param
+    batch: The stream's batch
+*/
+static void batch_flush(logger_batch *batch)
+{
+    size_t written;
+
+    written = 0;
+    while(written < batch->length)
+    {
+        ssize_t result;
+
+        result = write(batch->fd, batch->data + written, batch->length - written);
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        written += (size_t)result;
+    }
+
+    batch->length = 0;
+}
+
+/*
+    Forks a process that keeps logging. Queued messages are written first so the
+    child starts with empty rings, and the child gets a flusher of its own since
+    the parent's does not survive the fork. Commands are started with
+    spawn_command instead, their children never log.
+
+    @return
+    As fork(2)
+*/
+pid_t logger_fork(void)
+{
+    pid_t pid;
+
+    if(!flusher_running)
+    {
+        return fork();
+    }
+
+    pthread_mutex_lock(&drain_lock);
+    drain_rings();
+    pid = fork();
+    if(pid != 0)
+    {
+        pthread_mutex_unlock(&drain_lock);
+        return pid;
+    }
+
+    pthread_mutex_unlock(&drain_lock);
+    pthread_cond_init(&flusher_wake, NULL);
+    flusher_stopping = false;
+    if(pthread_create(&flusher, NULL, flusher_thread, NULL) != 0)
+    {
+        flusher_running = false;
+        __atomic_store_n(&logger_threshold, LOG_LEVEL_OFF, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
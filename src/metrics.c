@@ -0,0 +1,495 @@
+#include "metrics.h"
+#include "server.h"
+#include <stdarg.h>
+
+#define METRICS_BACKLOG 16
+#define METRICS_SOCKET_MODE 0600
+
+// Text being built in a caller's buffer
+typedef struct
+{
+    char  *buffer;
+    size_t size;
+    size_t length;
+    bool   truncated;
+} metrics_text;
+
+static void  text_append(metrics_text *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void  text_describe(metrics_text *text, const char *name, const char *type, const char *help);
+static void  text_value(metrics_text *text, const char *name, const char *labels, uint64_t value);
+static void *endpoint_thread(void *arg);
+static void  serve_scrape(const metrics_endpoint *endpoint, int client_fd);
+static int   send_all(int fd, const char *data, size_t length);
+
+// Label of each FSM state, in the order of enum application_states
+static const char *const state_names[METRICS_STATES] = {
+    "wait_for_cmd",
+    "parse_cmd",
+    "check_cmd_type",
+    "invalid_cmd",
+    "execute_built_in",
+    "search_for_cmd",
+    "execute_cmd",
+    "send_output",
+    "cleanup",
+    "error",
+};
+
+// Label of each kind of command, in the order of enum metrics_command
+static const char *const command_names[METRICS_COMMAND_KINDS] = {
+    "builtin",
+    "fast_path",
+    "external",
+    "cached",
+    "invalid",
+};
+
+/*
+    Adds to a counter or gauge. Only the owning reactor writes its metrics, so
+    a plain read and write are enough as long as readers never see a torn value.
+
+    @param
+    value: The counter or gauge
+    amount: What to add
+*/
+void metrics_add(uint64_t *value, uint64_t amount)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/*
+    Subtracts from a gauge.
+
+    @param
+    value: The gauge
+    amount: What to subtract
+*/
+void metrics_sub(uint64_t *value, uint64_t amount)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) - amount, __ATOMIC_RELAXED);
+}
+
+/*
+    Adds up the metrics of every reactor.
+
+    @param
+    reactors: The reactors of the process
+    reactor_count: Number of reactors
+    total: Receives the sums
+*/
+void metrics_collect(const struct server_data *reactors, int reactor_count, server_metrics *total)
+{
+    int i;
+
+    memset(total, 0, sizeof(*total));
+    total->log_dropped = logger_dropped();
+    for(i = 0; i < reactor_count; i++)
+    {
+        const server_metrics *metrics;
+        size_t                n;
+
+        metrics                = &reactors[i].metrics;
+        total->accepted       += __atomic_load_n(&metrics->accepted, __ATOMIC_RELAXED);
+        total->rejected       += __atomic_load_n(&metrics->rejected, __ATOMIC_RELAXED);
+        total->sessions       += __atomic_load_n(&metrics->sessions, __ATOMIC_RELAXED);
+        total->channels       += __atomic_load_n(&metrics->channels, __ATOMIC_RELAXED);
+        total->children       += __atomic_load_n(&metrics->children, __ATOMIC_RELAXED);
+        total->spawn_failures += __atomic_load_n(&metrics->spawn_failures, __ATOMIC_RELAXED);
+        total->timed_out      += __atomic_load_n(&metrics->timed_out, __ATOMIC_RELAXED);
+        total->idle_closed    += __atomic_load_n(&metrics->idle_closed, __ATOMIC_RELAXED);
+        total->output_stalls  += __atomic_load_n(&metrics->output_stalls, __ATOMIC_RELAXED);
+        total->bytes_in       += __atomic_load_n(&metrics->bytes_in, __ATOMIC_RELAXED);
+        total->bytes_out      += __atomic_load_n(&metrics->bytes_out, __ATOMIC_RELAXED);
+
+        for(n = 0; n < METRICS_STATES; n++)
+        {
+            total->states[n] += __atomic_load_n(&metrics->states[n], __ATOMIC_RELAXED);
+        }
+
+        for(n = 0; n < METRICS_COMMAND_KINDS; n++)
+        {
+            total->commands[n] += __atomic_load_n(&metrics->commands[n], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+    Writes metrics in the Prometheus text exposition format.
+
+    @param
+    total: The metrics, usually from metrics_collect
+    buffer: Receives the text, NUL-terminated
+    size: Size of the buffer
+
+    @return
+    Length of the text, or -1 if it did not fit
+*/
+int metrics_format(const server_metrics *total, char *buffer, size_t size)
+{
+    metrics_text text;
+    char         labels[METRICS_LABEL_SIZE];
+    size_t       n;
+
+    text.buffer    = buffer;
+    text.size      = size;
+    text.length    = 0;
+    text.truncated = size == 0;
+
+    text_describe(&text, "connections_accepted_total", "counter", "Connections given a session.");
+    text_value(&text, "connections_accepted_total", NULL, total->accepted);
+    text_describe(&text, "connections_rejected_total", "counter", "Connections turned away because every session slot was taken.");
+    text_value(&text, "connections_rejected_total", NULL, total->rejected);
+    text_describe(&text, "sessions_active", "gauge", "Connected sessions.");
+    text_value(&text, "sessions_active", NULL, total->sessions);
+    text_describe(&text, "channels_open", "gauge", "Sessions opened on a channel of a connection.");
+    text_value(&text, "channels_open", NULL, total->channels);
+    text_describe(&text, "children_running", "gauge", "Child processes started for commands that have not been reaped.");
+    text_value(&text, "children_running", NULL, total->children);
+
+    text_describe(&text, "fsm_state_entries_total", "counter", "Times the request state machine entered each state.");
+    for(n = 0; n < METRICS_STATES; n++)
+    {
+        snprintf(labels, sizeof(labels), "state=\"%s\"", state_names[n]);
+        text_value(&text, "fsm_state_entries_total", labels, total->states[n]);
+    }
+
+    text_describe(&text, "commands_total", "counter", "Commands by how they were answered.");
+    for(n = 0; n < METRICS_COMMAND_KINDS; n++)
+    {
+        snprintf(labels, sizeof(labels), "kind=\"%s\"", command_names[n]);
+        text_value(&text, "commands_total", labels, total->commands[n]);
+    }
+
+    text_describe(&text, "spawn_failures_total", "counter", "External commands whose process could not be started.");
+    text_value(&text, "spawn_failures_total", NULL, total->spawn_failures);
+    text_describe(&text, "commands_timed_out_total", "counter", "Commands terminated for running past their deadline.");
+    text_value(&text, "commands_timed_out_total", NULL, total->timed_out);
+    text_describe(&text, "sessions_idle_closed_total", "counter", "Sessions closed after sending nothing for the idle timeout.");
+    text_value(&text, "sessions_idle_closed_total", NULL, total->idle_closed);
+    text_describe(&text, "output_stalls_total", "counter", "Times a client's socket was full and output was queued until it drained.");
+    text_value(&text, "output_stalls_total", NULL, total->output_stalls);
+    text_describe(&text, "received_bytes_total", "counter", "Bytes read from client sockets.");
+    text_value(&text, "received_bytes_total", NULL, total->bytes_in);
+    text_describe(&text, "sent_bytes_total", "counter", "Bytes written or queued for client sockets, frame headers included.");
+    text_value(&text, "sent_bytes_total", NULL, total->bytes_out);
+    text_describe(&text, "log_dropped_total", "counter", "Log messages dropped because a thread's log buffer was full.");
+    text_value(&text, "log_dropped_total", NULL, total->log_dropped);
+
+    return text.truncated ? -1 : (int)text.length;
+}
+
+/*
+    Starts serving metrics on a Unix socket from a thread of its own. A stale
+    socket left at the path by an earlier run is replaced.
+
+    @param
+    endpoint: The endpoint to start
+    path: Where the socket is created
+    reactors: The reactors whose metrics are served
+    reactor_count: Number of reactors
+
+    @return
+    0 on success, -1 on failure
+*/
+int metrics_endpoint_start(metrics_endpoint *endpoint, const char *path, const struct server_data *reactors, int reactor_count)
+{
+    struct sockaddr_un addr;
+    struct stat        st;
+
+    memset(endpoint, 0, sizeof(*endpoint));
+    endpoint->listen_fd     = -1;
+    endpoint->stop_pipe[0]  = -1;
+    endpoint->stop_pipe[1]  = -1;
+    endpoint->path          = path;
+    endpoint->reactors      = reactors;
+    endpoint->reactor_count = reactor_count;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    // Only a socket is replaced, never a file that happens to have the same name
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    endpoint->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(endpoint->listen_fd == -1)
+    {
+        return -1;
+    }
+
+    if(bind(endpoint->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        goto close_listener;
+    }
+
+    // The metrics describe what clients run, keep them to the server's user
+    if(chmod(path, METRICS_SOCKET_MODE) == -1 || listen(endpoint->listen_fd, METRICS_BACKLOG) == -1 || pipe2(endpoint->stop_pipe, O_CLOEXEC) == -1)
+    {
+        goto unlink_path;
+    }
+
+    if(pthread_create(&endpoint->thread, NULL, endpoint_thread, endpoint) != 0)
+    {
+        close(endpoint->stop_pipe[0]);
+        close(endpoint->stop_pipe[1]);
+        goto unlink_path;
+    }
+
+    return 0;
+
+unlink_path:
+    unlink(path);
+
+close_listener:
+    close(endpoint->listen_fd);
+    endpoint->listen_fd = -1;
+    return -1;
+}
+
+/*
+    Stops the endpoint's thread and removes its socket.
+
+    @param
+    endpoint: A started endpoint
+*/
+void metrics_endpoint_stop(metrics_endpoint *endpoint)
+{
+    char stop;
+
+    if(endpoint->listen_fd == -1)
+    {
+        return;
+    }
+
+    stop = 0;
+    while(write(endpoint->stop_pipe[1], &stop, sizeof(stop)) == -1 && errno == EINTR)
+    {
+    }
+    pthread_join(endpoint->thread, NULL);
+
+    close(endpoint->stop_pipe[0]);
+    close(endpoint->stop_pipe[1]);
+    close(endpoint->listen_fd);
+    unlink(endpoint->path);
+    endpoint->listen_fd = -1;
+}
+
+/*
+    Appends formatted text, marking the text as truncated once the buffer is full.
+
+    @param
+    text: The text being built
+    format: printf format
+*/
+static void text_append(metrics_text *text, const char *format, ...)
+{
+    va_list list;
+    int     length;
+
+    if(text->truncated)
+    {
+        return;
+    }
+
+    va_start(list, format);
+    length = vsnprintf(text->buffer + text->length, text->size - text->length, format, list);
+    va_end(list);
+
+    if(length < 0 || (size_t)length >= text->size - text->length)
+    {
+        text->truncated = true;
+        return;
+    }
+
+    text->length += (size_t)length;
+}
+
+/*
+    Writes the HELP and TYPE lines of a metric.
+
+    @param
+    text: The text being built
+    name: The metric's name without the prefix
+    type: counter or gauge
+    help: One-line description
+*/
+static void text_describe(metrics_text *text, const char *name, const char *type, const char *help)
+{
+    text_append(text, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", name, help, name, type);
+}
+
+/*
+    Writes one sample of a metric.
+
+    @param
+    text: The text being built
+    name: The metric's name without the prefix
+    labels: The sample's labels, NULL for none
+    value: The sample
+*/
+static void text_value(metrics_text *text, const char *name, const char *labels, uint64_t value)
+{
+    if(labels == NULL)
+    {
+        text_append(text, METRICS_PREFIX "%s %" PRIu64 "\n", name, value);
+    }
+    else
+    {
+        text_append(text, METRICS_PREFIX "%s{%s} %" PRIu64 "\n", name, labels, value);
+    }
+}
+
+/*
+    Accepts scrapers one at a time until the endpoint is stopped.
+
+    @param
+    arg: The endpoint
+
+    @return
+    NULL
+*/
+static void *endpoint_thread(void *arg)
+{
+    const metrics_endpoint *endpoint;
+
+    endpoint = (const metrics_endpoint *)arg;
+    for(;;)
+    {
+        struct pollfd fds[2];
+        int           client_fd;
+
+        fds[0].fd     = endpoint->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd     = endpoint->stop_pipe[0];
+        fds[1].events = POLLIN;
+
+        if(poll(fds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("Metrics endpoint poll failed");
+            return NULL;
+        }
+
+        if(fds[1].revents != 0)
+        {
+            return NULL;
+        }
+
+        client_fd = accept4(endpoint->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(client_fd == -1)
+        {
+            continue;
+        }
+
+        serve_scrape(endpoint, client_fd);
+        close(client_fd);
+    }
+}
+
+/*
+    Answers one scrape with an HTTP response carrying the metrics. The request
+    itself is read and ignored, any path returns the same metrics.
+
+    @param
+    endpoint: The endpoint
+    client_fd: The scraper's connection
+*/
+static void serve_scrape(const metrics_endpoint *endpoint, int client_fd)
+{
+    char           request[METRICS_REQUEST_SIZE];
+    char           body[METRICS_TEXT_SIZE];
+    char           header[METRICS_REQUEST_SIZE];
+    server_metrics total;
+    struct timeval timeout;
+    size_t         received;
+    int            body_length;
+    int            header_length;
+
+    // A scraper that never finishes its request doesn't hold up the next one for long
+    timeout.tv_sec  = METRICS_READ_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    received = 0;
+    while(received < sizeof(request) - 1)
+    {
+        ssize_t bytes;
+
+        bytes = recv(client_fd, request + received, sizeof(request) - 1 - received, 0);
+        if(bytes <= 0)
+        {
+            break;
+        }
+
+        received         += (size_t)bytes;
+        request[received] = '\0';
+        if(strstr(request, "\r\n\r\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    metrics_collect(endpoint->reactors, endpoint->reactor_count, &total);
+    body_length = metrics_format(&total, body, sizeof(body));
+    if(body_length == -1)
+    {
+        header_length = snprintf(header, sizeof(header), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        body_length   = 0;
+    }
+    else
+    {
+        header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", body_length);
+    }
+
+    if(send_all(client_fd, header, (size_t)header_length) == 0)
+    {
+        send_all(client_fd, body, (size_t)body_length);
+    }
+}
+
+/*
+    Writes a whole buffer to a socket.
+
+    @param
+    fd: The socket
+    data: The bytes
+    length: The number of bytes
+
+    @return
+    0 on success, -1 if the peer went away
+*/
+static int send_all(int fd, const char *data, size_t length)
+{
+    while(length > 0)
+    {
+        ssize_t sent;
+
+        sent = send(fd, data, length, MSG_NOSIGNAL);
+        if(sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data   += sent;
+        length -= (size_t)sent;
+    }
+
+    return 0;
+}
@@ -0,0 +1,608 @@
+#include "outbox.h"
+
+#if !defined(MSG_NOSIGNAL)
+    #define MSG_NOSIGNAL 0
+#endif
+#if !defined(MSG_MORE)
+    #define MSG_MORE 0
+#endif
+
+static int      write_or_queue(outbox *box, int fd, const struct iovec *iov, int iovcnt, int flags);
+static ssize_t  send_file_range(int fd, int file_fd, off_t offset, size_t length);
+static ssize_t  send_chunks(const outbox *box, int fd);
+static uint8_t *queue_reserve(outbox *box, size_t length);
+static int      queue_iov(outbox *box, const struct iovec *iov, int iovcnt, size_t skip);
+static int      queue_file(outbox *box, int file_fd, off_t offset, size_t length);
+static void     chunk_append(outbox *box, outbox_chunk *chunk);
+static void     consume(outbox *box, size_t length);
+
+/*
+    Sends a set of buffers, or queues them behind the output that is already
+    waiting. Whatever the socket doesn't take right away is copied to the queue.
+
+    @param
+    box: The connection's queue
+    fd: The connected, non-blocking socket
+    iov: The buffers to send
+    iovcnt: The number of buffers
+
+    @return
+    0 once everything is sent or queued, -1 on failure
+*/
+int outbox_sendv(outbox *box, int fd, const struct iovec *iov, int iovcnt)
+{
+    return write_or_queue(box, fd, iov, iovcnt, 0);
+}
+
+/*
+    Sends or queues one complete frame.
+
+    @param
+    box: The connection's queue
+    fd: The connected, non-blocking socket
+    type: The frame type
+    flags: Frame flags
+    channel: The channel the frame belongs to
+    request_id: The request the frame belongs to
+    payload: The payload, may be NULL when length is 0
+    length: The payload length
+
+    @return
+    0 once the frame is sent or queued, -1 on failure
+*/
+int outbox_send(outbox *box, int fd, uint8_t type, uint8_t flags, uint16_t channel, uint32_t request_id, const void *payload, uint32_t length)
+{
+    uint8_t      header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+
+    frame_encode_header(header, type, flags, channel, request_id, length);
+    iov[0].iov_base = header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = (void *)(uintptr_t)payload;
+    iov[1].iov_len  = length;
+
+    return write_or_queue(box, fd, iov, length > 0 ? 2 : 1, 0);
+}
+
+/*
+    Sends one frame whose payload is moved straight from a pipe with splice(2),
+    so it never passes through user space. Once the socket is full, or if the
+    kernel can't splice to it, the rest of the payload is read into the queue.
+    The pipe must already hold length bytes.
+
+    @param
+    box: The connection's queue
+    fd: The connected, non-blocking socket
+    pipe_fd: The pipe holding the payload
+    type: The frame type
+    channel: The channel the frame belongs to
+    request_id: The request the frame belongs to
+    length: The payload length
+
+    @return
+    0 once the frame is sent or queued, -1 on failure (the frame may be partially sent)
+*/
+int outbox_splice(outbox *box, int fd, int pipe_fd, uint8_t type, uint16_t channel, uint32_t request_id, uint32_t length)
+{
+    uint8_t      header[FRAME_HEADER_SIZE];
+    struct iovec iov;
+    size_t       remaining;
+    uint8_t     *data;
+
+    frame_encode_header(header, type, 0, channel, request_id, length);
+    iov.iov_base = header;
+    iov.iov_len  = sizeof(header);
+    if(write_or_queue(box, fd, &iov, 1, MSG_MORE) == -1)
+    {
+        return -1;
+    }
+
+    remaining = length;
+#if defined(__linux__)
+    while(remaining > 0 && box->head == NULL)
+    {
+        ssize_t bytes_moved;
+
+        bytes_moved = splice(pipe_fd, NULL, fd, NULL, remaining, SPLICE_F_MOVE);
+        if(bytes_moved == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EINVAL || errno == ENOSYS)
+            {
+                break;
+            }
+
+            return -1;
+        }
+
+        if(bytes_moved == 0)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        remaining -= (size_t)bytes_moved;
+    }
+#endif
+
+    // The socket is full, the rest of the payload is copied to the queue
+    data = remaining > 0 ? queue_reserve(box, remaining) : NULL;
+    if(remaining > 0 && data == NULL)
+    {
+        return -1;
+    }
+
+    while(remaining > 0)
+    {
+        ssize_t bytes_read;
+
+        bytes_read = read(pipe_fd, data, remaining);
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        // The pipe held the whole payload, anything less leaves the frame unfinished
+        if(bytes_read <= 0)
+        {
+            errno = bytes_read == 0 || errno == EAGAIN ? EPIPE : errno;
+            return -1;
+        }
+
+        data      += bytes_read;
+        remaining -= (size_t)bytes_read;
+    }
+
+    return 0;
+}
+
+/*
+    Sends one frame whose payload is read from a file by the kernel with
+    sendfile(2). Once the socket is full the rest of the range is queued, still
+    to be sent from the file.
+
+    @param
+    box: The connection's queue
+    fd: The connected, non-blocking socket
+    file_fd: The file holding the payload
+    offset: Where the payload starts in the file
+    type: The frame type
+    channel: The channel the frame belongs to
+    request_id: The request the frame belongs to
+    length: The payload length
+
+    @return
+    0 once the frame is sent or queued, -1 on failure (the frame may be partially sent)
+*/
+int outbox_sendfile(outbox *box, int fd, int file_fd, off_t offset, uint8_t type, uint16_t channel, uint32_t request_id, uint32_t length)
+{
+    uint8_t      header[FRAME_HEADER_SIZE];
+    struct iovec iov;
+    size_t       remaining;
+
+    frame_encode_header(header, type, 0, channel, request_id, length);
+    iov.iov_base = header;
+    iov.iov_len  = sizeof(header);
+    if(write_or_queue(box, fd, &iov, 1, MSG_MORE) == -1)
+    {
+        return -1;
+    }
+
+    remaining = length;
+    while(remaining > 0 && box->head == NULL)
+    {
+        ssize_t bytes_sent;
+
+        bytes_sent = send_file_range(fd, file_fd, offset, remaining);
+        if(bytes_sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN)
+            {
+                break;
+            }
+
+            return -1;
+        }
+
+        offset    += bytes_sent;
+        remaining -= (size_t)bytes_sent;
+    }
+
+    return remaining > 0 ? queue_file(box, file_fd, offset, remaining) : 0;
+}
+
+/*
+    Writes as much of the queue as the socket takes. Consecutive chunks of
+    bytes go out in one sendmsg, file ranges with sendfile.
+
+    @param
+    box: The connection's queue
+    fd: The connected, non-blocking socket
+
+    @return
+    0 if the socket took everything or is full again, -1 on failure
+*/
+int outbox_flush(outbox *box, int fd)
+{
+    while(box->head != NULL)
+    {
+        ssize_t bytes_sent;
+
+        if(box->head->file_fd != -1)
+        {
+            bytes_sent = send_file_range(fd, box->head->file_fd, box->head->offset, box->head->length);
+        }
+        else
+        {
+            bytes_sent = send_chunks(box, fd);
+        }
+
+        if(bytes_sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        consume(box, (size_t)bytes_sent);
+    }
+
+    return 0;
+}
+
+/*
+    Drops everything still queued.
+
+    @param
+    box: The connection's queue
+*/
+void outbox_clear(outbox *box)
+{
+    while(box->head != NULL)
+    {
+        outbox_chunk *chunk;
+
+        chunk     = box->head;
+        box->head = chunk->next;
+        if(chunk->file_fd != -1)
+        {
+            close(chunk->file_fd);
+        }
+        free(chunk);
+    }
+
+    box->tail  = NULL;
+    box->bytes = 0;
+}
+
+/*
+    Sends buffers straight to the socket while nothing is queued, then queues
+    what is left so later frames can't overtake it.
+
+    @param
+    box: The connection's queue
+    fd: The connected, non-blocking socket
+    iov: The buffers to send
+    iovcnt: The number of buffers
+    flags: Extra sendmsg flags
+
+    @return
+    0 once everything is sent or queued, -1 on failure
+*/
+static int write_or_queue(outbox *box, int fd, const struct iovec *iov, int iovcnt, int flags)
+{
+    struct msghdr msg;
+    ssize_t       bytes_sent;
+
+    if(box->head != NULL)
+    {
+        return queue_iov(box, iov, iovcnt, 0);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = (struct iovec *)(uintptr_t)iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+
+    do
+    {
+        bytes_sent = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+    } while(bytes_sent == -1 && errno == EINTR);
+
+    if(bytes_sent == -1)
+    {
+        if(errno != EAGAIN)
+        {
+            return -1;
+        }
+
+        bytes_sent = 0;
+    }
+
+    // A short write means the socket is full, the rest waits for it to drain
+    return queue_iov(box, iov, iovcnt, (size_t)bytes_sent);
+}
+
+/*
+    Sends part of a file. Where sendfile can't be used the range is copied.
+
+    @param
+    fd: The connected, non-blocking socket
+    file_fd: The file
+    offset: Where the range starts in the file
+    length: The length of the range
+
+    @return
+    The number of bytes sent, or -1 on failure
+*/
+static ssize_t send_file_range(int fd, int file_fd, off_t offset, size_t length)
+{
+    uint8_t buffer[OUTBOX_COPY_SIZE];
+    ssize_t bytes_read;
+
+#if defined(__linux__)
+    ssize_t bytes_sent;
+
+    bytes_sent = sendfile(fd, file_fd, &offset, length);
+    if(bytes_sent != -1 || (errno != EINVAL && errno != ENOSYS))
+    {
+        // The file shrank, the frame can't be completed
+        if(bytes_sent == 0)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        return bytes_sent;
+    }
+#endif
+
+    bytes_read = pread(file_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+    if(bytes_read <= 0)
+    {
+        errno = bytes_read == 0 ? EPIPE : errno;
+        return -1;
+    }
+
+    return send(fd, buffer, (size_t)bytes_read, MSG_NOSIGNAL);
+}
+
+/*
+    Sends the queued chunks of bytes up to the first file range.
+
+    @param
+    box: The connection's queue, starting with a chunk of bytes
+    fd: The connected, non-blocking socket
+
+    @return
+    The number of bytes sent, or -1 on failure
+*/
+static ssize_t send_chunks(const outbox *box, int fd)
+{
+    struct iovec        iov[OUTBOX_IOV_MAX];
+    struct msghdr       msg;
+    const outbox_chunk *chunk;
+    int                 iovcnt;
+
+    iovcnt = 0;
+    for(chunk = box->head; chunk != NULL && chunk->file_fd == -1 && iovcnt < OUTBOX_IOV_MAX; chunk = chunk->next)
+    {
+        iov[iovcnt].iov_base = (void *)(uintptr_t)(chunk->data + chunk->start);
+        iov[iovcnt].iov_len  = chunk->length;
+        iovcnt++;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/*
+    Makes room for bytes at the end of the queue, in the last chunk if they fit.
+
+    @param
+    box: The connection's queue
+    length: The number of bytes
+
+    @return
+    Where the bytes go, or NULL if out of memory
+*/
+static uint8_t *queue_reserve(outbox *box, size_t length)
+{
+    outbox_chunk *chunk;
+    uint8_t      *data;
+
+    chunk = box->tail;
+    if(chunk == NULL || chunk->file_fd != -1 || chunk->size - chunk->start - chunk->length < length)
+    {
+        size_t size;
+
+        size  = length > OUTBOX_CHUNK_SIZE ? length : OUTBOX_CHUNK_SIZE;
+        chunk = (outbox_chunk *)malloc(sizeof(outbox_chunk) + size);
+        if(chunk == NULL)
+        {
+            return NULL;
+        }
+
+        chunk->file_fd = -1;
+        chunk->offset  = 0;
+        chunk->start   = 0;
+        chunk->length  = 0;
+        chunk->size    = size;
+        chunk_append(box, chunk);
+    }
+
+    data           = chunk->data + chunk->start + chunk->length;
+    chunk->length += length;
+    box->bytes    += length;
+
+    return data;
+}
+
+/*
+    Copies buffers to the end of the queue.
+
+    @param
+    box: The connection's queue
+    iov: The buffers
+    iovcnt: The number of buffers
+    skip: Bytes at the start of the buffers that were already sent
+
+    @return
+    0 on success, -1 if out of memory
+*/
+static int queue_iov(outbox *box, const struct iovec *iov, int iovcnt, size_t skip)
+{
+    uint8_t *data;
+    size_t   total;
+    int      i;
+
+    total = 0;
+    for(i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    if(total == skip)
+    {
+        return 0;
+    }
+
+    data = queue_reserve(box, total - skip);
+    if(data == NULL)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++)
+    {
+        size_t length;
+
+        if(skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        length = iov[i].iov_len - skip;
+        memcpy(data, (const uint8_t *)iov[i].iov_base + skip, length);
+        data += length;
+        skip  = 0;
+    }
+
+    return 0;
+}
+
+/*
+    Queues a range of a file. The queue holds its own descriptor, so the
+    caller may close the file.
+
+    @param
+    box: The connection's queue
+    file_fd: The file
+    offset: Where the range starts in the file
+    length: The length of the range
+
+    @return
+    0 on success, -1 on failure
+*/
+static int queue_file(outbox *box, int file_fd, off_t offset, size_t length)
+{
+    outbox_chunk *chunk;
+
+    chunk = (outbox_chunk *)malloc(sizeof(outbox_chunk));
+    if(chunk == NULL)
+    {
+        return -1;
+    }
+
+    chunk->file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+    if(chunk->file_fd == -1)
+    {
+        free(chunk);
+        return -1;
+    }
+
+    chunk->offset = offset;
+    chunk->start  = 0;
+    chunk->length = length;
+    chunk->size   = 0;
+    chunk_append(box, chunk);
+    box->bytes += length;
+
+    return 0;
+}
+
+/*
+    Links a chunk in at the end of the queue.
+
+    @param
+    box: The connection's queue
+    chunk: The chunk
+*/
+static void chunk_append(outbox *box, outbox_chunk *chunk)
+{
+    chunk->next = NULL;
+    if(box->tail == NULL)
+    {
+        box->head = chunk;
+    }
+    else
+    {
+        box->tail->next = chunk;
+    }
+    box->tail = chunk;
+}
+
+/*
+    Removes bytes the socket took from the front of the queue.
+
+    @param
+    box: The connection's queue
+    length: The number of bytes sent
+*/
+static void consume(outbox *box, size_t length)
+{
+    box->bytes -= length;
+    while(length > 0)
+    {
+        outbox_chunk *chunk;
+        size_t        sent;
+
+        chunk          = box->head;
+        sent           = length < chunk->length ? length : chunk->length;
+        chunk->offset += (off_t)sent;
+        chunk->start  += sent;
+        chunk->length -= sent;
+        length        -= sent;
+
+        if(chunk->length > 0)
+        {
+            break;
+        }
+
+        box->head = chunk->next;
+        if(box->head == NULL)
+        {
+            box->tail = NULL;
+        }
+        if(chunk->file_fd != -1)
+        {
+            close(chunk->file_fd);
+        }
+        free(chunk);
+    }
+}
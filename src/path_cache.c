@@ -0,0 +1,529 @@
+#include "path_cache.h"
+
+#define PATH_CACHE_MIN_CAPACITY 1024
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#if defined(__linux__)
+    #define PATH_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+static uint32_t    hash_name(const char *name);
+static const char *current_path(void);
+static int         rebuild(path_cache *cache);
+static int         split_path(path_cache *cache, const char *path);
+static void        scan_directory(path_cache *cache, uint32_t dir);
+static int         insert_entry(path_cache *cache, const char *name, uint32_t hash, uint32_t dir);
+static int         grow(path_cache *cache);
+static void        clear_entries(path_cache *cache);
+static void        clear_dirs(path_cache *cache);
+static int         search_dirs(const path_cache *cache, const char *name, char *full_path, size_t size);
+
+/*
+    Creates the executable index and builds it from the current PATH.
+
+    @param
+    cache: The cache to initialise
+
+    @return
+    0 on success, -1 on failure
+*/
+int path_cache_create(path_cache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->stale = true;
+
+#if defined(__linux__)
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    cache->inotify_fd = -1;
+#endif
+
+    // Without change notifications every lookup searches the directories instead
+    if(rebuild(cache) == -1)
+    {
+        path_cache_destroy(cache);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Frees the index and stops watching the PATH directories.
+
+    @param
+    cache: The cache to destroy
+*/
+void path_cache_destroy(path_cache *cache)
+{
+    clear_entries(cache);
+    clear_dirs(cache);
+
+    if(cache->inotify_fd >= 0)
+    {
+        close(cache->inotify_fd);
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    cache->inotify_fd = -1;
+}
+
+/*
+    Resolves a command name to the first executable of that name on PATH.
+
+    @param
+    cache: The executable index
+    name: Name of the command to search for
+    full_path: Buffer to store the resolved full path
+    size: Size of the full_path buffer
+
+    @return
+    0 if the executable is found, -1 otherwise
+*/
+int path_cache_lookup(path_cache *cache, const char *name, char *full_path, size_t size)
+{
+    uint32_t hash;
+    size_t   mask;
+    size_t   i;
+    int      written;
+
+    // Rebuild lazily after a directory changed or PATH was modified
+    if(cache->stale || cache->path == NULL || strcmp(cache->path, current_path()) != 0)
+    {
+        cache->stale = true;
+        if(rebuild(cache) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if(cache->inotify_fd == -1)
+    {
+        return search_dirs(cache, name, full_path, size);
+    }
+
+    if(cache->count == 0 || strchr(name, '/') != NULL)
+    {
+        return -1;
+    }
+
+    hash = hash_name(name);
+    mask = cache->capacity - 1;
+    for(i = hash & mask; cache->entries[i].name != NULL; i = (i + 1) & mask)
+    {
+        if(cache->entries[i].hash == hash && strcmp(cache->entries[i].name, name) == 0)
+        {
+            written = snprintf(full_path, size, "%s/%s", cache->dirs[cache->entries[i].dir], name);
+            return (written < 0 || (size_t)written >= size) ? -1 : 0;
+        }
+    }
+
+    return -1;    // Not found
+}
+
+/*
+    Drains the inotify descriptor after the event loop reports it readable. Any
+    change to a PATH directory marks the index stale.
+
+    @param
+    cache: The executable index
+*/
+void path_cache_handle_event(path_cache *cache)
+{
+#if defined(__linux__)
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if(cache->inotify_fd == -1)
+    {
+        return;
+    }
+
+    for(;;)
+    {
+        ssize_t bytes_read;
+        ssize_t offset;
+
+        bytes_read = read(cache->inotify_fd, buffer, sizeof(buffer));
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_read <= 0)
+        {
+            return;
+        }
+
+        // IN_IGNORED only reports a removed watch, which a rebuild restores
+        for(offset = 0; offset < bytes_read;)
+        {
+            const struct inotify_event *event;
+
+            event = (const struct inotify_event *)(void *)(buffer + offset);
+            if((event->mask & (PATH_WATCH_MASK | IN_Q_OVERFLOW)) != 0)
+            {
+                cache->stale = true;
+            }
+
+            offset += (ssize_t)(sizeof(struct inotify_event) + event->len);
+        }
+    }
+#else
+    cache->stale = true;
+#endif
+}
+
+/*
+    Hashes a command name with 32-bit FNV-1a.
+
+    @param
+    name: The command name
+
+    @return
+    The hash value
+*/
+static uint32_t hash_name(const char *name)
+{
+    uint32_t hash;
+
+    hash = FNV_OFFSET_BASIS;
+    while(*name != '\0')
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+    Gets the PATH commands are resolved against.
+
+    @return
+    The PATH environment variable, or a default search path if it is unset
+*/
+static const char *current_path(void)
+{
+    const char *path;
+
+    path = getenv("PATH");
+    if(!path || *path == '\0')
+    {
+        path = DEFAULT_PATH;
+    }
+
+    return path;
+}
+
+/*
+    Re-reads every PATH directory into the index.
+
+    @param
+    cache: The executable index
+
+    @return
+    0 on success, -1 on failure
+*/
+static int rebuild(path_cache *cache)
+{
+    const char *path;
+    uint32_t    dir;
+
+    path = current_path();
+    clear_entries(cache);
+
+    if(cache->path == NULL || strcmp(cache->path, path) != 0)
+    {
+        clear_dirs(cache);
+        if(split_path(cache, path) == -1)
+        {
+            clear_dirs(cache);
+            return -1;
+        }
+    }
+
+    cache->stale = false;
+    if(cache->inotify_fd == -1)
+    {
+        return 0;
+    }
+
+    for(dir = 0; dir < cache->dir_count; dir++)
+    {
+        scan_directory(cache, dir);
+    }
+
+    // A failed insert leaves the index incomplete, so try again on the next lookup
+    return cache->stale ? -1 : 0;
+}
+
+/*
+    Splits a PATH value into its directories.
+
+    @param
+    cache: The executable index
+    path: The PATH value
+
+    @return
+    0 on success, -1 on failure
+*/
+static int split_path(path_cache *cache, const char *path)
+{
+    char       *path_copy;
+    const char *dir;
+    char       *saveptr;
+    size_t      max_dirs;
+    size_t      i;
+
+    max_dirs = 1;
+    for(i = 0; path[i] != '\0'; i++)
+    {
+        max_dirs += path[i] == ':';
+    }
+
+    cache->path    = strdup(path);
+    path_copy      = strdup(path);
+    cache->dirs    = (char **)calloc(max_dirs, sizeof(char *));
+    cache->watches = (int *)calloc(max_dirs, sizeof(int));
+    if(cache->path == NULL || path_copy == NULL || cache->dirs == NULL || cache->watches == NULL)
+    {
+        free(path_copy);
+        return -1;
+    }
+
+    // Tokenize and record directories in PATH
+    dir = strtok_r(path_copy, ":", &saveptr);
+    while(dir != NULL)
+    {
+        cache->dirs[cache->dir_count] = strdup(dir);
+        if(cache->dirs[cache->dir_count] == NULL)
+        {
+            free(path_copy);
+            return -1;
+        }
+
+        cache->watches[cache->dir_count] = -1;
+        cache->dir_count++;
+        dir = strtok_r(NULL, ":", &saveptr);
+    }
+
+    free(path_copy);
+    return 0;
+}
+
+/*
+    Watches a PATH directory and adds its executables to the index. Names already
+    found in an earlier directory are skipped, matching the shell's search order.
+
+    @param
+    cache: The executable index
+    dir: Index of the directory in cache->dirs
+*/
+static void scan_directory(path_cache *cache, uint32_t dir)
+{
+    DIR                 *stream;
+    const struct dirent *entry;
+    int                  dir_fd;
+
+#if defined(__linux__)
+    // Watch before reading so nothing added during the scan is missed
+    cache->watches[dir] = inotify_add_watch(cache->inotify_fd, cache->dirs[dir], PATH_WATCH_MASK | IN_ONLYDIR);
+#endif
+
+    stream = opendir(cache->dirs[dir]);
+    if(stream == NULL)
+    {
+        return;
+    }
+
+    dir_fd = dirfd(stream);
+    while((entry = readdir(stream)) != NULL)
+    {
+        if(entry->d_type == DT_DIR || faccessat(dir_fd, entry->d_name, X_OK, 0) != 0)
+        {
+            continue;
+        }
+
+        if(insert_entry(cache, entry->d_name, hash_name(entry->d_name), dir) == -1)
+        {
+            cache->stale = true;
+            break;
+        }
+    }
+
+    closedir(stream);
+}
+
+/*
+    Adds a name to the index unless it is already present.
+
+    @param
+    cache: The executable index
+    name: The executable name
+    hash: Hash of name
+    dir: Index of the directory the executable is in
+
+    @return
+    0 on success, -1 on failure
+*/
+static int insert_entry(path_cache *cache, const char *name, uint32_t hash, uint32_t dir)
+{
+    size_t mask;
+    size_t i;
+
+    // Keep the table at most half full so probes stay short
+    if((cache->count + 1) * 2 > cache->capacity && grow(cache) == -1)
+    {
+        return -1;
+    }
+
+    mask = cache->capacity - 1;
+    for(i = hash & mask; cache->entries[i].name != NULL; i = (i + 1) & mask)
+    {
+        if(cache->entries[i].hash == hash && strcmp(cache->entries[i].name, name) == 0)
+        {
+            return 0;
+        }
+    }
+
+    cache->entries[i].name = strdup(name);
+    if(cache->entries[i].name == NULL)
+    {
+        return -1;
+    }
+
+    cache->entries[i].hash = hash;
+    cache->entries[i].dir  = dir;
+    cache->count++;
+
+    return 0;
+}
+
+/*
+    Doubles the size of the hash table.
+
+    @param
+    cache: The executable index
+
+    @return
+    0 on success, -1 on failure
+*/
+static int grow(path_cache *cache)
+{
+    path_entry *entries;
+    size_t      capacity;
+    size_t      mask;
+    size_t      i;
+
+    capacity = cache->capacity == 0 ? PATH_CACHE_MIN_CAPACITY : cache->capacity * 2;
+    entries  = (path_entry *)calloc(capacity, sizeof(path_entry));
+    if(entries == NULL)
+    {
+        return -1;
+    }
+
+    mask = capacity - 1;
+    for(i = 0; i < cache->capacity; i++)
+    {
+        size_t slot;
+
+        if(cache->entries[i].name == NULL)
+        {
+            continue;
+        }
+
+        slot = cache->entries[i].hash & mask;
+        while(entries[slot].name != NULL)
+        {
+            slot = (slot + 1) & mask;
+        }
+        entries[slot] = cache->entries[i];
+    }
+
+    free(cache->entries);
+    cache->entries  = entries;
+    cache->capacity = capacity;
+
+    return 0;
+}
+
+/*
+    Empties the hash table.
+
+    @param
+    cache: The executable index
+*/
+static void clear_entries(path_cache *cache)
+{
+    size_t i;
+
+    for(i = 0; i < cache->capacity; i++)
+    {
+        free(cache->entries[i].name);
+    }
+
+    free(cache->entries);
+    cache->entries  = NULL;
+    cache->capacity = 0;
+    cache->count    = 0;
+}
+
+/*
+    Forgets the PATH directories and removes their watches.
+
+    @param
+    cache: The executable index
+*/
+static void clear_dirs(path_cache *cache)
+{
+    size_t i;
+
+    for(i = 0; i < cache->dir_count; i++)
+    {
+#if defined(__linux__)
+        if(cache->watches[i] >= 0)
+        {
+            inotify_rm_watch(cache->inotify_fd, cache->watches[i]);
+        }
+#endif
+        free(cache->dirs[i]);
+    }
+
+    free(cache->dirs);
+    free(cache->watches);
+    free(cache->path);
+    cache->dirs      = NULL;
+    cache->watches   = NULL;
+    cache->path      = NULL;
+    cache->dir_count = 0;
+}
+
+/*
+    Searches the PATH directories one at a time, for platforms without inotify.
+
+    @param
+    cache: The executable index
+    name: Name of the command to search for
+    full_path: Buffer to store the resolved full path
+    size: Size of the full_path buffer
+
+    @return
+    0 if the executable is found, -1 otherwise
+*/
+static int search_dirs(const path_cache *cache, const char *name, char *full_path, size_t size)
+{
+    size_t i;
+
+    for(i = 0; i < cache->dir_count; i++)
+    {
+        int written;
+
+        written = snprintf(full_path, size, "%s/%s", cache->dirs[i], name);
+        if(written >= 0 && (size_t)written < size && access(full_path, X_OK) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,226 @@
+#include "protocol.h"
+
+#if !defined(MSG_NOSIGNAL)
+    #define MSG_NOSIGNAL 0
+#endif
+
+static int read_fully(int fd, void *buffer, size_t size);
+
+/*
+    Writes a frame header in wire format.
+
+    @param
+    buffer: Destination of at least FRAME_HEADER_SIZE bytes
+    type: The frame type
+    flags: Frame flags
+    channel: The channel the frame belongs to
+    request_id: The request the frame belongs to
+    length: The payload length
+*/
+void frame_encode_header(uint8_t *buffer, uint8_t type, uint8_t flags, uint16_t channel, uint32_t request_id, uint32_t length)
+{
+    buffer[0] = type;
+    buffer[1] = flags;
+    buffer[2] = (uint8_t)(channel >> 8);
+    buffer[3] = (uint8_t)channel;
+    frame_encode_u32(buffer + 4, request_id);
+    frame_encode_u32(buffer + 8, length);
+}
+
+/*
+    Reads a frame header from wire format.
+
+    @param
+    buffer: Source of at least FRAME_HEADER_SIZE bytes
+    header: Receives the decoded fields
+*/
+void frame_decode_header(const uint8_t *buffer, frame_header *header)
+{
+    header->type       = buffer[0];
+    header->flags      = buffer[1];
+    header->channel    = (uint16_t)((buffer[2] << 8) | buffer[3]);
+    header->request_id = frame_decode_u32(buffer + 4);
+    header->length     = frame_decode_u32(buffer + 8);
+}
+
+/*
+    Stores a 32-bit value in network byte order.
+
+    @param
+    buffer: Destination of at least 4 bytes
+    value: The value to store
+*/
+void frame_encode_u32(uint8_t *buffer, uint32_t value)
+{
+    uint32_t net_value;
+
+    net_value = htonl(value);
+    memcpy(buffer, &net_value, sizeof(net_value));
+}
+
+/*
+    Loads a 32-bit value stored in network byte order.
+
+    @param
+    buffer: Source of at least 4 bytes
+
+    @return
+    The value in host byte order
+*/
+uint32_t frame_decode_u32(const uint8_t *buffer)
+{
+    uint32_t net_value;
+
+    memcpy(&net_value, buffer, sizeof(net_value));
+    return ntohl(net_value);
+}
+
+/*
+    Sends a set of buffers to a socket, retrying until everything is written.
+
+    @param
+    fd: The connected socket
+    iov: The buffers to send, updated as data is written
+    iovcnt: The number of buffers
+
+    @return
+    0 on success, -1 on failure
+*/
+int frame_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+
+    while(msg.msg_iovlen > 0)
+    {
+        ssize_t bytes_sent;
+
+        bytes_sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(bytes_sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        // Skip past whatever was written
+        while(msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len)
+        {
+            bytes_sent -= (ssize_t)msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if(msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + bytes_sent;
+            msg.msg_iov->iov_len -= (size_t)bytes_sent;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Sends one complete frame.
+
+    @param
+    fd: The connected socket
+    type: The frame type
+    flags: Frame flags
+    channel: The channel the frame belongs to
+    request_id: The request the frame belongs to
+    payload: The payload, may be NULL when length is 0
+    length: The payload length
+
+    @return
+    0 on success, -1 on failure
+*/
+int frame_send(int fd, uint8_t type, uint8_t flags, uint16_t channel, uint32_t request_id, const void *payload, uint32_t length)
+{
+    uint8_t      header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+
+    frame_encode_header(header, type, flags, channel, request_id, length);
+    iov[0].iov_base = header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = (void *)(uintptr_t)payload;
+    iov[1].iov_len  = length;
+
+    return frame_sendv(fd, iov, length > 0 ? 2 : 1);
+}
+
+/*
+    Receives one complete frame from a blocking socket.
+
+    @param
+    fd: The connected socket
+    header: Receives the frame header
+    payload: Receives the payload
+    size: Capacity of payload
+
+    @return
+    0 on success, -1 on failure or EOF (errno is 0 on a clean EOF)
+*/
+int frame_recv(int fd, frame_header *header, void *payload, size_t size)
+{
+    uint8_t buffer[FRAME_HEADER_SIZE];
+
+    if(read_fully(fd, buffer, sizeof(buffer)) == -1)
+    {
+        return -1;
+    }
+
+    frame_decode_header(buffer, header);
+    if(header->length > size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return read_fully(fd, payload, header->length);
+}
+
+/*
+    Reads exactly size bytes.
+
+    @param
+    fd: The file descriptor to read from
+    buffer: Destination buffer
+    size: The number of bytes to read
+
+    @return
+    0 on success, -1 on failure or EOF (errno is 0 on a clean EOF)
+*/
+static int read_fully(int fd, void *buffer, size_t size)
+{
+    size_t total;
+
+    total = 0;
+    while(total < size)
+    {
+        ssize_t bytes_read;
+
+        bytes_read = read(fd, (uint8_t *)buffer + total, size - total);
+        if(bytes_read == 0)
+        {
+            errno = 0;
+            return -1;
+        }
+
+        if(bytes_read == -1)
+        {
+            return -1;
+        }
+
+        total += (size_t)bytes_read;
+    }
+
+    return 0;
+}
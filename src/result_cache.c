@@ -0,0 +1,474 @@
+#include "result_cache.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+// A command whose output only depends on its arguments and the files they name
+typedef struct
+{
+    const char *name;
+    const char *value_options;      // Option letters whose value is the next argument
+    const char *allowed_options;    // The only option letters accepted, long options never are
+} pure_command;
+
+static const pure_command *find_pure_command(const char *command);
+static int                 stamp_file(int cwd_fd, const char *name, result_stamp *stamp);
+static bool                stamps_equal(const result_stamp *a, const result_stamp *b);
+static bool                same_command(const result_key *a, const result_key *b);
+static uint32_t            hash_bytes(uint32_t hash, const void *data, size_t length);
+static time_t              monotonic_seconds(void);
+static void                clear_entry(result_entry *entry);
+
+// Commands that are safe to answer from the cache. Only the operands are
+// stamped, so options that read other files, such as md5sum -c, are left out.
+// A directory is stamped by its own inode alone, so ls is limited to options
+// that print names, which change with the directory. Stamps follow links and
+// leave out the access time, both of which stat prints.
+static const pure_command pure_commands[] = {
+    {"cat",       "",   "AbeEnstTuv"},
+    {"head",      "cn", "cnqvz"     },
+    {"tail",      "cn", "cnqvz"     },
+    {"ls",        "",   "1aAdr"     },
+    {"wc",        "",   "clmwL"     },
+    {"cksum",     "",   ""          },
+    {"md5sum",    "",   "btz"       },
+    {"sha1sum",   "",   "btz"       },
+    {"sha256sum", "",   "btz"       },
+};
+
+/*
+    Sets up a result cache. A TTL of 0 leaves caching off.
+
+    @param
+    cache: The cache to initialise
+    ttl: Seconds a result is served for
+
+    @return
+    0 on success, -1 on failure
+*/
+int result_cache_create(result_cache *cache, int ttl)
+{
+    memset(cache, 0, sizeof(*cache));
+    if(ttl <= 0)
+    {
+        return 0;
+    }
+
+    cache->entries = (result_entry *)calloc(RESULT_CACHE_ENTRIES, sizeof(result_entry));
+    if(cache->entries == NULL)
+    {
+        return -1;
+    }
+
+    cache->ttl = ttl;
+    return 0;
+}
+
+/*
+    Frees every cached result.
+
+    @param
+    cache: The cache to destroy
+*/
+void result_cache_destroy(result_cache *cache)
+{
+    size_t i;
+
+    if(cache->entries != NULL)
+    {
+        for(i = 0; i < RESULT_CACHE_ENTRIES; i++)
+        {
+            clear_entry(&cache->entries[i]);
+        }
+    }
+
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/*
+    Describes a command and the current version of everything it reads. Only
+    commands on the allowlist, given options it accepts and operands that all
+    exist, can be cached.
+
+    @param
+    cache: The result cache
+    cwd_fd: The session's working directory
+    command: The resolved executable
+    args: The command's arguments, separated by spaces
+    key: Receives the description
+
+    @return
+    0 on success, -1 if the command's result can't be cached
+*/
+int result_key_build(const result_cache *cache, int cwd_fd, const char *command, const char *args, result_key *key)
+{
+    const pure_command *pure;
+    result_stamp        cwd;
+    char                copy[MAX_ARGS_LENGTH];
+    char               *token;
+    char               *saveptr;
+    size_t              letters;
+    bool                options_done;
+
+    if(cache->entries == NULL)
+    {
+        return -1;
+    }
+
+    pure = find_pure_command(command);
+    if(pure == NULL || stamp_file(cwd_fd, ".", &cwd) == -1)
+    {
+        return -1;
+    }
+
+    memset(key, 0, sizeof(*key));
+    snprintf(key->command, sizeof(key->command), "%s", command);
+    snprintf(key->args, sizeof(key->args), "%s", args);
+    key->cwd_dev = cwd.dev;
+    key->cwd_ino = cwd.ino;
+
+    // Every operand has to exist, so a failing command never reaches the cache
+    snprintf(copy, sizeof(copy), "%s", args);
+    options_done = false;
+    for(token = strtok_r(copy, " ", &saveptr); token != NULL; token = strtok_r(NULL, " ", &saveptr))
+    {
+        if(!options_done && strcmp(token, "--") == 0)
+        {
+            options_done = true;
+            continue;
+        }
+
+        if(!options_done && token[0] == '-')
+        {
+            // Whatever follows a value option is its value, as in "-n5"
+            letters = strspn(token + 1, pure->allowed_options);
+            if(token[letters + 1] != '\0' && (letters == 0 || strchr(pure->value_options, token[letters]) == NULL))
+            {
+                return -1;
+            }
+
+            // "-n 5" takes the next argument as its value, "-n5" doesn't
+            if(token[1] != '-' && token[1] != '\0' && token[2] == '\0' && strchr(pure->value_options, token[1]) != NULL)
+            {
+                token = strtok_r(NULL, " ", &saveptr);
+                if(token == NULL)
+                {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        if(key->input_count == RESULT_CACHE_MAX_INPUTS || stamp_file(cwd_fd, token, &key->inputs[key->input_count]) == -1)
+        {
+            return -1;
+        }
+        key->input_count++;
+    }
+
+    // Without operands the command reads the directory it runs in
+    if(key->input_count == 0)
+    {
+        key->inputs[key->input_count++] = cwd;
+    }
+
+    key->hash = hash_bytes(FNV_OFFSET_BASIS, key->command, strlen(key->command));
+    key->hash = hash_bytes(key->hash, key->args, strlen(key->args));
+    key->hash = hash_bytes(key->hash, &key->cwd_dev, sizeof(key->cwd_dev));
+    key->hash = hash_bytes(key->hash, &key->cwd_ino, sizeof(key->cwd_ino));
+
+    return 0;
+}
+
+/*
+    Finds the cached output of a command. A result that has expired, or whose
+    files have changed since it was produced, is dropped.
+
+    @param
+    cache: The result cache
+    key: The command, built by result_key_build
+    output: Receives the output, at least RESULT_CACHE_MAX_OUTPUT bytes
+    length: Receives the output's length
+
+    @return
+    0 if the output was found, -1 otherwise
+*/
+int result_cache_lookup(result_cache *cache, const result_key *key, char *output, size_t *length)
+{
+    size_t i;
+    time_t now;
+
+    now = monotonic_seconds();
+    for(i = 0; i < RESULT_CACHE_PROBE; i++)
+    {
+        result_entry *entry;
+        int           input;
+
+        entry = &cache->entries[(key->hash + i) & (RESULT_CACHE_ENTRIES - 1)];
+        if(entry->output == NULL || !same_command(&entry->key, key))
+        {
+            continue;
+        }
+
+        if(now - entry->stored >= cache->ttl || entry->key.input_count != key->input_count)
+        {
+            clear_entry(entry);
+            return -1;
+        }
+
+        for(input = 0; input < key->input_count; input++)
+        {
+            if(!stamps_equal(&entry->key.inputs[input], &key->inputs[input]))
+            {
+                clear_entry(entry);
+                return -1;
+            }
+        }
+
+        memcpy(output, entry->output, entry->length);
+        *length = entry->length;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+    Caches the complete output of a command that succeeded. The entry replaces
+    an older result of the same command, an empty slot or the oldest entry near
+    the command's home slot.
+
+    @param
+    cache: The result cache
+    capture: The command and its output
+*/
+void result_cache_store(result_cache *cache, const result_capture *capture)
+{
+    result_entry *victim;
+    size_t        i;
+
+    if(cache->entries == NULL || capture->overflow)
+    {
+        return;
+    }
+
+    victim = NULL;
+    for(i = 0; i < RESULT_CACHE_PROBE; i++)
+    {
+        result_entry *entry;
+
+        entry = &cache->entries[(capture->key.hash + i) & (RESULT_CACHE_ENTRIES - 1)];
+        if(entry->output == NULL || same_command(&entry->key, &capture->key))
+        {
+            victim = entry;
+            break;
+        }
+
+        if(victim == NULL || entry->stored < victim->stored)
+        {
+            victim = entry;
+        }
+    }
+
+    clear_entry(victim);
+
+    // One extra byte so an empty output still marks the slot as used
+    victim->output = (char *)malloc(capture->length + 1);
+    if(victim->output == NULL)
+    {
+        return;
+    }
+
+    memcpy(victim->output, capture->output, capture->length);
+    victim->key    = capture->key;
+    victim->length = capture->length;
+    victim->stored = monotonic_seconds();
+}
+
+/*
+    Starts collecting the output of a job whose result may be cached.
+
+    @param
+    key: The command, built by result_key_build before the job started
+
+    @return
+    The capture, or NULL if out of memory
+*/
+result_capture *result_capture_create(const result_key *key)
+{
+    result_capture *capture;
+
+    capture = (result_capture *)malloc(sizeof(result_capture));
+    if(capture == NULL)
+    {
+        return NULL;
+    }
+
+    capture->key      = *key;
+    capture->length   = 0;
+    capture->overflow = false;
+
+    return capture;
+}
+
+/*
+    Adds a chunk of a job's output to its capture.
+
+    @param
+    capture: The capture
+    data: The output
+    length: Bytes of output
+*/
+void result_capture_append(result_capture *capture, const void *data, size_t length)
+{
+    if(capture->overflow || length > RESULT_CACHE_MAX_OUTPUT - capture->length)
+    {
+        capture->overflow = true;
+        return;
+    }
+
+    memcpy(capture->output + capture->length, data, length);
+    capture->length += length;
+}
+
+/*
+    Finds an executable on the allowlist by its file name.
+
+    @param
+    command: The resolved executable
+
+    @return
+    The allowlist entry, or NULL if the command isn't on it
+*/
+static const pure_command *find_pure_command(const char *command)
+{
+    const char *name;
+    size_t      i;
+
+    name = strrchr(command, '/');
+    name = name == NULL ? command : name + 1;
+
+    for(i = 0; i < sizeof(pure_commands) / sizeof(pure_commands[0]); i++)
+    {
+        if(strcmp(pure_commands[i].name, name) == 0)
+        {
+            return &pure_commands[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Records the identity and version of a file.
+
+    @param
+    cwd_fd: The directory relative names are resolved against
+    name: The file
+    stamp: Receives the file's version
+
+    @return
+    0 on success, -1 if the file can't be examined
+*/
+static int stamp_file(int cwd_fd, const char *name, result_stamp *stamp)
+{
+    struct stat st;
+
+    if(fstatat(cwd_fd, name, &st, 0) == -1)
+    {
+        return -1;
+    }
+
+    stamp->dev   = st.st_dev;
+    stamp->ino   = st.st_ino;
+    stamp->size  = st.st_size;
+    stamp->mtime = st.st_mtim;
+    stamp->ctime = st.st_ctim;
+
+    return 0;
+}
+
+/*
+    Compares two versions of a file.
+
+    @param
+    a: The first version
+    b: The second version
+
+    @return
+    true if both describe the same, unchanged file
+*/
+static bool stamps_equal(const result_stamp *a, const result_stamp *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec && a->ctime.tv_sec == b->ctime.tv_sec &&
+           a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+/*
+    Compares the command lines and directories of two keys, ignoring file versions.
+
+    @param
+    a: The first key
+    b: The second key
+
+    @return
+    true if both describe the same command run in the same directory
+*/
+static bool same_command(const result_key *a, const result_key *b)
+{
+    return a->hash == b->hash && a->cwd_dev == b->cwd_dev && a->cwd_ino == b->cwd_ino && strcmp(a->command, b->command) == 0 && strcmp(a->args, b->args) == 0;
+}
+
+/*
+    Continues a 32-bit FNV-1a hash over a block of bytes.
+
+    @param
+    hash: The hash so far
+    data: The bytes
+    length: The number of bytes
+
+    @return
+    The updated hash
+*/
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes;
+    size_t         i;
+
+    bytes = (const uint8_t *)data;
+    for(i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+    Reads a clock that wall-clock changes don't move.
+
+    @return
+    Seconds on CLOCK_MONOTONIC
+*/
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/*
+    Empties a cache slot.
+
+    @param
+    entry: The slot
+*/
+static void clear_entry(result_entry *entry)
+{
+    free(entry->output);
+    entry->output = NULL;
+    entry->length = 0;
+}
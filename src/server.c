@@ -1,5 +1,6 @@
 #include "server.h"
 #include "builtin.h"
+#include "fastpath.h"
 #include "setup.h"
 
 static p101_fsm_state_t wait_for_command(const struct p101_env *env, struct p101_error *err, void *arg);
@@ -13,14 +14,339 @@ static p101_fsm_state_t send_output(const struct p101_env *env, struct p101_erro
 static p101_fsm_state_t state_error(const struct p101_env *env, struct p101_error *err, void *arg);
 static p101_fsm_state_t cleanup(const struct p101_env *env, struct p101_error *err, void *arg);
 
-static void start_listening(int server_fd, int backlog);
-static int  socket_accept_connection(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
-static void shutdown_socket(int sockfd, int how);
-static void socket_close(int sockfd);
-static void process_exit(void);
-static int  find_executable(const char *cmd, char *full_path, size_t size);
+static void            *reactor_thread(void *arg);
+static int              run_reactor(server_data *server_state, int session_fd);
+static void             stop_reactors(server_data *server_state);
+static int              create_listener(struct sockaddr_storage *addr, in_port_t port, bool reuse_port);
+static void             start_listening(int server_fd, int backlog);
+static int              socket_accept_connection(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
+static int              set_nonblocking(int fd);
+static void             raise_fd_limit(void);
+static void             accept_clients(server_data *server_state);
+static int              add_client(server_data *server_state, int client_socket);
+static int              serve_session_processes(int server_fd);
+static void             reap_session_processes(pid_t *sessions, int *session_count);
+static void             watch_session_exits(bool enable);
+static void             sigchld_handler(int signum);
+static p101_fsm_state_t serve_client(server_data *server_state, uint32_t index);
+static p101_fsm_state_t process_input(server_data *server_state, uint32_t index);
+static p101_fsm_state_t relay_jobs(server_data *server_state, uint32_t index);
+static p101_fsm_state_t splice_job_output(server_data *server_state, uint32_t index, int slot, size_t available);
+static p101_fsm_state_t handle_frame(server_data *server_state, uint32_t index, const frame_header *header, const uint8_t *payload);
+static int              route_frame(server_data *server_state, uint32_t index, const frame_header *header, const uint8_t *frame);
+static int              open_channel(server_data *server_state, uint32_t index, const frame_header *header, const uint8_t *payload);
+static void             close_channel(server_data *server_state, uint32_t index);
+static int              send_control(server_data *server_state, uint32_t index, uint8_t type, uint16_t channel, const void *payload, uint32_t length);
+static bool             connection_busy(const server_data *server_state, const client_info *client);
+static int              flush_output(server_data *server_state, uint32_t index);
+static void             watch_output(server_data *server_state, uint32_t index);
+static void             resume_connection(server_data *server_state, uint32_t index);
+static void             close_client(server_data *server_state, int index);
+static void             stop_session_jobs(server_data *server_state, client_info *client);
+static void             release_idle_buffers(server_data *server_state, client_info *client);
+static void             handle_job_event(server_data *server_state, const event_record *record);
+static void             close_job_output(server_data *server_state, job_info *job);
+static void             notify_job(server_data *server_state, int job_index);
+static void             discard_job(server_data *server_state, int job_index);
+static void             release_job(server_data *server_state, int job_index);
+static void             run_timers(server_data *server_state);
+static void             expire_session(server_data *server_state, uint32_t index);
+static void             expire_job(server_data *server_state, timer_entry *timer);
+static void             reset_idle_timer(server_data *server_state, client_info *client);
+static p101_fsm_state_t finish_job(server_data *server_state, int client_index, int slot);
+static p101_fsm_state_t start_pipeline(server_data *server_state, int client_index);
+static int              create_job_pipe(client_info *client, int pipe_fds[2]);
+static p101_fsm_state_t report_spawn_failure(server_data *server_state, client_info *client, int job_index, int spawn_error);
+static p101_fsm_state_t watch_job(server_data *server_state, int client_index, int job_index, int output_fd);
+static void             stop_jobs(server_data *server_state);
+static void             shutdown_socket(int sockfd, int how);
+static void             socket_close(int sockfd);
+static void             count_state(server_data *server_state, p101_fsm_state_t state);
+static int              parse_limit(const char *text, long max, int *value);
 
 int main(int argc, char *argv[])
+{
+    char *address;
+    char *port_str;
+
+    in_port_t               port;
+    struct sockaddr_storage addr;
+    int                     exit_code;
+    server_data            *reactors;
+    int                     reactor_count;
+    int                     loops_created;
+    int                     threads_started;
+    const char             *threads_str;
+    const char             *cache_str;
+    int                     cache_ttl;
+    const char             *deadline_str;
+    int                     command_timeout;
+    const char             *idle_str;
+    int                     idle_timeout;
+    const char             *metrics_path;
+    const char             *log_str;
+    enum logger_level       log_level;
+    metrics_endpoint        endpoint;
+    bool                    process_mode;
+    bool                    buffered_relay;
+    bool                    external_only;
+    int                     session_fd;
+    sigset_t                blocked;
+    sigset_t                previous;
+    int                     i;
+    const program_option    options[] = {
+        {'f', NULL,      "Serve each connection in its own process",                          NULL,          &process_mode  },
+        {'t', "threads", "Number of reactor threads, each with its own listener (default 1)", &threads_str,  NULL           },
+        {'b', NULL,      "Relay command output through a buffer instead of splice(2)",        NULL,          &buffered_relay},
+        {'e', NULL,      "Run ls, cat, head, wc and stat as external commands",               NULL,          &external_only },
+        {'c', "seconds", "Serve repeated read-only commands from a cache for this long",      &cache_str,    NULL           },
+        {'a', "path",    "Serve Prometheus metrics on this Unix socket",                      &metrics_path, NULL           },
+        {'l', "level",   "Log level: error, warn, info or debug (default info)",              &log_str,      NULL           },
+        {'d', "seconds", "Terminate commands still running after this long",                  &deadline_str, NULL           },
+        {'i', "seconds", "Close sessions that send nothing for this long",                    &idle_str,     NULL           },
+    };
+
+    address         = NULL;
+    port_str        = NULL;
+    threads_str     = NULL;
+    cache_str       = NULL;
+    metrics_path    = NULL;
+    log_str         = NULL;
+    deadline_str    = NULL;
+    idle_str        = NULL;
+    exit_code       = EXIT_SUCCESS;
+    process_mode    = false;
+    buffered_relay  = false;
+    external_only   = false;
+    session_fd      = -1;
+    loops_created   = 0;
+    threads_started = 1;
+
+    // Start the server program
+    parse_arguments(argc, argv, options, sizeof(options) / sizeof(options[0]), &address, &port_str);
+    handle_arguments(argv[0], address, port_str, &port);
+
+    if(builtin_registry_init() == -1 || fast_path_init() == -1)
+    {
+        fprintf(stderr, "Unable to build the builtin registry\n");
+        return EXIT_FAILURE;
+    }
+
+    reactor_count = 1;
+    if(threads_str != NULL && parse_limit(threads_str, MAX_REACTORS, &reactor_count) == -1)
+    {
+        fprintf(stderr, "The number of threads must be between 1 and %d\n", MAX_REACTORS);
+        return EXIT_FAILURE;
+    }
+
+    cache_ttl = 0;
+    if(cache_str != NULL && parse_limit(cache_str, RESULT_CACHE_MAX_TTL, &cache_ttl) == -1)
+    {
+        fprintf(stderr, "The cache lifetime must be between 1 and %d seconds\n", RESULT_CACHE_MAX_TTL);
+        return EXIT_FAILURE;
+    }
+
+    command_timeout = 0;
+    if(deadline_str != NULL && parse_limit(deadline_str, MAX_TIMEOUT_SECONDS, &command_timeout) == -1)
+    {
+        fprintf(stderr, "The command deadline must be between 1 and %d seconds\n", MAX_TIMEOUT_SECONDS);
+        return EXIT_FAILURE;
+    }
+
+    idle_timeout = 0;
+    if(idle_str != NULL && parse_limit(idle_str, MAX_TIMEOUT_SECONDS, &idle_timeout) == -1)
+    {
+        fprintf(stderr, "The idle timeout must be between 1 and %d seconds\n", MAX_TIMEOUT_SECONDS);
+        return EXIT_FAILURE;
+    }
+
+    if(process_mode && reactor_count > 1)
+    {
+        fprintf(stderr, "Options -f and -t cannot be combined\n");
+        return EXIT_FAILURE;
+    }
+
+    log_level = LOG_LEVEL_INFO;
+    if(log_str != NULL && logger_parse_level(log_str, &log_level) == -1)
+    {
+        fprintf(stderr, "The log level must be error, warn, info or debug\n");
+        return EXIT_FAILURE;
+    }
+
+    // Session processes keep their metrics to themselves
+    if(process_mode && metrics_path != NULL)
+    {
+        fprintf(stderr, "Options -f and -a cannot be combined\n");
+        return EXIT_FAILURE;
+    }
+
+    reactors = (server_data *)calloc((size_t)reactor_count, sizeof(server_data));
+    if(reactors == NULL)
+    {
+        perror("Unable to allocate reactors");
+        return EXIT_FAILURE;
+    }
+
+    // Requests are logged from the reactors without waiting on stdout
+    if(logger_start(log_level) == -1)
+    {
+        perror("Unable to start the logger");
+        free(reactors);
+        return EXIT_FAILURE;
+    }
+
+    // Every session holds a socket and a directory descriptor
+    raise_fd_limit();
+
+    // Set up server, one listener per reactor sharing the port
+    convert_address(address, &addr);
+    for(i = 0; i < reactor_count; i++)
+    {
+        reactors[i].active_client   = -1;
+        reactors[i].reactors        = reactors;
+        reactors[i].reactor_count   = reactor_count;
+        reactors[i].fast_paths      = !external_only;
+        reactors[i].cache_ttl       = cache_ttl;
+        reactors[i].command_timeout = command_timeout;
+        reactors[i].idle_timeout    = idle_timeout;
+#if defined(__linux__)
+        reactors[i].splice_output = !buffered_relay;
+#endif
+        reactors[i].server_socket = create_listener(&addr, port, reactor_count > 1);
+        if(reactors[i].server_socket == -1)
+        {
+            reactors[i].server_socket = 0;
+            exit_code                 = EXIT_FAILURE;
+            goto done;
+        }
+    }
+
+    // Set up signal handler
+    setup_signal_handler();
+
+    // In process-per-connection mode only the session processes continue past here
+    if(process_mode)
+    {
+        session_fd = serve_session_processes(reactors[0].server_socket);
+        if(session_fd == -1)
+        {
+            goto done;
+        }
+
+        close(reactors[0].server_socket);
+        reactors[0].server_socket  = 0;
+        reactors[0].single_session = true;
+    }
+
+    // Event loops outlive every reactor so they can always be woken
+    for(loops_created = 0; loops_created < reactor_count; loops_created++)
+    {
+        if(event_loop_create(&reactors[loops_created].events, MAX_CLIENTS) == -1)
+        {
+            perror("Unable to set up event loop");
+            exit_code = EXIT_FAILURE;
+            goto free_events;
+        }
+    }
+
+    // Startup messages go out before anything the reactors log
+    fflush(stdout);
+
+    // Only the main thread takes SIGINT, shutdown reaches the other reactors through their wake pipes
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    endpoint.listen_fd = -1;
+    if(metrics_path != NULL && metrics_endpoint_start(&endpoint, metrics_path, reactors, reactor_count) == -1)
+    {
+        perror("Unable to serve metrics");
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        exit_code = EXIT_FAILURE;
+        goto free_events;
+    }
+    for(; threads_started < reactor_count; threads_started++)
+    {
+        if(pthread_create(&reactors[threads_started].thread, NULL, reactor_thread, &reactors[threads_started]) != 0)
+        {
+            perror("Unable to start reactor thread");
+            stop_reactors(&reactors[0]);
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if(run_reactor(&reactors[0], session_fd) != EXIT_SUCCESS)
+    {
+        exit_code = EXIT_FAILURE;
+    }
+
+    for(i = 1; i < threads_started; i++)
+    {
+        void *result;
+
+        pthread_join(reactors[i].thread, &result);
+        if(result != NULL)
+        {
+            exit_code = EXIT_FAILURE;
+        }
+    }
+
+    metrics_endpoint_stop(&endpoint);
+
+free_events:
+    for(i = 0; i < loops_created; i++)
+    {
+        event_loop_destroy(&reactors[i].events);
+    }
+
+done:
+    for(i = 0; i < reactor_count; i++)
+    {
+        if(reactors[i].server_socket > 0)
+        {
+            close(reactors[i].server_socket);
+            reactors[i].server_socket = 0;
+        }
+    }
+    free(reactors);
+    logger_stop();
+    return exit_code;
+}
+
+/*
+    Entry point of every reactor thread after the first.
+
+    @param
+    arg: The reactor to run
+
+    @return
+    NULL on a clean shutdown, non-NULL if the reactor could not run
+*/
+static void *reactor_thread(void *arg)
+{
+    server_data *server_state;
+
+    server_state = (server_data *)arg;
+    if(run_reactor(server_state, -1) != EXIT_SUCCESS)
+    {
+        return server_state;
+    }
+
+    return NULL;
+}
+
+/*
+    Sets up a reactor's jobs and PATH index and runs its FSM until shutdown.
+
+    @param
+    server_state: The reactor, with its listener and event loop already created
+    session_fd: The only connection to serve in a session process, otherwise -1
+
+    @return
+    EXIT_SUCCESS or EXIT_FAILURE
+*/
+static int run_reactor(server_data *server_state, int session_fd)
 {
     static struct p101_fsm_transition transitions[] = {
         {P101_FSM_INIT,    WAIT_FOR_CMD,     wait_for_command  },
@@ -28,15 +354,21 @@ int main(int argc, char *argv[])
         {WAIT_FOR_CMD,     PARSE_CMD,        parse_command     },
         {WAIT_FOR_CMD,     CLEANUP,          cleanup           },
         {PARSE_CMD,        CHECK_CMD_TYPE,   check_command_type},
+        {PARSE_CMD,        SEND_OUTPUT,      send_output       },
         {CHECK_CMD_TYPE,   EXECUTE_BUILT_IN, execute_built_in  },
         {CHECK_CMD_TYPE,   SEARCH_FOR_CMD,   search_for_command},
+        {CHECK_CMD_TYPE,   EXECUTE_CMD,      execute_command   },
         {CHECK_CMD_TYPE,   CLEANUP,          cleanup           },
+        {WAIT_FOR_CMD,     SEND_OUTPUT,      send_output       },
         {SEARCH_FOR_CMD,   EXECUTE_CMD,      execute_command   },
         {SEARCH_FOR_CMD,   INVALID_CMD,      invalid_command   },
         {INVALID_CMD,      SEND_OUTPUT,      send_output       },
         {EXECUTE_BUILT_IN, SEND_OUTPUT,      send_output       },
+        {EXECUTE_BUILT_IN, SEARCH_FOR_CMD,   search_for_command},
         {EXECUTE_CMD,      SEND_OUTPUT,      send_output       },
+        {EXECUTE_CMD,      WAIT_FOR_CMD,     wait_for_command  },
         {SEND_OUTPUT,      WAIT_FOR_CMD,     wait_for_command  },
+        {SEND_OUTPUT,      PARSE_CMD,        parse_command     },
         {WAIT_FOR_CMD,     ERROR,            state_error       },
         {PARSE_CMD,        ERROR,            state_error       },
         {CHECK_CMD_TYPE,   ERROR,            state_error       },
@@ -55,40 +387,55 @@ int main(int argc, char *argv[])
     p101_fsm_state_t      to_state;
     struct p101_error    *fsm_error;
     struct p101_env      *fsm_env;
+    int                   exit_code;
 
-    char *address;
-    char *port_str;
-
-    in_port_t               port;
-    int                     sockfd;
-    struct sockaddr_storage addr;
-    int                     exit_code;
-    server_data             server_state;
-
-    address   = NULL;
-    port_str  = NULL;
     exit_code = EXIT_SUCCESS;
+    session_pool_create(&server_state->sessions);
+    timer_wheel_create(&server_state->timers);
 
-    // Start the server program
-    parse_arguments(argc, argv, &address, &port_str);
-    handle_arguments(argv[0], address, port_str, &port);
-
-    // Set up server
-    convert_address(address, &addr);
-    sockfd                     = socket_create(addr.ss_family, SOCK_STREAM, 0);
-    server_state.server_socket = sockfd;
-    socket_bind(sockfd, &addr, port);
-    start_listening(sockfd, SOMAXCONN);
-
-    // Set up signal handler
-    setup_signal_handler();
+    if(job_table_create(&server_state->jobs, MAX_JOBS) == -1)
+    {
+        perror("Unable to create job table");
+        exit_code = EXIT_FAILURE;
+        goto free_jobs;
+    }
+    if(!server_state->single_session && event_add(&server_state->events, server_state->server_socket, EVENT_LISTENER, 0) == -1)
+    {
+        perror("Unable to watch server socket");
+        exit_code = EXIT_FAILURE;
+        goto free_jobs;
+    }
+    if(path_cache_create(&server_state->paths) == -1)
+    {
+        perror("Unable to index PATH");
+        exit_code = EXIT_FAILURE;
+        goto free_jobs;
+    }
+    if(server_state->paths.inotify_fd >= 0 && event_add(&server_state->events, server_state->paths.inotify_fd, EVENT_PATH_CACHE, 0) == -1)
+    {
+        perror("Unable to watch PATH");
+        exit_code = EXIT_FAILURE;
+        goto free_paths;
+    }
+    if(result_cache_create(&server_state->results, server_state->cache_ttl) == -1)
+    {
+        perror("Unable to create result cache");
+        exit_code = EXIT_FAILURE;
+        goto free_paths;
+    }
+    if(server_state->single_session && add_client(server_state, session_fd) == -1)
+    {
+        close(session_fd);
+        exit_code = EXIT_FAILURE;
+        goto free_results;
+    }
 
     // Set up FSM
     error = p101_error_create(false);
     if(error == NULL)
     {
         exit_code = EXIT_FAILURE;
-        goto done;
+        goto free_results;
     }
     env = p101_env_create(error, true, NULL);
     if(p101_error_has_error(error))
@@ -111,7 +458,7 @@ int main(int argc, char *argv[])
     }
 
     fsm = p101_fsm_info_create(env, error, "application-fsm", fsm_env, fsm_error, NULL);
-    p101_fsm_run(fsm, &from_state, &to_state, &server_state, transitions, sizeof(transitions));
+    p101_fsm_run(fsm, &from_state, &to_state, server_state, transitions, sizeof(transitions));
 
     // Cleanup
     p101_fsm_info_destroy(env, &fsm);
@@ -128,21 +475,54 @@ free_error:
     p101_error_reset(error);
     free(error);
 
-done:
-    if(server_state.server_socket > 0)
+free_results:
+    result_cache_destroy(&server_state->results);
+
+free_paths:
+    path_cache_destroy(&server_state->paths);
+
+free_jobs:
+    job_table_destroy(&server_state->jobs);
+    session_pool_destroy(&server_state->sessions);
+
+    // A reactor that could not start takes the rest of the server down with it
+    if(exit_code != EXIT_SUCCESS)
     {
-        close(server_state.server_socket);
-        server_state.server_socket = 0;
+        stop_reactors(server_state);
     }
+
     return exit_code;
 }
 
+/*
+    Asks every reactor to shut down.
+
+    @param
+    server_state: The reactor initiating the shutdown
+*/
+static void stop_reactors(server_data *server_state)
+{
+    int i;
+
+    exit_flag = 1;
+    for(i = 0; i < server_state->reactor_count; i++)
+    {
+        if(&server_state->reactors[i] != server_state)
+        {
+            event_wake(&server_state->reactors[i].events);
+        }
+    }
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 /*
-    Waits for input from connected clients or new connection attempts using select().
-    Accepts new connections or reads messages from active clients into their buffer.
+    Waits for input from connected clients or new connection attempts using the event loop.
+    Sessions with pending input are served from the ready list before waiting again, so
+    each wakeup only touches the descriptors that actually fired. Output and exit
+    notifications from running jobs are handled here as well, so a slow command never
+    blocks the other sessions.
 
     @param
     env: The program context
@@ -152,144 +532,99 @@ done:
     @return
     WAIT_FOR_CMD: Continue waiting for input
     PARSE_CMD: A message was received and should be parsed
+    SEND_OUTPUT: A job finished and its output is ready
     CLEANUP: Shutdown was requested
-    ERROR: A socket or select error occurred
+    ERROR: A socket or event loop error occurred
 */
 p101_fsm_state_t wait_for_command(const struct p101_env *env, struct p101_error *err, void *arg)
 {
-    struct sockaddr_storage client_addr;
-    struct timeval          timeout;
-    server_data            *server_state;
-    fd_set                  read_fds;
-    socklen_t               client_len;
-    ssize_t                 bytes_received;
-    int                     activity;
-    int                     nfds;
-    int                     i;
-    int                     new_socket;
+    server_data *server_state;
+    event_record records[EVENT_BATCH];
+    uint32_t     index;
+    int          count;
+    int          i;
 
     P101_TRACE(env);
     server_state = (server_data *)arg;
-    client_len   = sizeof(client_addr);
-    new_socket   = -1;
 
-    // **Reset FD_SET and add server socket**
-    FD_ZERO(&read_fds);
-    FD_SET(server_state->server_socket, &read_fds);
+    count_state(server_state, WAIT_FOR_CMD);
 
-    // **Calculate max file descriptor (nfds)**
-    nfds = server_state->server_socket;
-    for(i = 0; i < MAX_CLIENTS; i++)
+    while(!exit_flag)
     {
-        int client_socket = server_state->clients[i].client_socket;
-        if(client_socket > 0)
+        // **Serve sessions that already have pending input**
+        while(!exit_flag && event_ready_pop(&server_state->events, &index))
         {
-            FD_SET(client_socket, &read_fds);
-            nfds = (nfds > client_socket) ? nfds : client_socket;
-        }
-    }
-    nfds += 1;
-
-    // **Set timeout for select**
-    timeout.tv_sec  = TIMEOUT;
-    timeout.tv_usec = 0;
+            p101_fsm_state_t next_state;
 
-    activity = select(nfds, &read_fds, NULL, NULL, &timeout);
-
-    if(activity < 0 && errno != EINTR)
-    {
-        perror("[ERROR] Select error");
-        return ERROR;
-    }
-    if(activity == 0)
-    {
-        fflush(stdout);
-        return WAIT_FOR_CMD;
-    }
-
-    // **Check for new client connections**
-    if(FD_ISSET(server_state->server_socket, &read_fds))
-    {
-        int slot_found = 0;
+            next_state = serve_client(server_state, index);
+            if(next_state != WAIT_FOR_CMD)
+            {
+                return next_state;
+            }
+        }
 
-        // Exit if exit_flag is set
+        // A session process stops as soon as its connection closes
         if(exit_flag)
         {
-            return CLEANUP;
+            break;
         }
 
-        new_socket = socket_accept_connection(server_state->server_socket, &client_addr, &client_len);
-        if(new_socket < 0)
-        {
-            perror("Accept error");
-            return ERROR;
-        }
+        // Sleep no longer than the next timer allows
+        count = event_wait(&server_state->events, records, EVENT_BATCH, timer_wheel_timeout(&server_state->timers, TIMEOUT * 1000));
 
-        for(i = 0; i < MAX_CLIENTS; i++)
+        if(count < 0)
         {
-            if(server_state->clients[i].client_socket == 0)
+            if(errno == EINTR)
             {
-                server_state->clients[i].client_socket = new_socket;
-                memset(server_state->clients[i].msg, 0, MAX_MSG_LENGTH);
-                slot_found = 1;
-                break;
+                continue;
             }
-        }
 
-        if(!slot_found)
-        {
-            fprintf(stderr, "Max clients reached, rejecting new connection.\n");
-            close(new_socket);
-            new_socket = -1;
+            perror("[ERROR] Event wait error");
+            return ERROR;
         }
-    }
 
-    // **Check for input from existing clients**
-    for(i = 0; i < MAX_CLIENTS; i++)
-    {
-        int client_socket = server_state->clients[i].client_socket;
+        run_timers(server_state);
 
-        if(client_socket > 0 && FD_ISSET(client_socket, &read_fds))
+        if(count == 0)
         {
-            char buffer[MAX_MSG_LENGTH];
-
-            bytes_received = recv(client_socket, buffer, MAX_MSG_LENGTH - 1, MSG_DONTWAIT);
+            fflush(stdout);
+            return WAIT_FOR_CMD;
+        }
 
-            if(bytes_received < 0 && errno != EWOULDBLOCK && errno == EAGAIN)
+        for(i = 0; i < count; i++)
+        {
+            if(records[i].kind == EVENT_LISTENER)
             {
-                printf("Waiting for data from client %d...\n", client_socket);
-                continue;
+                accept_clients(server_state);
             }
-
-            if(bytes_received < 0)
+            else if(records[i].kind == EVENT_WAKE)
             {
-                perror("[ERROR] recv() failed");
-                close(client_socket);
-                FD_CLR(client_socket, &read_fds);
-                server_state->clients[i].client_socket = 0;
-                continue;
+                event_wake_drain(&server_state->events);
             }
-
-            if(bytes_received == 0)
+            else if(records[i].kind == EVENT_PATH_CACHE)
+            {
+                path_cache_handle_event(&server_state->paths);
+            }
+            else if(records[i].kind == EVENT_CLIENT)
             {
-                printf("Client %d disconnected\n", client_socket);
-                close(client_socket);
-                FD_CLR(client_socket, &read_fds);
-                server_state->clients[i].client_socket = 0;
+                client_info *client;
+
+                // Room to write only flushes the queued output, the socket isn't read again for it
+                client = session_get(&server_state->sessions, records[i].token);
+                if(client != NULL && (records[i].events & (EVENT_IN | EVENT_HUP)))
+                {
+                    client->drained = false;
+                }
+                event_ready_push(&server_state->events, records[i].token);
             }
             else
             {
-                buffer[bytes_received] = '\0';
-                strncpy(server_state->clients[i].msg, buffer, MAX_MSG_LENGTH);
-                server_state->active_client = i;
-                printf("[input] from client %d: %s\n", client_socket, buffer);
-                return PARSE_CMD;
+                handle_job_event(server_state, &records[i]);
             }
         }
     }
 
-    (void)new_socket;
-    return WAIT_FOR_CMD;
+    return CLEANUP;
 }
 
 #pragma GCC diagnostic pop
@@ -298,7 +633,9 @@ p101_fsm_state_t wait_for_command(const struct p101_env *env, struct p101_error
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 /*
-    Parses a client's message into a command and its arguments.
+    Parses a client's message into a command and its arguments. A list of
+    commands joined by ;, && or || is cut after its first command, send_output
+    comes back here with each of the others that has to run.
 
     @param
     env: The program context
@@ -307,55 +644,43 @@ p101_fsm_state_t wait_for_command(const struct p101_env *env, struct p101_error
 
     @return
     CHECK_CMD_TYPE: Command successfully parsed
+    SEND_OUTPUT: The command list is malformed
 */
 static p101_fsm_state_t parse_command(const struct p101_env *env, struct p101_error *err, void *arg)
 {
     server_data *server_state;
     int          client_index;
     client_info *client;
-    int          i;
-    int          j;
-    int          k;
 
     P101_TRACE(env);
 
     server_state = (server_data *)arg;
     client_index = server_state->active_client;
-    client       = &server_state->clients[client_index];
+    client       = session_get(&server_state->sessions, (uint32_t)client_index);
 
-    i = 0;    // for original message
-    j = 0;    // for command buffer
-    k = 0;    // for argument buffer
-
-    // Extract the command
-    while(client->msg[i] != ' ' && client->msg[i] != '\0' && j < MAX_CMD_LENGTH - 1)
-    {
-        client->cmd[j++] = client->msg[i++];
-    }
-    client->cmd[j] = '\0';
+    count_state(server_state, PARSE_CMD);
 
-    // Move past space(s) to get to the arguments
-    while(client->msg[i] == ' ')
-    {
-        i++;
-    }
+    // Every request ends with a STATUS frame, success unless a later state says otherwise
+    client->status         = 0;
+    client->reply_complete = true;
 
-    // Extract any arguments
-    if(client->msg[i] != '\0')
+    // A command taken from a list already has the rest of the list waiting
+    if(client->io->sequence[0] == '\0')
     {
-        while(client->msg[i] != '\0' && k < MAX_ARGS_LENGTH - 1)
+        if(session_split_list(client->io) == -1)
         {
-            client->args[k++] = client->msg[i++];
+            snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Missing command in command list\n");
+            client->status = CMD_SYNTAX_ERROR;
+            metrics_add(&server_state->metrics.commands[METRICS_INVALID], 1);
+            return SEND_OUTPUT;
         }
-        client->args[k] = '\0';
-    }
-    else
-    {
-        client->args[0] = '\0';
+        client->io->sequence_id = client->request_id;
     }
 
-    // printf("Parsed command: %s\n", client->cmd);
-    // printf("Parsed argument(s): %s\n", client->args);
+    session_parse_command(client->io);
+
+    // printf("Parsed command: %s\n", client->io->cmd);
+    // printf("Parsed argument(s): %s\n", client->io->args);
 
     return CHECK_CMD_TYPE;
 }
@@ -377,6 +702,7 @@ static p101_fsm_state_t parse_command(const struct p101_env *env, struct p101_er
     CLEANUP: If "exit" command is received
     EXECUTE_BUILT_IN: If the command is a recognized built-in
     SEARCH_FOR_CMD: If the command may be external
+    EXECUTE_CMD: If the command line has pipes or redirections
 */
 static p101_fsm_state_t check_command_type(const struct p101_env *env, struct p101_error *err, void *arg)
 {
@@ -389,21 +715,30 @@ static p101_fsm_state_t check_command_type(const struct p101_env *env, struct p1
 
     server_state = (server_data *)arg;
     client_index = server_state->active_client;
-    client       = &server_state->clients[client_index];
+    client       = session_get(&server_state->sessions, (uint32_t)client_index);
+
+    count_state(server_state, CHECK_CMD_TYPE);
 
-    if(strcmp(client->cmd, "exit") == 0)
+    server_state->active_builtin = builtin_lookup(server_state, client->io->cmd);
+
+    if(server_state->active_builtin != NULL && (server_state->active_builtin->flags & BUILTIN_STOPS_SERVER))
     {
-        printf("[exit] Shutting down server...\n");
+        LOG_AT(LOG_LEVEL_INFO, "[exit] Shutting down server...\n");
         next_state = CLEANUP;
     }
-    else if(strcmp(client->cmd, "cd") == 0 || strcmp(client->cmd, "pwd") == 0 || strcmp(client->cmd, "echo") == 0 || strcmp(client->cmd, "type") == 0 || strcmp(client->cmd, "meow") == 0)
+    else if(pipeline_is_compound(client->io->msg))
+    {
+        // Every stage of a pipeline runs as a program, even one named like a builtin
+        next_state = EXECUTE_CMD;
+    }
+    else if(server_state->active_builtin != NULL)
     {
-        printf("[type] %s is built-in\n", client->cmd);
+        LOG_AT(LOG_LEVEL_DEBUG, "[type] %s is built-in\n", client->io->cmd);
         next_state = EXECUTE_BUILT_IN;
     }
     else
     {
-        // printf("[type] %s is external\n", client->cmd);
+        // printf("[type] %s is external\n", client->io->cmd);
         next_state = SEARCH_FOR_CMD;
     }
 
@@ -436,9 +771,13 @@ static p101_fsm_state_t invalid_command(const struct p101_env *env, struct p101_
 
     server_state = (server_data *)arg;
     client_index = server_state->active_client;
-    client       = &server_state->clients[client_index];
+    client       = session_get(&server_state->sessions, (uint32_t)client_index);
+
+    count_state(server_state, INVALID_CMD);
 
-    snprintf(client->output, MAX_MSG_LENGTH, "Error: Invalid command\n");
+    snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Invalid command\n");
+    client->status = CMD_NOT_FOUND;
+    metrics_add(&server_state->metrics.commands[METRICS_INVALID], 1);
 
     return SEND_OUTPUT;
 }
@@ -449,7 +788,7 @@ static p101_fsm_state_t invalid_command(const struct p101_env *env, struct p101_
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 /*
-    Executes a built-in command like cd, pwd, echo, type, or meow.
+    Runs the handler of the built-in command found by check_command_type.
 
     @param
     env: The program context
@@ -458,6 +797,7 @@ static p101_fsm_state_t invalid_command(const struct p101_env *env, struct p101_
 
     @return
     SEND_OUTPUT: Transition to send the result to the client
+    SEARCH_FOR_CMD: If a fast path left the command to the external program
 */
 static p101_fsm_state_t execute_built_in(const struct p101_env *env, struct p101_error *err, void *arg)
 {
@@ -469,40 +809,20 @@ static p101_fsm_state_t execute_built_in(const struct p101_env *env, struct p101
 
     server_state = (server_data *)arg;
     client_index = server_state->active_client;
-    client       = &server_state->clients[client_index];
+    client       = session_get(&server_state->sessions, (uint32_t)client_index);
+
+    count_state(server_state, EXECUTE_BUILT_IN);
 
     // Clear output buffer
-    memset(client->output, 0, MAX_MSG_LENGTH);
+    memset(client->io->output, 0, MAX_MSG_LENGTH);
 
-    if(strcmp(client->cmd, "cd") == 0)
-    {
-        process_cd(client);
-    }
-    else if(strcmp(client->cmd, "pwd") == 0)
-    {
-        process_pwd(client);
-    }
-    else if(strcmp(client->cmd, "echo") == 0)
-    {
-        process_echo(client);
-    }
-    else if(strcmp(client->cmd, "type") == 0)
-    {
-        process_type(client);
-    }
-    else if(strcmp(client->cmd, "meow") == 0)
-    {
-        process_meow(client);
-    }
-    else if(strcmp(client->cmd, "exit") == 0)
-    {
-        process_exit();
-    }
-    else
+    // check_command_type already resolved the registry entry
+    if(server_state->active_builtin->handler(client, server_state) == BUILTIN_EXTERNAL)
     {
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Unrecognized built-in command\n");
+        return SEARCH_FOR_CMD;
     }
 
+    metrics_add(&server_state->metrics.commands[(server_state->active_builtin->flags & BUILTIN_FAST_PATH) ? METRICS_FAST_PATH : METRICS_BUILTIN], 1);
     return SEND_OUTPUT;
 }
 
@@ -534,19 +854,21 @@ static p101_fsm_state_t search_for_command(const struct p101_env *env, struct p1
 
     server_state = (server_data *)arg;
     client_index = server_state->active_client;
-    client       = &server_state->clients[client_index];
+    client       = session_get(&server_state->sessions, (uint32_t)client_index);
+
+    count_state(server_state, SEARCH_FOR_CMD);
 
     // Try to locate the command in the system's PATH
-    if(find_executable(client->cmd, command_path, sizeof(command_path)) != 0)
+    if(path_cache_lookup(&server_state->paths, client->io->cmd, command_path, sizeof(command_path)) != 0)
     {
         // Command not found, set error message
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Command not found\n");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Command not found\n");
         return INVALID_CMD;
     }
 
     // Command found, store it and transition to execution
-    printf("[type] %s is external at %s\n", client->cmd, command_path);
-    snprintf(client->cmd_path, MAX_MSG_LENGTH, "%s", command_path);
+    LOG_AT(LOG_LEVEL_DEBUG, "[type] %s is external at %s\n", client->io->cmd, command_path);
+    snprintf(client->io->cmd_path, MAX_MSG_LENGTH, "%s", command_path);
     return EXECUTE_CMD;
 }
 
@@ -556,7 +878,8 @@ static p101_fsm_state_t search_for_command(const struct p101_env *env, struct p1
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 /*
-    Executes an external command and captures its output via a pipe.
+    Starts an external command as a job whose output pipe and exit notification are
+    watched by the event loop. The session's reply is sent once the job finishes.
 
     @param
     env: The program context
@@ -564,7 +887,8 @@ static p101_fsm_state_t search_for_command(const struct p101_env *env, struct p1
     arg: The program configuration details
 
     @return
-    SEND_OUTPUT: After execution, with output or error message
+    WAIT_FOR_CMD: The job was started
+    SEND_OUTPUT: The job could not be started, with an error message
 */
 static p101_fsm_state_t execute_command(const struct p101_env *env, struct p101_error *err, void *arg)
 {
@@ -573,138 +897,344 @@ static p101_fsm_state_t execute_command(const struct p101_env *env, struct p101_
     client_info *client;
     int          pipe_fds[2];
     pid_t        pid;
+    char         args[MAX_ARGS_LENGTH];
+    char        *argv[(MAX_ARGS_LENGTH / 2) + 2];
+    int          argc;
+    char        *token;
     char        *saveptr;
+    int          spawn_error;
+    job_info    *job;
+    int          job_index;
+    result_key   key;
+    bool         cacheable;
 
     P101_TRACE(env);
 
     server_state = (server_data *)arg;
     client_index = server_state->active_client;
-    client       = &server_state->clients[client_index];
+    client       = session_get(&server_state->sessions, (uint32_t)client_index);
+
+    count_state(server_state, EXECUTE_CMD);
+
+    // Any early return below is a failure to start the command
+    client->status = EXIT_FAILURE;
+
+    // Pipes and redirections are parsed from the whole message
+    if(pipeline_is_compound(client->io->msg))
+    {
+        return start_pipeline(server_state, client_index);
+    }
 
-    if(client->cmd_path[0] == '\0')
+    if(client->io->cmd_path[0] == '\0')
     {
         perror("Executable not found");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Executable not found\n");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Executable not found\n");
+        client->status = CMD_NOT_EXECUTABLE;
         return SEND_OUTPUT;
     }
 
-    // Create a pipe
-#if defined(__linux__)
-    if(pipe2(pipe_fds, O_CLOEXEC) == -1)
+    // For cat, check if there are args
+    if(client->io->args[0] == '\0' && strcmp(client->io->cmd, "cat") == 0)
     {
-        perror("pipe2 failed");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Unable to create pipe\n");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: 'cat' requires input or filename\n");
         return SEND_OUTPUT;
     }
-#else
-    if(pipe(pipe_fds) == -1)    // NOLINT(android-cloexec-pipe)
+
+    // Repeated read-only commands are answered from the result cache, the key records the files as they are before the run
+    cacheable = result_key_build(&server_state->results, client->cwd_fd, client->io->cmd_path, client->io->args, &key) == 0;
+    if(cacheable && result_cache_lookup(&server_state->results, &key, client->io->output, &client->output_len) == 0)
     {
-        perror("pipe failed");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Unable to create pipe\n");
+        LOG_AT(LOG_LEVEL_DEBUG, "[cache] %s %s\n", client->io->cmd, client->io->args);
+        client->status = EXIT_SUCCESS;
+        metrics_add(&server_state->metrics.commands[METRICS_CACHED], 1);
+        if(client->output_len == 0)
+        {
+            client->io->output[0] = '\0';
+        }
         return SEND_OUTPUT;
     }
 
-    // Set close-on-exec manually
-    if(fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC) == -1)
+    job = client->job_count < MAX_SESSION_JOBS ? job_acquire(&server_state->jobs, &job_index) : NULL;
+    if(job == NULL)
     {
-        perror("fcntl failed");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Unable to set pipe flags\n");
-        close(pipe_fds[0]);
-        close(pipe_fds[1]);
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Too many running commands\n");
         return SEND_OUTPUT;
     }
-#endif
 
-    // Set FD_CLOEXEC flag manually
-    if(fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC) == -1)
+    if(create_job_pipe(client, pipe_fds) == -1)
+    {
+        job_release(&server_state->jobs, job_index);
+        return SEND_OUTPUT;
+    }
+
+    // Prepare the argument vector, leaving the session's copy of the arguments intact
+    snprintf(args, sizeof(args), "%s", client->io->args);
+    argc         = 0;
+    argv[argc++] = client->io->cmd_path;
+    token        = strtok_r(args, " ", &saveptr);
+
+    while(token && argc < MAX_ARGS_LENGTH / 2)
+    {
+        argv[argc++] = token;
+        token        = strtok_r(NULL, " ", &saveptr);
+    }
+    argv[argc] = NULL;
+
+    // Start the command in the session's directory without copying the server's address space
+    spawn_error = spawn_command(client->io->cmd_path, argv, pipe_fds[1], client->cwd_fd, &pid);
+
+    // Close write end
+    close(pipe_fds[1]);
+
+    if(spawn_error != 0)
     {
-        perror("Failed to set FD_CLOEXEC");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Unable to set pipe flags\n");
         close(pipe_fds[0]);
-        close(pipe_fds[1]);
+        return report_spawn_failure(server_state, client, job_index, spawn_error);
+    }
+
+    job->pid     = pid;
+    job->capture = cacheable ? result_capture_create(&key) : NULL;
+    return watch_job(server_state, client_index, job_index, pipe_fds[0]);
+}
+
+/*
+    Starts a command line with pipes or redirections as one job. Every stage is
+    looked up on PATH, builtins included, and the job ends with the last stage.
+
+    @param
+    server_state: The server owning the session
+    client_index: The session running the pipeline
+
+    @return
+    WAIT_FOR_CMD: The pipeline was started
+    SEND_OUTPUT: The pipeline could not be started, with an error message
+*/
+static p101_fsm_state_t start_pipeline(server_data *server_state, int client_index)
+{
+    client_info *client;
+    char         line[MAX_MSG_LENGTH];
+    pipeline     pl;
+    pid_t        pids[MAX_PIPELINE_STAGES];
+    int          pipe_fds[2];
+    const char  *error;
+    int          spawn_error;
+    job_info    *job;
+    int          job_index;
+    int          i;
+
+    client = session_get(&server_state->sessions, (uint32_t)client_index);
+
+    // The stages point into a copy, the session's message stays intact
+    snprintf(line, sizeof(line), "%s", client->io->msg);
+    if(pipeline_parse(line, &pl, &error) == -1)
+    {
+        snprintf(client->io->output, MAX_MSG_LENGTH, "%s", error);
+        client->status = CMD_SYNTAX_ERROR;
+        metrics_add(&server_state->metrics.commands[METRICS_INVALID], 1);
         return SEND_OUTPUT;
     }
 
-    // For cat, check if there are args
-    if(client->args[0] == '\0' && strcmp(client->cmd, "cat") == 0)
+    for(i = 0; i < pl.stage_count; i++)
+    {
+        if(path_cache_lookup(&server_state->paths, pl.stages[i].argv[0], pl.stages[i].path, sizeof(pl.stages[i].path)) != 0)
+        {
+            snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Command not found: %s\n", pl.stages[i].argv[0]);
+            client->status = CMD_NOT_FOUND;
+            metrics_add(&server_state->metrics.commands[METRICS_INVALID], 1);
+            return SEND_OUTPUT;
+        }
+    }
+
+    job = client->job_count < MAX_SESSION_JOBS ? job_acquire(&server_state->jobs, &job_index) : NULL;
+    if(job == NULL)
+    {
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Too many running commands\n");
+        return SEND_OUTPUT;
+    }
+
+    if(create_job_pipe(client, pipe_fds) == -1)
     {
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: 'cat' requires input or filename\n");
+        job_release(&server_state->jobs, job_index);
         return SEND_OUTPUT;
     }
 
-    // Fork a new child process
-    pid = fork();
-    if(pid < 0)
+    // Redirected files are opened in the session's directory, like the stages run in it
+    spawn_error = pipeline_open_redirects(&pl, client->cwd_fd, &error);
+    if(spawn_error != 0)
     {
-        perror("Fork failed");
-        snprintf(client->output, MAX_MSG_LENGTH, "Error: Unable to execute due to fork failure\n");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: %s: %s\n", error, strerror(spawn_error));
         close(pipe_fds[0]);
         close(pipe_fds[1]);
+        job_release(&server_state->jobs, job_index);
         return SEND_OUTPUT;
     }
 
-    // Child process
-    if(pid == 0)
-    {
-        char *argv[(MAX_ARGS_LENGTH / 2) + 2];
-        int   argc;
+    spawn_error = spawn_pipeline(&pl, pipe_fds[1], client->cwd_fd, pids);
+    pipeline_close_redirects(&pl);
+    close(pipe_fds[1]);
 
-        // Close read end
+    if(spawn_error != 0)
+    {
         close(pipe_fds[0]);
+        return report_spawn_failure(server_state, client, job_index, spawn_error);
+    }
+
+    // The last stage's exit status is the pipeline's, the others only have to be reaped
+    job->pid         = pids[pl.stage_count - 1];
+    job->stage_count = pl.stage_count - 1;
+    memcpy(job->stages, pids, sizeof(pid_t) * (size_t)job->stage_count);
+    LOG_AT(LOG_LEVEL_DEBUG, "[pipeline] %d stages for client %d\n", pl.stage_count, client->client_socket);
+
+    return watch_job(server_state, client_index, job_index, pipe_fds[0]);
+}
+
+/*
+    Creates the pipe a job's output is relayed from. The write end is inherited by
+    the command, the read end is non-blocking for the event loop.
+
+    @param
+    client: The session, receives the error message on failure
+    pipe_fds: Receives the read and write ends
+
+    @return
+    0 on success, -1 on failure
+*/
+static int create_job_pipe(client_info *client, int pipe_fds[2])
+{
+    // Create a pipe
+#if defined(__linux__)
+    if(pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe2 failed");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Unable to create pipe\n");
+        return -1;
+    }
+#else
+    if(pipe(pipe_fds) == -1)    // NOLINT(android-cloexec-pipe)
+    {
+        perror("pipe failed");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Unable to create pipe\n");
+        return -1;
+    }
 
-        // Redirect stdout and stderr
-        dup2(pipe_fds[1], STDOUT_FILENO);
-        dup2(pipe_fds[1], STDERR_FILENO);
+    // Set close-on-exec manually
+    if(fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC) == -1)
+    {
+        perror("fcntl failed");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Unable to set pipe flags\n");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+#endif
 
-        // Close write end
+    // Set FD_CLOEXEC flag manually, the read end is drained by the event loop
+    if(fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC) == -1 || set_nonblocking(pipe_fds[0]) == -1)
+    {
+        perror("Failed to set pipe flags");
+        snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Unable to set pipe flags\n");
+        close(pipe_fds[0]);
         close(pipe_fds[1]);
+        return -1;
+    }
 
-        // Prepare file path for execv
-        argc         = 0;
-        argv[argc++] = client->cmd_path;
-        arg          = strtok_r(client->args, " ", &saveptr);
 
-        while(arg && argc < MAX_ARGS_LENGTH / 2)
-        {
-            argv[argc++] = (char *)arg;
-            arg          = strtok_r(NULL, " ", &saveptr);
-        }
-        argv[argc] = NULL;
+    return 0;
+}
+
+/*
+    Answers a request whose command couldn't be started, freeing the job it
+    would have run as.
 
-        // Execute command
-        execv(argv[0], argv);
+    @param
+    server_state: The server owning the session
+    client: The session
+    job_index: The job's slot in the job table
+    spawn_error: The errno value from starting the command
 
-        perror("Exec failed");
-        exit(EXIT_FAILURE);
+    @return
+    SEND_OUTPUT, with an error message
+*/
+static p101_fsm_state_t report_spawn_failure(server_data *server_state, client_info *client, int job_index, int spawn_error)
+{
+    errno = spawn_error;
+    perror("Spawn failed");
+    metrics_add(&server_state->metrics.spawn_failures, 1);
+    snprintf(client->io->output, MAX_MSG_LENGTH, "Error: Unable to execute command\n");
+    job_release(&server_state->jobs, job_index);
+
+    if(spawn_error == ENOENT)
+    {
+        client->status = CMD_NOT_FOUND;
     }
-    else
+    else if(spawn_error == EACCES || spawn_error == ENOEXEC)
     {
-        char    buffer[MAX_MSG_LENGTH];
-        ssize_t bytes_read;
+        client->status = CMD_NOT_EXECUTABLE;
+    }
+    return SEND_OUTPUT;
+}
 
-        // Close write end
-        close(pipe_fds[1]);
+/*
+    Hands a started job to the event loop, which relays its output and reports
+    its exit to the session.
 
-        // Prepare output from the child
-        memset(buffer, 0, MAX_MSG_LENGTH);
-        bytes_read = read(pipe_fds[0], buffer, MAX_MSG_LENGTH - 1);
+    @param
+    server_state: The server owning the session
+    client_index: The session the job answers
+    job_index: The job, with its processes started
+    output_fd: Read end of the job's output pipe
 
-        close(pipe_fds[0]);
+    @return
+    WAIT_FOR_CMD: The session waits for the job
+    SEND_OUTPUT: The job finished before it could be watched
+*/
+static p101_fsm_state_t watch_job(server_data *server_state, int client_index, int job_index, int output_fd)
+{
+    client_info *client;
+    job_info    *job;
+
+    client = session_get(&server_state->sessions, (uint32_t)client_index);
+    job    = &server_state->jobs.jobs[job_index];
+
+    job->client                       = client_index;
+    job->request_id                   = client->request_id;
+    job->output_fd                    = output_fd;
+    client->jobs[client->job_count++] = job_index;
+    memset(client->io->output, 0, MAX_MSG_LENGTH);
+    metrics_add(&server_state->metrics.commands[METRICS_EXTERNAL], 1);
+    metrics_add(&server_state->metrics.children, 1);
+
+    timer_init(&job->timer, TIMER_DEADLINE, (uint32_t)job_index);
+    timer_init(&job->reap_timer, TIMER_REAP, (uint32_t)job_index);
+    if(server_state->command_timeout > 0)
+    {
+        timer_schedule(&server_state->timers, &job->timer, (uint64_t)server_state->command_timeout * 1000);
+    }
 
-        if(bytes_read > 0)
-        {
-            strncpy(client->output, buffer, MAX_MSG_LENGTH);
-        }
-        else
+    if(event_add(&server_state->events, job->output_fd, EVENT_JOB_OUTPUT, (uint32_t)job_index) == -1)
+    {
+        perror("Unable to watch command output");
+        close(job->output_fd);
+        job->output_fd = -1;
+    }
+
+    if(job_watch_exit(job) != -1 && event_add(&server_state->events, job->pidfd, EVENT_JOB_EXIT, (uint32_t)job_index) == -1)
+    {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+
+    // Without an output pipe or exit notification, poll for the exit instead of blocking the reactor
+    if(job->output_fd == -1 && job->pidfd == -1)
+    {
+        if(job_reap(job, false))
         {
-            snprintf(client->output, MAX_MSG_LENGTH, "Error: no output from command\n");
+            return finish_job(server_state, client_index, client->job_count - 1);
         }
-
-        // Wait for child to finish
-        waitpid(pid, NULL, 0);
+        timer_schedule(&server_state->timers, &job->reap_timer, REAP_POLL_MS);
     }
 
-    return SEND_OUTPUT;
+    return WAIT_FOR_CMD;
 }
 
 #pragma GCC diagnostic pop
@@ -713,7 +1243,12 @@ static p101_fsm_state_t execute_command(const struct p101_env *env, struct p101_
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 /*
-    Sends the generated output back to the active client.
+    Sends the generated output back to the active client as an OUTPUT frame,
+    followed by the STATUS frame when the request is complete. Input a channel
+    has consumed since the last reply is handed back as credit in the same write.
+    When the command was part of a list, the STATUS frame waits until the list
+    is finished and the next command that has to run is parsed instead. What the
+    socket doesn't take right away is queued on the connection.
 
     @param
     env: The program context
@@ -721,75 +1256,114 @@ static p101_fsm_state_t execute_command(const struct p101_env *env, struct p101_
     arg: The program configuration details
 
     @return
-    WAIT_FOR_CMD: After successfully sending the response
-    ERROR: If an error occurs during transmission
+    WAIT_FOR_CMD: After sending the response (a client that cannot be written to is closed)
+    PARSE_CMD: The next command of a list should run
+    ERROR: If the active client is invalid
 */
 static p101_fsm_state_t send_output(const struct p101_env *env, struct p101_error *err, void *arg)
 {
     server_data *server_state;
     int          client_index;
     client_info *client;
+    client_info *connection;
     size_t       msg_length;
-    ssize_t      total_written;
+    uint8_t      output_header[FRAME_HEADER_SIZE];
+    uint8_t      status_frame[FRAME_HEADER_SIZE + sizeof(uint32_t)];
+    uint8_t      credit_frame[FRAME_HEADER_SIZE + sizeof(uint32_t)];
+    struct iovec iov[4];
+    int          iovcnt;
+    bool         next_command;
+    int          i;
 
     P101_TRACE(env);
 
     server_state = (server_data *)arg;
     client_index = server_state->active_client;
+    client       = session_get(&server_state->sessions, (uint32_t)client_index);
 
-    // Validate client index before accessing the array
-    if(client_index < 0 || client_index >= MAX_CLIENTS)
+    count_state(server_state, SEND_OUTPUT);
+
+    // Validate the active session before touching its buffers
+    if(client == NULL || client->io == NULL)
     {
         fprintf(stderr, "Invalid client index: %d\n", client_index);
         return ERROR;
     }
 
-    client = &server_state->clients[client_index];
+    // Relayed command output may contain NUL bytes, text replies are strings
+    msg_length = client->output_len > 0 ? client->output_len : strlen(client->io->output);
+    LOG_AT(LOG_LEVEL_DEBUG, "[output] to client %d: %.*s\n", client->client_socket, (int)msg_length, client->io->output);
 
-    printf("[output] to client %d: %s\n", client->client_socket, client->output);
+    // The output of every command of a list goes to the one request
+    next_command = client->reply_complete && client->io->sequence[0] != '\0' && client->request_id == client->io->sequence_id && session_next_command(client->io, client->status);
+    if(next_command)
+    {
+        client->reply_complete = false;
+    }
 
-    msg_length    = strlen(client->output);
-    total_written = 0;
+    iovcnt = 0;
+    if(msg_length > 0)
+    {
+        frame_encode_header(output_header, FRAME_OUTPUT, 0, client->channel, client->request_id, (uint32_t)msg_length);
+        iov[iovcnt].iov_base = output_header;
+        iov[iovcnt].iov_len  = sizeof(output_header);
+        iovcnt++;
+        iov[iovcnt].iov_base = client->io->output;
+        iov[iovcnt].iov_len  = msg_length;
+        iovcnt++;
+        client->output_credit -= (int64_t)msg_length;
+    }
 
-    // Loop until the entire message is written
-    while((size_t)total_written < msg_length)
+    if(client->reply_complete)
     {
-        ssize_t bytes_written;
+        frame_encode_header(status_frame, FRAME_STATUS, 0, client->channel, client->request_id, sizeof(uint32_t));
+        frame_encode_u32(status_frame + FRAME_HEADER_SIZE, (uint32_t)client->status);
+        iov[iovcnt].iov_base = status_frame;
+        iov[iovcnt].iov_len  = sizeof(status_frame);
+        iovcnt++;
+    }
 
-        size_t bytes_to_write = msg_length - (size_t)total_written;
-        bytes_written         = write(client->client_socket, client->output + total_written, bytes_to_write);
+    if(client->flow_controlled && client->input_consumed > 0)
+    {
+        frame_encode_header(credit_frame, FRAME_CREDIT, 0, client->channel, 0, sizeof(uint32_t));
+        frame_encode_u32(credit_frame + FRAME_HEADER_SIZE, (uint32_t)client->input_consumed);
+        iov[iovcnt].iov_base = credit_frame;
+        iov[iovcnt].iov_len  = sizeof(credit_frame);
+        iovcnt++;
+        client->input_consumed = 0;
+    }
 
-        if(bytes_written == -1)
-        {
-            if(errno == EINTR)
-            {
-                continue;
-            }
+    server_state->active_client = -1;
+    connection                  = session_get(&server_state->sessions, client->owner);
 
-            if(errno == EAGAIN)
-            {
-                // Non-blocking mode: try again later
-                fprintf(stderr, "Client socket %d is not ready for writing\n", client->client_socket);
-                return WAIT_FOR_CMD;
-            }
-            perror("Error sending output to client");
-            return ERROR;
-        }
+    if(iovcnt > 0 && outbox_sendv(&connection->outbound, client->client_socket, iov, iovcnt) == -1)
+    {
+        // A client that went away only ends its own session
+        perror("Error sending output to client");
+        close_client(server_state, client_index);
+        return WAIT_FOR_CMD;
+    }
 
-        if(bytes_written == 0)
-        {
-            // Client may have closed the connection
-            fprintf(stderr, "Client socket %d closed the connection\n", client->client_socket);
-            return ERROR;
-        }
+    // Fast paths may have queued output of their own before this
+    watch_output(server_state, client->owner);
 
-        total_written += bytes_written;
+    for(i = 0; i < iovcnt; i++)
+    {
+        metrics_add(&server_state->metrics.bytes_out, iov[i].iov_len);
     }
 
     // Clear output buffer
-    server_state->active_client = -1;
-    memset(client->output, 0, MAX_MSG_LENGTH);
-    memset(client->msg, 0, MAX_MSG_LENGTH);
+    client->output_len = 0;
+    memset(client->io->output, 0, MAX_MSG_LENGTH);
+
+    if(next_command)
+    {
+        server_state->active_client = client_index;
+        return PARSE_CMD;
+    }
+
+    memset(client->io->msg, 0, MAX_MSG_LENGTH);
+    release_idle_buffers(server_state, client);
 
     return WAIT_FOR_CMD;
 }
@@ -812,9 +1386,14 @@ static p101_fsm_state_t send_output(const struct p101_env *env, struct p101_erro
 */
 static p101_fsm_state_t state_error(const struct p101_env *env, struct p101_error *err, void *arg)
 {
+    server_data *server_state;
+
     P101_TRACE(env);
 
-    printf("A critical server error occurred\n");
+    server_state = (server_data *)arg;
+    count_state(server_state, ERROR);
+
+    LOG_AT(LOG_LEVEL_ERROR, "A critical server error occurred\n");
 
     return CLEANUP;
 }
@@ -844,18 +1423,23 @@ static p101_fsm_state_t cleanup(const struct p101_env *env, struct p101_error *e
 
     server_state = (server_data *)arg;
 
+    count_state(server_state, CLEANUP);
+
     // printf("Cleaning up server resources...\n");
 
-    // Close all active client sockets
-    for(i = 0; i < MAX_CLIENTS; i++)
+    stop_reactors(server_state);
+
+    // Close all active client sockets, which orphans their jobs before they are killed
+    for(i = 0; (uint32_t)i < server_state->sessions.capacity; i++)
     {
-        if(server_state->clients[i].client_socket > 0)
+        if(session_get(&server_state->sessions, (uint32_t)i)->client_socket > 0)
         {
-            close(server_state->clients[i].client_socket);
-            server_state->clients[i].client_socket = 0;
+            close_client(server_state, i);
         }
     }
 
+    stop_jobs(server_state);
+
     // Close the server socket
     if(server_state->server_socket > 0)
     {
@@ -871,6 +1455,56 @@ static p101_fsm_state_t cleanup(const struct p101_env *env, struct p101_error *e
 
 #pragma GCC diagnostic pop
 
+/*
+    Creates a non-blocking listening socket. With reuse_port several listeners
+    share the address and the kernel spreads new connections across them.
+
+    @param
+    addr: The address to bind to
+    port: The port to bind to
+    reuse_port: Allow other listeners on the same address and port
+
+    @return
+    The listening socket, or -1 on failure
+*/
+static int create_listener(struct sockaddr_storage *addr, in_port_t port, bool reuse_port)
+{
+    int sockfd;
+
+    sockfd = socket_create(addr->ss_family, SOCK_STREAM, 0);
+
+    if(reuse_port)
+    {
+#if defined(SO_REUSEPORT)
+        int enable;
+
+        enable = 1;
+        if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+        {
+            perror("Unable to set SO_REUSEPORT");
+            close(sockfd);
+            return -1;
+        }
+#else
+        fprintf(stderr, "SO_REUSEPORT is not supported, use a single thread\n");
+        close(sockfd);
+        return -1;
+#endif
+    }
+
+    socket_bind(sockfd, addr, port);
+    start_listening(sockfd, SOMAXCONN);
+
+    if(set_nonblocking(sockfd) == -1 || set_cloexec(sockfd) == -1)
+    {
+        perror("Unable to set up server socket");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
 /*
     Starts listening for incoming connections on the specified socket.
 
@@ -912,12 +1546,22 @@ static int socket_accept_connection(int server_fd, struct sockaddr_storage *clie
     char client_host[NI_MAXHOST];
     char client_service[NI_MAXSERV];
 
-    errno     = 0;
+    // Sessions must not leak into the commands the server starts
+    errno = 0;
+#if defined(__linux__)
+    client_fd = accept4(server_fd, (struct sockaddr *)client_addr, client_addr_len, SOCK_CLOEXEC);
+#else
     client_fd = accept(server_fd, (struct sockaddr *)client_addr, client_addr_len);
+    if(client_fd != -1 && set_cloexec(client_fd) == -1)
+    {
+        close(client_fd);
+        client_fd = -1;
+    }
+#endif
 
     if(client_fd == -1)
     {
-        if(errno != EINTR)
+        if(errno != EINTR && errno != EAGAIN)
         {
             printf("accept() failed");
         }
@@ -925,14 +1569,19 @@ static int socket_accept_connection(int server_fd, struct sockaddr_storage *clie
         return -1;
     }
 
-    if(getnameinfo((struct sockaddr *)client_addr, *client_addr_len, client_host, NI_MAXHOST, client_service, NI_MAXSERV, 0) != 0)
+    // Only look the peer up when it is logged, and never through DNS
+    if(__atomic_load_n(&logger_threshold, __ATOMIC_RELAXED) >= LOG_LEVEL_INFO)
     {
-        fprintf(stderr, "Unable to get client information\n");
-        close(client_fd);
-        return -1;
+        if(getnameinfo((struct sockaddr *)client_addr, *client_addr_len, client_host, NI_MAXHOST, client_service, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        {
+            LOG_AT(LOG_LEVEL_WARN, "Unable to get client information\n");
+            close(client_fd);
+            return -1;
+        }
+
+        LOG_AT(LOG_LEVEL_INFO, "Accepted a new connection from %s:%s\n", client_host, client_service);
     }
 
-    printf("Accepted a new connection from %s:%s\n\n", client_host, client_service);
     return client_fd;
 }
 #if defined(__clang__)
@@ -941,91 +1590,1549 @@ static int socket_accept_connection(int server_fd, struct sockaddr_storage *clie
 #endif
 
 /*
-    Shuts down the specified socket for reading, writing, or both.
+    Puts a file descriptor into non-blocking mode.
 
     @param
-    sockfd: The socket file descriptor
-    how: Specifies how to shut down (e.g., SHUT_RD, SHUT_WR, SHUT_RDWR)
+    fd: The file descriptor to update
+
+    @return
+    0 on success, -1 on failure
 */
-static void shutdown_socket(int sockfd, int how)
+static int set_nonblocking(int fd)
 {
-    if(shutdown(sockfd, how) == -1)
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if(flags == -1)
     {
-        perror("Error closing socket");
-        exit(EXIT_FAILURE);
+        return -1;
     }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 /*
-    Closes the specified socket and exits on failure.
-
-    @param
-    sockfd: The socket file descriptor to close
+    Raises the soft descriptor limit to the hard limit so the session pool, not
+    the default limit, decides how many connections can be served.
 */
-static void socket_close(int sockfd)
+static void raise_fd_limit(void)
 {
-    if(close(sockfd) == -1)
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
     {
-        perror("Error closing socket");
-        exit(EXIT_FAILURE);
+        limit.rlim_cur = limit.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
+        {
+            perror("Unable to raise the descriptor limit");
+        }
     }
 }
 
 /*
-    Signals the server to begin shutdown by setting the global exit_flag.
+    Accepts every pending connection on the (edge-triggered) listener and
+    registers each new client with the event loop exactly once.
+
+    @param
+    server_state: The server whose listener became readable
 */
-static void process_exit(void)
+static void accept_clients(server_data *server_state)
 {
-    exit_flag = 1;
+    for(;;)
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t               client_len;
+        int                     new_socket;
+
+        client_len = sizeof(client_addr);
+        new_socket = socket_accept_connection(server_state->server_socket, &client_addr, &client_len);
+        if(new_socket < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            // EAGAIN means the backlog is drained
+            return;
+        }
+
+        if(add_client(server_state, new_socket) == -1)
+        {
+            close(new_socket);
+        }
+    }
 }
 
 /*
-    Searches for an executable command in the system's PATH.
+    Gives a connected socket a free session slot and registers it with the event loop.
 
     @param
-    cmd: Name of the command to search for
-    full_path: Buffer to store the resolved full path
-    size: Size of the full_path buffer
+    server_state: The server taking the connection
+    client_socket: The connected socket
 
     @return
-    0 if the executable is found, -1 otherwise
+    The session's slot, or -1 if the connection could not be taken
 */
-static int find_executable(const char *cmd, char *full_path, size_t size)
+static int add_client(server_data *server_state, int client_socket)
 {
-    const char *path;
-    const char *dir;
-    char        candidate[MAX_MSG_LENGTH];
-    char       *saveptr;
-    char       *path_copy;
+    client_info *client;
+    uint32_t     index;
 
-    // Get the system PATH
-    path = getenv("PATH");
-    if(!path || *path == '\0')
+    client = session_acquire(&server_state->sessions, &index);
+    if(client == NULL)
     {
-        path = "/usr/local/bin:/usr/bin:/bin:/usr/sbin:/sbin";
+        LOG_AT(LOG_LEVEL_WARN, "Max clients reached, rejecting new connection.\n");
+        metrics_add(&server_state->metrics.rejected, 1);
+        return -1;
     }
 
-    // Create modifiable copy
-    path_copy = strdup(path);
+    // Sessions start in the server's directory and move independently from there
+    client->cwd_fd = open(".", SESSION_DIR_FLAGS);
+    if(client->cwd_fd == -1)
+    {
+        perror("Unable to open working directory");
+        session_release(&server_state->sessions, index);
+        return -1;
+    }
 
-    // Tokenize and search directories in PATH
-    dir = strtok_r(path_copy, ":", &saveptr);
-    while(dir != NULL)
+    // Replies are queued when the socket is full instead of blocking the reactor
+    if(set_nonblocking(client_socket) == -1 || event_add(&server_state->events, client_socket, EVENT_CLIENT, index) == -1)
     {
-        snprintf(candidate, sizeof(candidate), "%s/%s", dir, cmd);
+        perror("Unable to watch client socket");
+        close(client->cwd_fd);
+        client->cwd_fd = -1;
+        session_release(&server_state->sessions, index);
+        return -1;
+    }
 
-        if(access(candidate, X_OK) == 0)
-        {
-            strncpy(full_path, candidate, size);
-            free(path_copy);
-            return 0;
-        }
+    // Buffers are only attached once the session has something to read or send
+    client->client_socket = client_socket;
+    client->owner         = index;
+    metrics_add(&server_state->metrics.accepted, 1);
+    metrics_add(&server_state->metrics.sessions, 1);
 
-        dir = strtok_r(NULL, ":", &saveptr);
-    }
+    timer_init(&client->idle_timer, TIMER_IDLE, index);
+    reset_idle_timer(server_state, client);
 
-    free(path_copy);
-    return -1;    // Not found
+    return (int)index;
+}
+
+/*
+    Runs the parent of process-per-connection mode. The parent only accepts
+    connections and reaps finished sessions; each connection is served by a
+    forked process running its own FSM, so sessions have their own working
+    directory and run in parallel.
+
+    @param
+    server_fd: The listening socket
+
+    @return
+    The connected socket in a session process, -1 in the parent once it shuts down
+*/
+static int serve_session_processes(int server_fd)
+{
+    pid_t *sessions;
+    int    session_count;
+    int    i;
+
+    sessions = (pid_t *)calloc(MAX_CLIENTS, sizeof(pid_t));
+    if(sessions == NULL)
+    {
+        perror("Unable to allocate session table");
+        return -1;
+    }
+
+    session_count = 0;
+    watch_session_exits(true);
+
+    while(!exit_flag)
+    {
+        struct pollfd listener;
+
+        reap_session_processes(sessions, &session_count);
+
+        listener.fd     = server_fd;
+        listener.events = POLLIN;
+        if(poll(&listener, 1, TIMEOUT * 1000) < 1)
+        {
+            continue;
+        }
+
+        for(;;)
+        {
+            struct sockaddr_storage client_addr;
+            socklen_t               client_len;
+            int                     client_fd;
+            pid_t                   pid;
+
+            client_len = sizeof(client_addr);
+            client_fd  = socket_accept_connection(server_fd, &client_addr, &client_len);
+            if(client_fd < 0)
+            {
+                if(errno == EINTR && !exit_flag)
+                {
+                    continue;
+                }
+
+                break;
+            }
+
+            reap_session_processes(sessions, &session_count);
+            if(session_count == MAX_CLIENTS)
+            {
+                LOG_AT(LOG_LEVEL_WARN, "Max clients reached, rejecting new connection.\n");
+                close(client_fd);
+                continue;
+            }
+
+            // Don't let the session inherit unwritten output
+            fflush(stdout);
+            pid = logger_fork();
+            if(pid == 0)
+            {
+                watch_session_exits(false);
+                close(server_fd);
+                free(sessions);
+                return client_fd;
+            }
+
+            close(client_fd);
+            if(pid < 0)
+            {
+                perror("Fork failed");
+                continue;
+            }
+
+            sessions[session_count++] = pid;
+        }
+    }
+
+    // Each session cleans up its own jobs when interrupted
+    for(i = 0; i < session_count; i++)
+    {
+        kill(sessions[i], SIGINT);
+    }
+    for(i = 0; i < session_count; i++)
+    {
+        pid_t result;
+
+        do
+        {
+            result = waitpid(sessions[i], NULL, 0);
+        } while(result == -1 && errno == EINTR);
+    }
+
+    free(sessions);
+    printf("Cleanup complete. Server shutting down.\n");
+    return -1;
+}
+
+/*
+    Collects session processes that have exited.
+
+    @param
+    sessions: Process ids of the running sessions
+    session_count: Number of running sessions, updated
+*/
+static void reap_session_processes(pid_t *sessions, int *session_count)
+{
+    pid_t pid;
+
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    {
+        int i;
+
+        for(i = 0; i < *session_count; i++)
+        {
+            if(sessions[i] == pid)
+            {
+                sessions[i] = sessions[--(*session_count)];
+                break;
+            }
+        }
+    }
+}
+
+/*
+    Serves a session that the event loop reported as ready. Output queued on the
+    connection is flushed first, then output and completions of its running jobs are
+    relayed. A pipelined command waits for the running jobs unless it is flagged as
+    concurrent. While more than OUTBOX_HIGH_WATER bytes are queued, neither job
+    output nor new commands are taken, so a client that doesn't read holds up only
+    its own commands.
+    Input is buffered and split into frames; while complete frames are buffered or the
+    socket has not been drained, the session is re-queued at the back of the ready list.
+    Only a connection's channel 0 session reads the socket, the sessions of its other
+    channels are handed their commands.
+
+    @param
+    server_state: The server owning the session
+    index: The session's slot in the client table
+
+    @return
+    PARSE_CMD: A message was read into the session's buffer
+    SEND_OUTPUT: Job output or a job's final status is ready
+    WAIT_FOR_CMD: Nothing to do (busy, drained, disconnected or failed)
+*/
+static p101_fsm_state_t serve_client(server_data *server_state, uint32_t index)
+{
+    client_info *client;
+    client_info *connection;
+
+    client = session_get(&server_state->sessions, index);
+    if(client == NULL || client->client_socket <= 0)
+    {
+        return WAIT_FOR_CMD;
+    }
+
+    connection = session_get(&server_state->sessions, client->owner);
+    if(connection->outbound.head != NULL && flush_output(server_state, client->owner) == -1)
+    {
+        return WAIT_FOR_CMD;
+    }
+
+    if(client->job_count > 0)
+    {
+        p101_fsm_state_t next_state;
+
+        next_state = relay_jobs(server_state, index);
+        if(next_state != WAIT_FOR_CMD || client->client_socket <= 0)
+        {
+            return next_state;
+        }
+    }
+
+    // The client is sent nothing more until it reads what is queued, flush_output queues the session again
+    if(connection->outbound.bytes >= OUTBOX_HIGH_WATER)
+    {
+        release_idle_buffers(server_state, client);
+        return WAIT_FOR_CMD;
+    }
+
+    for(;;)
+    {
+        p101_fsm_state_t next_state;
+        ssize_t          bytes_received;
+
+        // **Handle the complete frames that are already buffered**
+        next_state = process_input(server_state, index);
+        if(next_state != WAIT_FOR_CMD || client->client_socket <= 0)
+        {
+            return next_state;
+        }
+
+        // Channels are fed by their connection, and a buffer full of waiting commands is read again once one finishes
+        if(client->drained || client->input_len == INPUT_BUFFER_SIZE)
+        {
+            release_idle_buffers(server_state, client);
+            return WAIT_FOR_CMD;
+        }
+
+        if(session_attach_io(&server_state->sessions, client) == NULL)
+        {
+            perror("Unable to allocate session buffers");
+            close_client(server_state, (int)index);
+            return WAIT_FOR_CMD;
+        }
+
+        bytes_received = recv(client->client_socket, client->io->input + client->input_len, INPUT_BUFFER_SIZE - client->input_len, MSG_DONTWAIT);
+
+        if(bytes_received < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN)
+            {
+                client->drained = true;
+                release_idle_buffers(server_state, client);
+                return WAIT_FOR_CMD;
+            }
+
+            perror("[ERROR] recv() failed");
+            close_client(server_state, (int)index);
+            return WAIT_FOR_CMD;
+        }
+
+        if(bytes_received == 0)
+        {
+            LOG_AT(LOG_LEVEL_INFO, "Client %d disconnected\n", client->client_socket);
+            close_client(server_state, (int)index);
+            return WAIT_FOR_CMD;
+        }
+
+        metrics_add(&server_state->metrics.bytes_in, (uint64_t)bytes_received);
+        reset_idle_timer(server_state, client);
+
+        // A short read means the socket is empty until the next edge
+        if((size_t)bytes_received < INPUT_BUFFER_SIZE - client->input_len)
+        {
+            client->drained = true;
+        }
+        client->input_len += (size_t)bytes_received;
+    }
+}
+
+/*
+    Handles the complete frames in a session's buffer. Frames of the session's own
+    channel are taken in order, and the first command that has to wait for the
+    running jobs holds back the ones after it. Frames for the connection's other
+    channels are passed on as they arrive, so a busy channel never blocks them.
+
+    @param
+    server_state: The server owning the session
+    index: The session's slot in the client table
+
+    @return
+    PARSE_CMD: A command was received and should be parsed
+    WAIT_FOR_CMD: Every frame that can be handled now was handled (or the client was closed)
+*/
+static p101_fsm_state_t process_input(server_data *server_state, uint32_t index)
+{
+    client_info *client;
+    size_t       offset;
+    bool         blocked;
+
+    client  = session_get(&server_state->sessions, index);
+    offset  = 0;
+    blocked = false;
+
+    while(client->input_len - offset >= FRAME_HEADER_SIZE)
+    {
+        frame_header     header;
+        uint8_t         *frame;
+        size_t           size;
+        p101_fsm_state_t next_state;
+
+        frame = client->io->input + offset;
+        frame_decode_header(frame, &header);
+        if(header.length > FRAME_MAX_COMMAND)
+        {
+            LOG_AT(LOG_LEVEL_WARN, "Protocol error from client %d: frame too large\n", client->client_socket);
+            close_client(server_state, (int)index);
+            return WAIT_FOR_CMD;
+        }
+
+        size = FRAME_HEADER_SIZE + header.length;
+        if(client->input_len - offset < size)
+        {
+            break;
+        }
+
+        if(header.channel != client->channel || (header.type != FRAME_HELLO && header.type != FRAME_COMMAND))
+        {
+            if(route_frame(server_state, index, &header, frame) == -1)
+            {
+                return WAIT_FOR_CMD;
+            }
+
+            client->input_len -= size;
+            memmove(frame, frame + size, client->input_len - offset);
+            continue;
+        }
+
+        // Requests run in order unless the client marked this one as safe to overlap, nothing overlaps a command list
+        if(blocked || (header.type == FRAME_COMMAND && (client->io->sequence[0] != '\0' || (client->job_count > 0 && (!(header.flags & FRAME_FLAG_CONCURRENT) || client->job_count == MAX_SESSION_JOBS)))))
+        {
+            blocked = true;
+            offset += size;
+            continue;
+        }
+
+        next_state = handle_frame(server_state, index, &header, frame + FRAME_HEADER_SIZE);
+        if(client->client_socket <= 0)
+        {
+            return WAIT_FOR_CMD;
+        }
+
+        client->input_len -= size;
+        memmove(frame, frame + size, client->input_len - offset);
+        if(client->flow_controlled)
+        {
+            client->input_consumed += size;
+        }
+
+        if(next_state != WAIT_FOR_CMD)
+        {
+            // More requests may be buffered or still in the socket
+            if(!client->drained || client->input_len >= FRAME_HEADER_SIZE)
+            {
+                event_ready_push(&server_state->events, index);
+            }
+            return next_state;
+        }
+    }
+
+    return WAIT_FOR_CMD;
+}
+
+/*
+    Relays the next chunk of output, or the final status, of one of a session's
+    running jobs. Jobs are visited round-robin so concurrent requests share the
+    connection fairly. A channel out of output credit leaves the output in the
+    pipes until the client grants more, and so does a connection with too much
+    output queued, until the client catches up. Children writing more then block
+    on the full pipe.
+
+    @param
+    server_state: The server owning the session
+    index: The session's slot in the client table
+
+    @return
+    SEND_OUTPUT: Output or a final status is ready to be sent
+    WAIT_FOR_CMD: None of the jobs has anything to report
+*/
+static p101_fsm_state_t relay_jobs(server_data *server_state, uint32_t index)
+{
+    client_info *client;
+    size_t       credit;
+    int          n;
+
+    client = session_get(&server_state->sessions, index);
+    credit = !client->flow_controlled ? SIZE_MAX : client->output_credit > 0 ? (size_t)client->output_credit : 0;
+    if(session_get(&server_state->sessions, client->owner)->outbound.bytes >= OUTBOX_HIGH_WATER)
+    {
+        credit = 0;
+    }
+
+    for(n = 0; n < client->job_count; n++)
+    {
+        job_info *job;
+        int       slot;
+
+        slot = (client->next_job + n) % client->job_count;
+        job  = &server_state->jobs.jobs[client->jobs[slot]];
+
+        // Relay the next chunk of output as soon as it is produced
+        if(job->readable && job->output_fd != -1 && credit > 0)
+        {
+            ssize_t bytes_read;
+            size_t  available;
+
+            // Whatever the pipe holds goes straight to the socket, EOF, errors and cached output take the buffered path
+            available = server_state->splice_output && job->capture == NULL ? job_output_available(job) : 0;
+            if(available > 0)
+            {
+                return splice_job_output(server_state, index, slot, available < credit ? available : credit);
+            }
+
+            bytes_read = job_read_output(job, client->io->output, credit < OUTPUT_CHUNK ? credit : OUTPUT_CHUNK);
+            if(bytes_read > 0)
+            {
+                if(job->capture != NULL)
+                {
+                    result_capture_append(job->capture, client->io->output, (size_t)bytes_read);
+                }
+
+                client->output_len          = (size_t)bytes_read;
+                client->request_id          = job->request_id;
+                client->reply_complete      = false;
+                client->next_job            = slot + 1;
+                server_state->active_client = (int)index;
+                event_ready_push(&server_state->events, index);
+                return SEND_OUTPUT;
+            }
+
+            if(bytes_read == 0 || errno != EAGAIN)
+            {
+                close_job_output(server_state, job);
+            }
+        }
+
+        if(job_is_done(job))
+        {
+            return finish_job(server_state, (int)index, slot);
+        }
+    }
+
+    return WAIT_FOR_CMD;
+}
+
+/*
+    Sends one OUTPUT frame whose payload is spliced from a job's pipe to the
+    session's socket. Once the socket is full the rest of the frame is copied
+    to the connection's queue. The session is queued again to relay the rest.
+
+    @param
+    server_state: The server owning the session
+    index: The session's slot in the client table
+    slot: The job's position in the session's job list
+    available: Bytes waiting in the job's pipe
+
+    @return
+    WAIT_FOR_CMD: The output was sent (or the client was closed)
+*/
+static p101_fsm_state_t splice_job_output(server_data *server_state, uint32_t index, int slot, size_t available)
+{
+    client_info *client;
+    client_info *connection;
+    job_info    *job;
+    size_t       length;
+
+    client     = session_get(&server_state->sessions, index);
+    connection = session_get(&server_state->sessions, client->owner);
+    job        = &server_state->jobs.jobs[client->jobs[slot]];
+    length     = available < FRAME_MAX_PAYLOAD ? available : FRAME_MAX_PAYLOAD;
+
+    // Part of a frame may already be on the wire, so the session can't continue
+    if(outbox_splice(&connection->outbound, client->client_socket, job->output_fd, FRAME_OUTPUT, client->channel, job->request_id, (uint32_t)length) == -1)
+    {
+        perror("Unable to relay command output");
+        close_client(server_state, (int)index);
+        return WAIT_FOR_CMD;
+    }
+
+    watch_output(server_state, client->owner);
+
+    job->bytes_out        += length;
+    client->output_credit -= (int64_t)length;
+    client->next_job       = slot + 1;
+    metrics_add(&server_state->metrics.bytes_out, FRAME_HEADER_SIZE + length);
+    event_ready_push(&server_state->events, index);
+
+    return WAIT_FOR_CMD;
+}
+
+/*
+    Acts on one frame received from a client: answers the HELLO handshake and
+    turns a COMMAND into the session's current request.
+
+    @param
+    server_state: The server owning the session
+    index: The session's slot in the client table
+    header: The decoded frame header
+    payload: The frame payload (header->length bytes)
+
+    @return
+    PARSE_CMD: A command was received and should be parsed
+    WAIT_FOR_CMD: The frame was handled (or the client was closed)
+*/
+static p101_fsm_state_t handle_frame(server_data *server_state, uint32_t index, const frame_header *header, const uint8_t *payload)
+{
+    client_info *client;
+
+    client = session_get(&server_state->sessions, index);
+
+    if(header->type == FRAME_HELLO && header->length == sizeof(uint32_t))
+    {
+        uint8_t  version[sizeof(uint32_t)];
+        uint32_t client_version;
+
+        client_version = frame_decode_u32(payload);
+        frame_encode_u32(version, PROTOCOL_VERSION);
+
+        if(outbox_send(&session_get(&server_state->sessions, client->owner)->outbound, client->client_socket, FRAME_HELLO, 0, 0, 0, version, sizeof(version)) == -1 || client_version != PROTOCOL_VERSION)
+        {
+            LOG_AT(LOG_LEVEL_WARN, "Handshake with client %d failed (version %u)\n", client->client_socket, client_version);
+            close_client(server_state, (int)index);
+            return WAIT_FOR_CMD;
+        }
+
+        client->greeted = true;
+        metrics_add(&server_state->metrics.bytes_out, FRAME_HEADER_SIZE + sizeof(version));
+        watch_output(server_state, client->owner);
+        return WAIT_FOR_CMD;
+    }
+
+    if(header->type == FRAME_COMMAND && client->greeted)
+    {
+        size_t length;
+
+        // Overlong commands are truncated like they always were
+        length = header->length < MAX_MSG_LENGTH - 1 ? header->length : MAX_MSG_LENGTH - 1;
+        memcpy(client->io->msg, payload, length);
+        client->io->msg[length]     = '\0';
+        client->request_id          = header->request_id;
+        server_state->active_client = (int)index;
+        LOG_AT(LOG_LEVEL_INFO, "[input] from client %d: %s\n", client->client_socket, client->io->msg);
+        return PARSE_CMD;
+    }
+
+    LOG_AT(LOG_LEVEL_WARN, "Protocol error from client %d: unexpected frame type %u\n", client->client_socket, header->type);
+    close_client(server_state, (int)index);
+    return WAIT_FOR_CMD;
+}
+
+/*
+    Acts on a control frame, or passes a command on to the session of the channel
+    it was sent on. Commands beyond the channel's credit are a protocol error,
+    frames for a channel that is no longer open are dropped.
+
+    @param
+    server_state: The server owning the connection
+    index: The slot of the connection's channel 0 session
+    header: The decoded frame header
+    frame: The whole frame, header included
+
+    @return
+    0 on success, -1 if the connection was closed
+*/
+static int route_frame(server_data *server_state, uint32_t index, const frame_header *header, const uint8_t *frame)
+{
+    client_info *client;
+    client_info *channel;
+    uint32_t     channel_index;
+
+    client = session_get(&server_state->sessions, index);
+    if(!client->greeted || header->channel >= MAX_CHANNELS || (header->channel == 0 && header->type != FRAME_CREDIT))
+    {
+        LOG_AT(LOG_LEVEL_WARN, "Protocol error from client %d: unexpected frame type %u on channel %u\n", client->client_socket, header->type, header->channel);
+        close_client(server_state, (int)index);
+        return -1;
+    }
+
+    if(header->type == FRAME_OPEN)
+    {
+        return open_channel(server_state, index, header, frame + FRAME_HEADER_SIZE);
+    }
+
+    // Channel 0 has no credit to return, and a closed channel nothing to deliver to
+    if(client->channels == NULL || !(client->channels->open & (1ULL << header->channel)))
+    {
+        return 0;
+    }
+
+    channel_index = client->channels->sessions[header->channel];
+    channel       = session_get(&server_state->sessions, channel_index);
+
+    if(header->type == FRAME_CLOSE)
+    {
+        LOG_AT(LOG_LEVEL_INFO, "Client %d closed channel %u\n", client->client_socket, header->channel);
+        close_channel(server_state, channel_index);
+        return send_control(server_state, index, FRAME_CLOSE, header->channel, NULL, 0);
+    }
+
+    if(header->type == FRAME_CREDIT && header->length == sizeof(uint32_t))
+    {
+        channel->output_credit += frame_decode_u32(frame + FRAME_HEADER_SIZE);
+        event_ready_push(&server_state->events, channel_index);
+        return 0;
+    }
+
+    if(header->type == FRAME_COMMAND && channel->input_len + channel->input_consumed + FRAME_HEADER_SIZE + header->length <= CHANNEL_WINDOW)
+    {
+        if(session_attach_io(&server_state->sessions, channel) == NULL)
+        {
+            perror("Unable to allocate session buffers");
+            close_client(server_state, (int)index);
+            return -1;
+        }
+
+        memcpy(channel->io->input + channel->input_len, frame, FRAME_HEADER_SIZE + header->length);
+        channel->input_len += FRAME_HEADER_SIZE + header->length;
+        event_ready_push(&server_state->events, channel_index);
+        return 0;
+    }
+
+    LOG_AT(LOG_LEVEL_WARN, "Protocol error from client %d: frame type %u overran channel %u\n", client->client_socket, header->type, header->channel);
+    close_client(server_state, (int)index);
+    return -1;
+}
+
+/*
+    Opens a channel as a session of its own, starting in the server's directory
+    like a new connection, and answers with its input credit. A channel there's
+    no session for is refused with CLOSE, one that is already open is closed
+    before being refused.
+
+    @param
+    server_state: The server owning the connection
+    index: The slot of the connection's channel 0 session
+    header: The OPEN frame's header
+    payload: The output credit the client grants
+
+    @return
+    0 on success, -1 if the connection was closed
+*/
+static int open_channel(server_data *server_state, uint32_t index, const frame_header *header, const uint8_t *payload)
+{
+    client_info *client;
+    client_info *channel;
+    uint32_t     channel_index;
+    uint8_t      credit[sizeof(uint32_t)];
+
+    client = session_get(&server_state->sessions, index);
+    if(header->length != sizeof(uint32_t))
+    {
+        LOG_AT(LOG_LEVEL_WARN, "Protocol error from client %d: malformed OPEN\n", client->client_socket);
+        close_client(server_state, (int)index);
+        return -1;
+    }
+
+    if(client->channels == NULL)
+    {
+        client->channels = (session_channels *)calloc(1, sizeof(session_channels));
+    }
+
+    // Refusing a channel that is already open closes it, so both ends agree it is gone
+    if(client->channels != NULL && (client->channels->open & (1ULL << header->channel)))
+    {
+        LOG_AT(LOG_LEVEL_WARN, "Client %d reopened channel %u, closing it\n", client->client_socket, header->channel);
+        close_channel(server_state, client->channels->sessions[header->channel]);
+        return send_control(server_state, index, FRAME_CLOSE, header->channel, NULL, 0);
+    }
+
+    channel = NULL;
+    if(client->channels != NULL)
+    {
+        channel = session_acquire(&server_state->sessions, &channel_index);
+    }
+
+    if(channel != NULL)
+    {
+        channel->cwd_fd = open(".", SESSION_DIR_FLAGS);
+        if(channel->cwd_fd == -1)
+        {
+            perror("Unable to open working directory");
+            session_release(&server_state->sessions, channel_index);
+            channel = NULL;
+        }
+    }
+
+    if(channel == NULL)
+    {
+        LOG_AT(LOG_LEVEL_WARN, "Refused channel %u of client %d\n", header->channel, client->client_socket);
+        return send_control(server_state, index, FRAME_CLOSE, header->channel, NULL, 0);
+    }
+
+    // Nothing is read from the socket for a channel, its commands are handed over by the connection
+    channel->client_socket                      = client->client_socket;
+    channel->owner                              = index;
+    channel->channel                            = header->channel;
+    channel->output_credit                      = frame_decode_u32(payload);
+    channel->flow_controlled                    = true;
+    channel->greeted                            = true;
+    channel->drained                            = true;
+    client->channels->sessions[header->channel] = channel_index;
+    client->channels->open                     |= 1ULL << header->channel;
+    metrics_add(&server_state->metrics.channels, 1);
+    LOG_AT(LOG_LEVEL_INFO, "Client %d opened channel %u\n", client->client_socket, header->channel);
+
+    frame_encode_u32(credit, CHANNEL_WINDOW);
+    return send_control(server_state, index, FRAME_OPEN, header->channel, credit, sizeof(credit));
+}
+
+/*
+    Ends the session of one channel. The connection and its other channels
+    carry on.
+
+    @param
+    server_state: The server owning the connection
+    index: The channel session's slot in the client table
+*/
+static void close_channel(server_data *server_state, uint32_t index)
+{
+    client_info *channel;
+    client_info *client;
+
+    channel = session_get(&server_state->sessions, index);
+    client  = session_get(&server_state->sessions, channel->owner);
+
+    stop_session_jobs(server_state, channel);
+    client->channels->open &= ~(1ULL << channel->channel);
+    close(channel->cwd_fd);
+    channel->cwd_fd = -1;
+    session_release(&server_state->sessions, index);
+    metrics_sub(&server_state->metrics.channels, 1);
+}
+
+/*
+    Sends a frame that belongs to no request on one of a connection's channels.
+
+    @param
+    server_state: The server owning the connection
+    index: The slot of the connection's channel 0 session
+    type: The frame type
+    channel: The channel the frame is about
+    payload: The payload, may be NULL when length is 0
+    length: The payload length
+
+    @return
+    0 on success, -1 if the connection failed and was closed
+*/
+static int send_control(server_data *server_state, uint32_t index, uint8_t type, uint16_t channel, const void *payload, uint32_t length)
+{
+    client_info *client;
+
+    client = session_get(&server_state->sessions, index);
+    if(outbox_send(&client->outbound, client->client_socket, type, 0, channel, 0, payload, length) == -1)
+    {
+        perror("Error sending to client");
+        close_client(server_state, (int)index);
+        return -1;
+    }
+
+    metrics_add(&server_state->metrics.bytes_out, FRAME_HEADER_SIZE + length);
+    watch_output(server_state, index);
+    return 0;
+}
+
+/*
+    Checks whether any channel of a connection has a command running.
+
+    @param
+    server_state: The server owning the connection
+    client: The connection's channel 0 session
+
+    @return
+    true if a command is running on any channel
+*/
+static bool connection_busy(const server_data *server_state, const client_info *client)
+{
+    uint64_t open;
+
+    if(client->job_count > 0)
+    {
+        return true;
+    }
+
+    open = client->channels != NULL ? client->channels->open : 0;
+    while(open != 0)
+    {
+        const client_info *channel;
+
+        channel = session_get(&server_state->sessions, client->channels->sessions[__builtin_ctzll(open)]);
+        if(channel->job_count > 0)
+        {
+            return true;
+        }
+        open &= open - 1;
+    }
+
+    return false;
+}
+
+/*
+    Writes as much of a connection's queued output as the socket takes. Once the
+    queue drops back under OUTBOX_HIGH_WATER every session of the connection is
+    served again, to relay the output its jobs left in the pipes and to read
+    new commands.
+
+    @param
+    server_state: The server owning the connection
+    index: The slot of the connection's channel 0 session
+
+    @return
+    0 on success, -1 if the connection failed and was closed
+*/
+static int flush_output(server_data *server_state, uint32_t index)
+{
+    client_info *client;
+    bool         backlogged;
+
+    client     = session_get(&server_state->sessions, index);
+    backlogged = client->outbound.bytes >= OUTBOX_HIGH_WATER;
+    if(outbox_flush(&client->outbound, client->client_socket) == -1)
+    {
+        perror("Error sending output to client");
+        close_client(server_state, (int)index);
+        return -1;
+    }
+
+    watch_output(server_state, index);
+    if(backlogged && client->outbound.bytes < OUTBOX_HIGH_WATER)
+    {
+        resume_connection(server_state, index);
+    }
+
+    return 0;
+}
+
+/*
+    Watches a connection's socket for room to write while output is queued on
+    it, and stops once the queue is empty so a writable socket doesn't keep
+    waking the reactor.
+
+    @param
+    server_state: The server owning the connection
+    index: The slot of the connection's channel 0 session
+*/
+static void watch_output(server_data *server_state, uint32_t index)
+{
+    client_info *client;
+    bool         pending;
+
+    client  = session_get(&server_state->sessions, index);
+    pending = client->outbound.head != NULL;
+    if(pending == client->output_watched)
+    {
+        return;
+    }
+
+    if(event_watch_output(&server_state->events, client->client_socket, EVENT_CLIENT, index, pending) == -1)
+    {
+        perror("Unable to watch client socket");
+        return;
+    }
+
+    client->output_watched = pending;
+    if(pending)
+    {
+        metrics_add(&server_state->metrics.output_stalls, 1);
+    }
+}
+
+/*
+    Queues every session of a connection to be served.
+
+    @param
+    server_state: The server owning the connection
+    index: The slot of the connection's channel 0 session
+*/
+static void resume_connection(server_data *server_state, uint32_t index)
+{
+    client_info *client;
+    uint64_t     open;
+
+    client = session_get(&server_state->sessions, index);
+    event_ready_push(&server_state->events, index);
+
+    open = client->channels != NULL ? client->channels->open : 0;
+    while(open != 0)
+    {
+        event_ready_push(&server_state->events, client->channels->sessions[__builtin_ctzll(open)]);
+        open &= open - 1;
+    }
+}
+
+/*
+    Unregisters and closes a client socket, freeing its slot. Every channel of the
+    connection is closed with it. Jobs whose relaying is paused behind a full
+    outbox are stopped like any other, along with the output left in their pipes.
+
+    @param
+    server_state: The server owning the session
+    index: The slot of any of the connection's sessions
+*/
+static void close_client(server_data *server_state, int index)
+{
+    client_info *client;
+
+    client = session_get(&server_state->sessions, (uint32_t)index);
+    if(client->channel != 0)
+    {
+        index  = (int)client->owner;
+        client = session_get(&server_state->sessions, (uint32_t)index);
+    }
+
+    if(client->channels != NULL)
+    {
+        while(client->channels->open != 0)
+        {
+            close_channel(server_state, client->channels->sessions[__builtin_ctzll(client->channels->open)]);
+        }
+        free(client->channels);
+        client->channels = NULL;
+    }
+
+    stop_session_jobs(server_state, client);
+    outbox_clear(&client->outbound);
+    timer_cancel(&server_state->timers, &client->idle_timer);
+    event_del(&server_state->events, client->client_socket);
+    close(client->client_socket);
+    close(client->cwd_fd);
+    client->cwd_fd = -1;
+    session_release(&server_state->sessions, (uint32_t)index);
+    metrics_sub(&server_state->metrics.sessions, 1);
+
+    // A session process exits with its connection
+    if(server_state->single_session)
+    {
+        exit_flag = 1;
+    }
+}
+
+/*
+    Stops a session's jobs once nobody is left to read their output, including
+    jobs whose relaying is paused. Their output is discarded straight away and
+    jobs that have already exited are released. Only children still running
+    are signalled, a reaped pid may already belong to another process.
+
+    @param
+    server_state: The server owning the session
+    client: The session
+*/
+static void stop_session_jobs(server_data *server_state, client_info *client)
+{
+    while(client->job_count > 0)
+    {
+        job_info *job;
+        int       job_index;
+
+        job_index   = client->jobs[--client->job_count];
+        job         = &server_state->jobs.jobs[job_index];
+        job->client = -1;
+        if(!job->exited)
+        {
+            job_signal(job, SIGTERM);
+            job->timer.kind = TIMER_KILL;
+            timer_schedule(&server_state->timers, &job->timer, COMMAND_KILL_GRACE_MS);
+        }
+
+        discard_job(server_state, job_index);
+    }
+}
+
+/*
+    Returns a session's buffers to the pool once it has no buffered input, no
+    running jobs and no reply in progress, so idle connections stay small.
+
+    @param
+    server_state: The server owning the session
+    client: The session
+*/
+static void release_idle_buffers(server_data *server_state, client_info *client)
+{
+    if(client->input_len == 0 && client->job_count == 0 && session_get(&server_state->sessions, (uint32_t)server_state->active_client) != client)
+    {
+        session_detach_io(&server_state->sessions, client);
+    }
+}
+
+/*
+    Records output and exit notifications from a running job and queues its session,
+    which relays the output one chunk at a time. Output of jobs whose session has gone
+    away is discarded so the child never blocks on a full pipe.
+
+    @param
+    server_state: The server owning the job
+    record: The event reported for the job's pipe or pidfd
+*/
+static void handle_job_event(server_data *server_state, const event_record *record)
+{
+    job_info *job;
+
+    if(record->token >= (uint32_t)server_state->jobs.capacity)
+    {
+        return;
+    }
+
+    job = &server_state->jobs.jobs[record->token];
+    if(!job->in_use)
+    {
+        return;
+    }
+
+    if(record->kind == EVENT_JOB_OUTPUT && job->output_fd != -1)
+    {
+        job->readable = true;
+    }
+
+    // The pidfd only watches the last stage of a pipeline, earlier stages still running are polled for
+    if(record->kind == EVENT_JOB_EXIT && job->pidfd != -1 && (job_reap(job, false) || job->reaped))
+    {
+        event_del(&server_state->events, job->pidfd);
+        close(job->pidfd);
+        job->pidfd = -1;
+        if(!job->exited)
+        {
+            timer_schedule(&server_state->timers, &job->reap_timer, REAP_POLL_MS);
+        }
+    }
+
+    notify_job(server_state, (int)record->token);
+}
+
+/*
+    Closes a job's output pipe once it reaches EOF. Without a pidfd the child is
+    polled for until it exits, since closing its stdout almost always means it is
+    exiting.
+
+    @param
+    server_state: The server owning the job
+    job: The job whose output is finished
+*/
+static void close_job_output(server_data *server_state, job_info *job)
+{
+    event_del(&server_state->events, job->output_fd);
+    close(job->output_fd);
+    job->output_fd = -1;
+
+    if(job->pidfd == -1 && !job_reap(job, false))
+    {
+        timer_schedule(&server_state->timers, &job->reap_timer, REAP_POLL_MS);
+    }
+}
+
+/*
+    Queues the session of a job that has output or has finished, or discards
+    the job if its session has gone away.
+
+    @param
+    server_state: The server owning the job
+    job_index: The job's slot in the job table
+*/
+static void notify_job(server_data *server_state, int job_index)
+{
+    const job_info *job;
+
+    job = &server_state->jobs.jobs[job_index];
+    if(job->client >= 0)
+    {
+        if(job->readable || job_is_done(job))
+        {
+            event_ready_push(&server_state->events, (uint32_t)job->client);
+        }
+    }
+    else
+    {
+        discard_job(server_state, job_index);
+    }
+}
+
+/*
+    Discards the output of a job whose session has gone away and releases the
+    job once it has exited. Closing the pipe drops whatever is already buffered
+    in it, which with edge-triggered events would otherwise wait for an edge
+    that never comes. A child still writing gets SIGPIPE.
+
+    @param
+    server_state: The server owning the job
+    job_index: The job's slot in the job table
+*/
+static void discard_job(server_data *server_state, int job_index)
+{
+    job_info *job;
+
+    job = &server_state->jobs.jobs[job_index];
+    if(job->output_fd != -1)
+    {
+        close_job_output(server_state, job);
+    }
+
+    if(job_is_done(job))
+    {
+        release_job(server_state, job_index);
+    }
+}
+
+/*
+    Disarms a started job's timers and returns its slot to the job table.
+
+    @param
+    server_state: The server owning the job
+    job_index: The job's slot in the job table
+*/
+static void release_job(server_data *server_state, int job_index)
+{
+    job_info *job;
+
+    job = &server_state->jobs.jobs[job_index];
+    timer_cancel(&server_state->timers, &job->timer);
+    timer_cancel(&server_state->timers, &job->reap_timer);
+    job_release(&server_state->jobs, job_index);
+    metrics_sub(&server_state->metrics.children, 1);
+}
+
+/*
+    Handles every timer that has come due since the last pass.
+
+    @param
+    server_state: The server owning the timers
+*/
+static void run_timers(server_data *server_state)
+{
+    timer_entry *timer;
+
+    timer_wheel_advance(&server_state->timers);
+    while((timer = timer_wheel_pop(&server_state->timers)) != NULL)
+    {
+        if(timer->kind == TIMER_IDLE)
+        {
+            expire_session(server_state, timer->token);
+        }
+        else
+        {
+            expire_job(server_state, timer);
+        }
+    }
+}
+
+/*
+    Closes a connection that has sent nothing for the idle timeout. One waiting
+    on commands on any of its channels isn't idle and gets another period.
+
+    @param
+    server_state: The server owning the session
+    index: The session's slot in the client table
+*/
+static void expire_session(server_data *server_state, uint32_t index)
+{
+    client_info *client;
+
+    client = session_get(&server_state->sessions, index);
+    if(client == NULL)
+    {
+        return;
+    }
+
+    if(connection_busy(server_state, client))
+    {
+        reset_idle_timer(server_state, client);
+        return;
+    }
+
+    LOG_AT(LOG_LEVEL_INFO, "Client %d idle for %d seconds, closing\n", client->client_socket, server_state->idle_timeout);
+    metrics_add(&server_state->metrics.idle_closed, 1);
+    close_client(server_state, (int)index);
+}
+
+/*
+    Acts on a job timer: terminates a command at its deadline, kills one that
+    ignored the termination request, or polls for the exit of a child without
+    a pidfd.
+
+    @param
+    server_state: The server owning the job
+    timer: The timer that fired
+*/
+static void expire_job(server_data *server_state, timer_entry *timer)
+{
+    job_info *job;
+
+    job = &server_state->jobs.jobs[timer->token];
+    if(!job->in_use)
+    {
+        return;
+    }
+
+    if(timer->kind == TIMER_REAP)
+    {
+        if(job_reap(job, false))
+        {
+            notify_job(server_state, (int)timer->token);
+        }
+        else
+        {
+            timer_schedule(&server_state->timers, timer, REAP_POLL_MS);
+        }
+        return;
+    }
+
+    // Output still open means something the command started is still running
+    if(job_is_done(job))
+    {
+        return;
+    }
+
+    if(timer->kind == TIMER_DEADLINE)
+    {
+        LOG_AT(LOG_LEVEL_WARN, "Command %d exceeded its %d second deadline, terminating\n", (int)job->pid, server_state->command_timeout);
+        metrics_add(&server_state->metrics.timed_out, 1);
+        job_signal(job, SIGTERM);
+        timer->kind = TIMER_KILL;
+        timer_schedule(&server_state->timers, timer, COMMAND_KILL_GRACE_MS);
+        return;
+    }
+
+    job_signal(job, SIGKILL);
+}
+
+/*
+    Restarts a session's idle period.
+
+    @param
+    server_state: The server owning the session
+    client: The session
+*/
+static void reset_idle_timer(server_data *server_state, client_info *client)
+{
+    if(server_state->idle_timeout > 0)
+    {
+        timer_schedule(&server_state->timers, &client->idle_timer, (uint64_t)server_state->idle_timeout * 1000);
+    }
+}
+
+/*
+    Releases a session's finished job and prepares the STATUS frame carrying its
+    exit status. All of its output has already been relayed.
+
+    @param
+    server_state: The server owning the session
+    client_index: The session whose job finished
+    slot: The job's position in the session's job list
+
+    @return
+    SEND_OUTPUT: The final status is ready to be sent
+*/
+static p101_fsm_state_t finish_job(server_data *server_state, int client_index, int slot)
+{
+    client_info    *client;
+    const job_info *job;
+    int             job_index;
+
+    client    = session_get(&server_state->sessions, (uint32_t)client_index);
+    job_index = client->jobs[slot];
+    job       = &server_state->jobs.jobs[job_index];
+
+    if(WIFEXITED(job->status))
+    {
+        client->status = WEXITSTATUS(job->status);
+    }
+    else if(WIFSIGNALED(job->status))
+    {
+        client->status = 128 + WTERMSIG(job->status);
+    }
+    else
+    {
+        client->status = EXIT_FAILURE;
+    }
+
+    // Only a complete, successful run is worth repeating
+    if(job->capture != NULL && WIFEXITED(job->status) && client->status == EXIT_SUCCESS)
+    {
+        result_cache_store(&server_state->results, job->capture);
+    }
+
+    client->request_id = job->request_id;
+    release_job(server_state, job_index);
+    client->jobs[slot] = client->jobs[--client->job_count];
+
+    // Input that arrived while the job ran is still waiting in the socket
+    event_ready_push(&server_state->events, (uint32_t)client_index);
+
+    client->output_len          = 0;
+    client->io->output[0]       = '\0';
+    client->reply_complete      = true;
+    server_state->active_client = client_index;
+
+    return SEND_OUTPUT;
+}
+
+/*
+    Terminates and reaps every job that is still running. Each job is taken off
+    its session's list and its descriptors are forgotten, so closing the session
+    afterwards never signals a reaped pid or closes a reused descriptor.
+
+    @param
+    server_state: The server owning the jobs
+*/
+static void stop_jobs(server_data *server_state)
+{
+    int i;
+
+    for(i = 0; i < server_state->jobs.capacity; i++)
+    {
+        job_info *job;
+
+        job = &server_state->jobs.jobs[i];
+        if(!job->in_use)
+        {
+            continue;
+        }
+
+        if(!job->exited)
+        {
+            job_signal(job, SIGKILL);
+            job_reap(job, true);
+        }
+
+        if(job->output_fd != -1)
+        {
+            close(job->output_fd);
+            job->output_fd = -1;
+        }
+
+        if(job->pidfd != -1)
+        {
+            close(job->pidfd);
+            job->pidfd = -1;
+        }
+
+        if(job->client >= 0)
+        {
+            client_info *client;
+            int          slot;
+
+            client = session_get(&server_state->sessions, (uint32_t)job->client);
+            slot   = 0;
+            while(slot < client->job_count && client->jobs[slot] != i)
+            {
+                slot++;
+            }
+
+            if(slot < client->job_count)
+            {
+                client->jobs[slot] = client->jobs[--client->job_count];
+            }
+            job->client = -1;
+        }
+
+        release_job(server_state, i);
+    }
+}
+
+/*
+    Shuts down the specified socket for reading, writing, or both.
+
+    @param
+    sockfd: The socket file descriptor
+    how: Specifies how to shut down (e.g., SHUT_RD, SHUT_WR, SHUT_RDWR)
+*/
+static void shutdown_socket(int sockfd, int how)
+{
+    if(shutdown(sockfd, how) == -1)
+    {
+        perror("Error closing socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+    Closes the specified socket and exits on failure.
+
+    @param
+    sockfd: The socket file descriptor to close
+*/
+static void socket_close(int sockfd)
+{
+    if(close(sockfd) == -1)
+    {
+        perror("Error closing socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+    Counts an entry into a state of the request state machine.
+
+    @param
+    server_state: The reactor running the state machine
+    state: The state being entered
+*/
+static void count_state(server_data *server_state, p101_fsm_state_t state)
+{
+    metrics_add(&server_state->metrics.states[state - WAIT_FOR_CMD], 1);
+}
+
+/*
+    Parses a positive whole number given on the command line.
+
+    @param
+    text: The option's argument
+    max: The largest value accepted
+    value: Receives the number
+
+    @return
+    0 on success, -1 if the text isn't a number from 1 to max
+*/
+static int parse_limit(const char *text, long max, int *value)
+{
+    char *endptr;
+    long  parsed;
+
+    errno  = 0;
+    parsed = strtol(text, &endptr, BASE_TEN);
+    if(errno != 0 || endptr == text || *endptr != '\0' || parsed < 1 || parsed > max)
+    {
+        return -1;
+    }
+
+    *value = (int)parsed;
+    return 0;
 }
 
 // Sets up a signal handler so the program can terminate gracefully
@@ -1042,6 +3149,32 @@ void setup_signal_handler(void)
     #pragma clang diagnostic pop
 #endif
     sigaction(SIGINT, &sa, NULL);
+
+    // A client that disconnects mid-splice must surface as EPIPE, not kill the server
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+}
+
+/*
+    Installs or removes the SIGCHLD handler used in process-per-connection mode.
+
+    @param
+    enable: Install the handler, or restore the default disposition
+*/
+static void watch_session_exits(bool enable)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = enable ? sigchld_handler : SIG_DFL;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
 }
 
 #pragma GCC diagnostic push
@@ -1059,4 +3192,15 @@ void sigint_handler(int signum)
     printf("SIGINT received. Cleaning up...\n");
 }
 
+/*
+    Interrupts the process-per-connection parent's poll so it can reap a session.
+
+    @param
+    signum: Signal number to handle (unused)
+*/
+static void sigchld_handler(int signum)
+{
+}
+
 #pragma GCC diagnostic pop
+
@@ -0,0 +1,471 @@
+#include "session.h"
+
+static client_info *slot_at(const session_pool *pool, uint32_t index);
+static int          grow(session_pool *pool);
+static size_t       find_list_operator(const char *text, size_t *length);
+static bool         is_blank(const char *text, size_t length);
+static void         copy_command(char *dest, const char *text, size_t length);
+
+/*
+    Initialises an empty session pool. Slots are allocated on demand.
+
+    @param
+    pool: The pool to initialise
+*/
+void session_pool_create(session_pool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+}
+
+/*
+    Frees every slot and buffer set. Open sessions are not touched.
+
+    @param
+    pool: The pool to destroy
+*/
+void session_pool_destroy(session_pool *pool)
+{
+    uint32_t i;
+
+    for(i = 0; i < pool->capacity; i++)
+    {
+        free(slot_at(pool, i)->io);
+    }
+
+    for(i = 0; i < pool->chunk_count; i++)
+    {
+        free(pool->chunks[i]);
+    }
+
+    while(pool->spare_io != NULL)
+    {
+        session_io *io;
+
+        io             = pool->spare_io;
+        pool->spare_io = io->next_spare;
+        free(io);
+    }
+
+    free(pool->free_list);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/*
+    Takes a free session slot, adding a chunk of slots when all are in use.
+
+    @param
+    pool: The session pool
+    index: Receives the slot number
+
+    @return
+    The reset session, or NULL if the pool is full or out of memory
+*/
+client_info *session_acquire(session_pool *pool, uint32_t *index)
+{
+    client_info *client;
+
+    if(pool->free_count == 0 && grow(pool) == -1)
+    {
+        return NULL;
+    }
+
+    *index = pool->free_list[--pool->free_count];
+    client = slot_at(pool, *index);
+
+    memset(client, 0, sizeof(*client));
+    client->cwd_fd = -1;
+
+    return client;
+}
+
+/*
+    Returns a session slot, and its buffers, to the pool.
+
+    @param
+    pool: The session pool
+    index: The slot to free
+*/
+void session_release(session_pool *pool, uint32_t index)
+{
+    client_info *client;
+
+    client = slot_at(pool, index);
+    session_detach_io(pool, client);
+    client->client_socket               = 0;
+    pool->free_list[pool->free_count++] = index;
+}
+
+/*
+    Looks up a session slot.
+
+    @param
+    pool: The session pool
+    index: The slot number
+
+    @return
+    The slot, or NULL if it has never been allocated
+*/
+client_info *session_get(const session_pool *pool, uint32_t index)
+{
+    if(index >= pool->capacity)
+    {
+        return NULL;
+    }
+
+    return slot_at(pool, index);
+}
+
+/*
+    Gives a session its I/O buffers, reusing a spare set when one is available.
+    The buffers' strings start out empty.
+
+    @param
+    pool: The session pool
+    client: The session that is about to receive or send
+
+    @return
+    The session's buffers, or NULL if out of memory
+*/
+session_io *session_attach_io(session_pool *pool, client_info *client)
+{
+    session_io *io;
+
+    if(client->io != NULL)
+    {
+        return client->io;
+    }
+
+    io = pool->spare_io;
+    if(io != NULL)
+    {
+        pool->spare_io = io->next_spare;
+        pool->spare_count--;
+    }
+    else
+    {
+        io = (session_io *)malloc(sizeof(session_io));
+        if(io == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    io->cmd[0]      = '\0';
+    io->args[0]     = '\0';
+    io->cmd_path[0] = '\0';
+    io->msg[0]      = '\0';
+    io->output[0]   = '\0';
+    io->sequence[0] = '\0';
+    io->next_spare  = NULL;
+    client->io      = io;
+
+    return io;
+}
+
+/*
+    Takes an idle session's I/O buffers away. A bounded number of sets is kept
+    for the next busy session, the rest go back to the allocator.
+
+    @param
+    pool: The session pool
+    client: The session, which must not have buffered input or running jobs
+*/
+void session_detach_io(session_pool *pool, client_info *client)
+{
+    if(client->io == NULL)
+    {
+        return;
+    }
+
+    if(pool->spare_count < SESSION_SPARE_IO)
+    {
+        client->io->next_spare = pool->spare_io;
+        pool->spare_io         = client->io;
+        pool->spare_count++;
+    }
+    else
+    {
+        free(client->io);
+    }
+
+    client->io         = NULL;
+    client->input_len  = 0;
+    client->output_len = 0;
+}
+
+/*
+    Splits the message a session received into the command and its arguments.
+
+    @param
+    io: The session's buffers, msg holds the message
+*/
+void session_parse_command(session_io *io)
+{
+    int i;
+    int j;
+    int k;
+
+    i = 0;    // for original message
+    j = 0;    // for command buffer
+    k = 0;    // for argument buffer
+
+    // Extract the command
+    while(io->msg[i] != ' ' && io->msg[i] != '\0' && j < MAX_CMD_LENGTH - 1)
+    {
+        io->cmd[j++] = io->msg[i++];
+    }
+    io->cmd[j] = '\0';
+
+    // Move past space(s) to get to the arguments
+    while(io->msg[i] == ' ')
+    {
+        i++;
+    }
+
+    // Extract any arguments
+    if(io->msg[i] != '\0')
+    {
+        while(io->msg[i] != '\0' && k < MAX_ARGS_LENGTH - 1)
+        {
+            io->args[k++] = io->msg[i++];
+        }
+        io->args[k] = '\0';
+    }
+    else
+    {
+        io->args[0] = '\0';
+    }
+}
+
+/*
+    Cuts a command list joined by ;, && or || after its first command. The commands
+    after it are kept, with the operator in front of them, for session_next_command.
+    A message without operators is left as it is.
+
+    @param
+    io: The session's buffers, msg holds the message and sequence is empty
+
+    @return
+    0 on success, -1 if an operator is missing the command before or after it
+*/
+int session_split_list(session_io *io)
+{
+    const char *cursor;
+    size_t      offset;
+    size_t      length;
+    bool        trailing_allowed;
+
+    offset = find_list_operator(io->msg, &length);
+    if(length == 0)
+    {
+        return 0;
+    }
+
+    // Every command of the list must be there, only a final ; may end it
+    cursor           = io->msg;
+    trailing_allowed = false;
+    for(;;)
+    {
+        size_t command_length;
+        size_t operator_length;
+
+        command_length = find_list_operator(cursor, &operator_length);
+        if(is_blank(cursor, command_length) && (operator_length != 0 || !trailing_allowed))
+        {
+            return -1;
+        }
+
+        if(operator_length == 0)
+        {
+            break;
+        }
+
+        trailing_allowed = cursor[command_length] == ';';
+        cursor += command_length + operator_length;
+    }
+
+    snprintf(io->sequence, sizeof(io->sequence), "%s", io->msg + offset);
+    copy_command(io->msg, io->msg, offset);
+
+    return 0;
+}
+
+/*
+    Moves the next command of a list that should run into the session's message.
+    After ; the next command always runs, after && only if the last command
+    succeeded and after || only if it failed. A command that is skipped leaves
+    the status as it was for the operator after it, as in a shell.
+
+    @param
+    io: The session's buffers, sequence holds the rest of the list
+    status: Exit status of the command that last ran
+
+    @return
+    true if msg holds the next command, false once the list is finished
+*/
+bool session_next_command(session_io *io, int status)
+{
+    const char *cursor;
+    size_t      offset;
+    size_t      length;
+
+    cursor = io->sequence;
+    offset = find_list_operator(cursor, &length);
+    while(length != 0)
+    {
+        bool   run;
+        size_t command_length;
+        size_t next_length;
+
+        run            = cursor[offset] == ';' || (cursor[offset] == '&' && status == 0) || (cursor[offset] == '|' && status != 0);
+        cursor        += offset + length;
+        command_length = find_list_operator(cursor, &next_length);
+
+        if(run && !is_blank(cursor, command_length))
+        {
+            copy_command(io->msg, cursor, command_length);
+            memmove(io->sequence, cursor + command_length, strlen(cursor + command_length) + 1);
+            return true;
+        }
+
+        offset = command_length;
+        length = next_length;
+    }
+
+    io->sequence[0] = '\0';
+    return false;
+}
+
+/*
+    Finds the first ;, && or || in a command line. A single | is a pipe and
+    doesn't end a command.
+
+    @param
+    text: The command line
+    length: Receives the operator's length, 0 if there is none
+
+    @return
+    The operator's offset, or the length of text if there is none
+*/
+static size_t find_list_operator(const char *text, size_t *length)
+{
+    size_t i;
+
+    for(i = 0; text[i] != '\0'; i++)
+    {
+        if(text[i] == ';')
+        {
+            *length = 1;
+            return i;
+        }
+
+        if((text[i] == '&' || text[i] == '|') && text[i + 1] == text[i])
+        {
+            *length = 2;
+            return i;
+        }
+    }
+
+    *length = 0;
+    return i;
+}
+
+/*
+    Checks whether part of a command line holds nothing but spaces.
+
+    @param
+    text: The start of the part
+    length: Its length
+
+    @return
+    true if there is no command in it
+*/
+static bool is_blank(const char *text, size_t length)
+{
+    return strspn(text, " \t") >= length;
+}
+
+/*
+    Copies one command of a list into a message buffer without the spaces around
+    it, which session_parse_command would take as part of the command or its
+    arguments. The source may be the buffer itself.
+
+    @param
+    dest: A buffer of MAX_MSG_LENGTH bytes
+    text: The start of the command
+    length: The length of the command, spaces included
+*/
+static void copy_command(char *dest, const char *text, size_t length)
+{
+    size_t start;
+
+    start = strspn(text, " \t");
+    while(length > start && (text[length - 1] == ' ' || text[length - 1] == '\t'))
+    {
+        length--;
+    }
+
+    length = length - start < MAX_MSG_LENGTH - 1 ? length - start : MAX_MSG_LENGTH - 1;
+    memmove(dest, text + start, length);
+    dest[length] = '\0';
+}
+
+/*
+    Finds a slot in its chunk.
+
+    @param
+    pool: The session pool
+    index: A slot number below pool->capacity
+
+    @return
+    The slot
+*/
+static client_info *slot_at(const session_pool *pool, uint32_t index)
+{
+    return &pool->chunks[index >> SESSION_CHUNK_SHIFT][index & (SESSION_CHUNK_SIZE - 1)];
+}
+
+/*
+    Adds a chunk of session slots to the pool.
+
+    @param
+    pool: The session pool
+
+    @return
+    0 on success, -1 if the pool is full or out of memory
+*/
+static int grow(session_pool *pool)
+{
+    client_info *chunk;
+    uint32_t    *free_list;
+    uint32_t     i;
+
+    if(pool->chunk_count == SESSION_MAX_CHUNKS)
+    {
+        return -1;
+    }
+
+    chunk     = (client_info *)calloc(SESSION_CHUNK_SIZE, sizeof(client_info));
+    free_list = (uint32_t *)realloc(pool->free_list, (pool->capacity + SESSION_CHUNK_SIZE) * sizeof(uint32_t));
+    if(free_list != NULL)
+    {
+        pool->free_list = free_list;
+    }
+
+    if(chunk == NULL || free_list == NULL)
+    {
+        free(chunk);
+        return -1;
+    }
+
+    pool->chunks[pool->chunk_count++] = chunk;
+
+    // Hand out low slots first
+    for(i = 0; i < SESSION_CHUNK_SIZE; i++)
+    {
+        pool->free_list[pool->free_count++] = pool->capacity + SESSION_CHUNK_SIZE - 1 - i;
+    }
+    pool->capacity += SESSION_CHUNK_SIZE;
+
+    return 0;
+}
@@ -3,6 +3,10 @@
 static _Noreturn void usage(const char *program_name, int exit_code, const char *message);
 static in_port_t      parse_in_port_t(const char *binary_name, const char *str);
 
+// Options accepted by the running program, listed by usage()
+static const program_option *program_options;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t                program_option_count;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
 /*
     Displays the usage message and exits the program.
 
@@ -13,14 +17,32 @@ static in_port_t      parse_in_port_t(const char *binary_name, const char *str);
 */
 static _Noreturn void usage(const char *program_name, int exit_code, const char *message)
 {
+    size_t i;
+
     if(message)
     {
         fprintf(stderr, "%s\n", message);
     }
 
-    fprintf(stderr, "Usage: %s [-h] <ip address> <port>\n", program_name);
+    fprintf(stderr, "Usage: %s [-h]", program_name);
+    for(i = 0; i < program_option_count; i++)
+    {
+        if(program_options[i].argument)
+        {
+            fprintf(stderr, " [-%c <%s>]", program_options[i].flag, program_options[i].argument);
+        }
+        else
+        {
+            fprintf(stderr, " [-%c]", program_options[i].flag);
+        }
+    }
+    fputs(" <ip address> <port>\n", stderr);
     fputs("Options:\n", stderr);
     fputs("  -h  Display this help message\n", stderr);
+    for(i = 0; i < program_option_count; i++)
+    {
+        fprintf(stderr, "  -%c  %s\n", program_options[i].flag, program_options[i].help);
+    }
     exit(exit_code);
 }
 
@@ -30,16 +52,38 @@ static _Noreturn void usage(const char *program_name, int exit_code, const char
     @param
     argc: Number of command-line arguments
     argv: Array of command-line argument strings
+    options: Options the program accepts besides -h, may be NULL
+    option_count: Number of entries in options
     ip_address: Output parameter for the IP address
     port: Output parameter for the port
 */
-void parse_arguments(int argc, char *argv[], char **ip_address, char **port)
+void parse_arguments(int argc, char *argv[], const program_option *options, size_t option_count, char **ip_address, char **port)
 {
-    int opt;
+    char   optstring[(MAX_OPTIONS * 2) + 3];
+    size_t length;
+    size_t i;
+    int    opt;
+
+    program_options      = options;
+    program_option_count = option_count < MAX_OPTIONS ? option_count : MAX_OPTIONS;
+
+    // Leading ':' reports a missing value separately from an unknown option
+    length              = 0;
+    optstring[length++] = ':';
+    optstring[length++] = 'h';
+    for(i = 0; i < program_option_count; i++)
+    {
+        optstring[length++] = options[i].flag;
+        if(options[i].argument)
+        {
+            optstring[length++] = ':';
+        }
+    }
+    optstring[length] = '\0';
 
     opterr = 0;
 
-    while((opt = getopt(argc, argv, "h")) != -1)
+    while((opt = getopt(argc, argv, optstring)) != -1)
     {
         switch(opt)
         {
@@ -47,6 +91,13 @@ void parse_arguments(int argc, char *argv[], char **ip_address, char **port)
             {
                 usage(argv[0], EXIT_SUCCESS, NULL);
             }
+            case ':':
+            {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                snprintf(message, sizeof(message), "Option '-%c' needs a value.", optopt);
+                usage(argv[0], EXIT_FAILURE, message);
+            }
             case '?':
             {
                 char message[UNKNOWN_OPTION_MESSAGE_LEN];
@@ -56,7 +107,31 @@ void parse_arguments(int argc, char *argv[], char **ip_address, char **port)
             }
             default:
             {
-                usage(argv[0], EXIT_FAILURE, NULL);
+                const program_option *option;
+
+                option = NULL;
+                for(i = 0; i < program_option_count; i++)
+                {
+                    if(options[i].flag == opt)
+                    {
+                        option = &options[i];
+                        break;
+                    }
+                }
+
+                if(option == NULL)
+                {
+                    usage(argv[0], EXIT_FAILURE, NULL);
+                }
+
+                if(option->value)
+                {
+                    *option->value = optarg;
+                }
+                if(option->enabled)
+                {
+                    *option->enabled = true;
+                }
             }
         }
     }
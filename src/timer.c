@@ -0,0 +1,402 @@
+#include "timer.h"
+
+#define MILLIS_PER_SEC 1000
+#define NANOS_PER_MILLI 1000000
+
+static uint64_t monotonic_ms(void);
+static void     list_init(timer_entry *head);
+static void     list_append(timer_entry *head, timer_entry *timer);
+static void     list_remove(timer_entry *timer);
+static void     place(timer_wheel *wheel, timer_entry *timer);
+static void     cascade(timer_wheel *wheel, int level, uint32_t slot);
+static uint64_t next_event(const timer_wheel *wheel);
+static uint32_t slot_distance(uint64_t occupied, uint32_t current);
+
+/*
+    Sets up an empty timer wheel starting at the current time.
+
+    @param
+    wheel: The wheel to initialise
+*/
+void timer_wheel_create(timer_wheel *wheel)
+{
+    int      level;
+    uint32_t slot;
+
+    memset(wheel, 0, sizeof(*wheel));
+    for(level = 0; level < TIMER_LEVELS; level++)
+    {
+        for(slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+
+    list_init(&wheel->expired);
+    wheel->origin_ms = monotonic_ms();
+}
+
+/*
+    Prepares a timer that isn't pending.
+
+    @param
+    timer: The timer
+    kind: What the owner does when it fires
+    token: Which object it belongs to
+*/
+void timer_init(timer_entry *timer, uint32_t kind, uint32_t token)
+{
+    timer->next  = NULL;
+    timer->prev  = NULL;
+    timer->kind  = kind;
+    timer->token = token;
+}
+
+/*
+    Arms a timer, replacing its previous expiry if it was already pending. The
+    timer fires on the first tick at or after the delay, never before.
+
+    @param
+    wheel: The wheel
+    timer: The timer
+    delay_ms: Milliseconds from now
+*/
+void timer_schedule(timer_wheel *wheel, timer_entry *timer, uint64_t delay_ms)
+{
+    uint64_t expires;
+
+    timer_cancel(wheel, timer);
+
+    expires = (monotonic_ms() - wheel->origin_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if(expires <= wheel->now)
+    {
+        expires = wheel->now + 1;
+    }
+    if(expires - wheel->now > TIMER_MAX_TICKS)
+    {
+        expires = wheel->now + TIMER_MAX_TICKS;
+    }
+
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+/*
+    Disarms a timer. Cancelling a timer that isn't pending does nothing.
+
+    @param
+    wheel: The wheel
+    timer: The timer
+*/
+void timer_cancel(timer_wheel *wheel, timer_entry *timer)
+{
+    if(timer->next == NULL)
+    {
+        return;
+    }
+
+    list_remove(timer);
+
+    // Level TIMER_LEVELS is the expired list, which has no bit to clear
+    if(timer->level < TIMER_LEVELS && wheel->slots[timer->level][timer->slot].next == &wheel->slots[timer->level][timer->slot])
+    {
+        wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+}
+
+/*
+    Checks whether a timer is armed.
+
+    @param
+    timer: The timer
+
+    @return
+    true if the timer is waiting to fire or has fired without being popped
+*/
+bool timer_pending(const timer_entry *timer)
+{
+    return timer->next != NULL;
+}
+
+/*
+    Processes every tick up to the current time, moving timers that are due
+    to the expired list. Ticks without anything to do are skipped, so catching
+    up after a long wait costs the same as one tick.
+
+    @param
+    wheel: The wheel
+*/
+void timer_wheel_advance(timer_wheel *wheel)
+{
+    uint64_t target;
+
+    target = (monotonic_ms() - wheel->origin_ms) / TIMER_TICK_MS;
+    while(wheel->now < target)
+    {
+        uint64_t next;
+        int      level;
+
+        next = next_event(wheel);
+        if(next > target)
+        {
+            wheel->now = target;
+            break;
+        }
+
+        // Coarser slots whose span starts now move down before the finest slot fires
+        wheel->now = next;
+        for(level = TIMER_LEVELS - 1; level >= 0; level--)
+        {
+            uint32_t shift;
+
+            shift = (uint32_t)(TIMER_LEVEL_BITS * level);
+            if((next & ((1ULL << shift) - 1)) == 0)
+            {
+                cascade(wheel, level, (uint32_t)((next >> shift) & (TIMER_SLOTS - 1)));
+            }
+        }
+    }
+}
+
+/*
+    Takes the next timer that has fired. The timer is no longer pending and may
+    be scheduled again.
+
+    @param
+    wheel: The wheel
+
+    @return
+    The timer, or NULL once every fired timer has been taken
+*/
+timer_entry *timer_wheel_pop(timer_wheel *wheel)
+{
+    timer_entry *timer;
+
+    if(wheel->expired.next == &wheel->expired)
+    {
+        return NULL;
+    }
+
+    timer = wheel->expired.next;
+    list_remove(timer);
+
+    return timer;
+}
+
+/*
+    Works out how long the event loop may sleep before the wheel needs attention.
+
+    @param
+    wheel: The wheel
+    max_ms: The longest wait wanted by the caller
+
+    @return
+    Milliseconds until the next timer or cascade is due, at most max_ms
+*/
+int timer_wheel_timeout(const timer_wheel *wheel, int max_ms)
+{
+    uint64_t next;
+    uint64_t due_ms;
+    uint64_t now_ms;
+
+    if(wheel->expired.next != &wheel->expired)
+    {
+        return 0;
+    }
+
+    next = next_event(wheel);
+    if(next == UINT64_MAX)
+    {
+        return max_ms;
+    }
+
+    due_ms = wheel->origin_ms + (next * TIMER_TICK_MS);
+    now_ms = monotonic_ms();
+    if(due_ms <= now_ms)
+    {
+        return 0;
+    }
+
+    return due_ms - now_ms < (uint64_t)max_ms ? (int)(due_ms - now_ms) : max_ms;
+}
+
+/*
+    Reads a clock that wall-clock changes don't move.
+
+    @return
+    Milliseconds on CLOCK_MONOTONIC
+*/
+static uint64_t monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * MILLIS_PER_SEC) + ((uint64_t)now.tv_nsec / NANOS_PER_MILLI);
+}
+
+/*
+    Makes a list head point at itself.
+
+    @param
+    head: The list head
+*/
+static void list_init(timer_entry *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+/*
+    Adds a timer to the end of a list.
+
+    @param
+    head: The list head
+    timer: The timer
+*/
+static void list_append(timer_entry *head, timer_entry *timer)
+{
+    timer->prev      = head->prev;
+    timer->next      = head;
+    head->prev->next = timer;
+    head->prev       = timer;
+}
+
+/*
+    Unlinks a timer from its list and marks it as not pending.
+
+    @param
+    timer: The timer
+*/
+static void list_remove(timer_entry *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next       = NULL;
+    timer->prev       = NULL;
+}
+
+/*
+    Puts a timer in the slot it fires or cascades from. The level is the first
+    one whose span covers the time left, the slot comes from the expiry tick's
+    bits at that level.
+
+    @param
+    wheel: The wheel
+    timer: The timer, with its expiry tick set
+*/
+static void place(timer_wheel *wheel, timer_entry *timer)
+{
+    uint64_t delta;
+    int      level;
+
+    if(timer->expires <= wheel->now)
+    {
+        timer->level = TIMER_LEVELS;
+        list_append(&wheel->expired, timer);
+        return;
+    }
+
+    delta = timer->expires - wheel->now;
+    level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    timer->level = (uint8_t)level;
+    timer->slot  = (uint8_t)((timer->expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1));
+    list_append(&wheel->slots[level][timer->slot], timer);
+    wheel->occupied[level] |= 1ULL << timer->slot;
+}
+
+/*
+    Empties a slot, placing each of its timers again relative to the current
+    tick. Timers of the finest level are due and go to the expired list.
+
+    @param
+    wheel: The wheel
+    level: The slot's level
+    slot: The slot
+*/
+static void cascade(timer_wheel *wheel, int level, uint32_t slot)
+{
+    timer_entry *head;
+
+    if(!(wheel->occupied[level] & (1ULL << slot)))
+    {
+        return;
+    }
+
+    wheel->occupied[level] &= ~(1ULL << slot);
+    head = &wheel->slots[level][slot];
+    while(head->next != head)
+    {
+        timer_entry *timer;
+
+        timer = head->next;
+        list_remove(timer);
+        place(wheel, timer);
+    }
+}
+
+/*
+    Finds the first tick after the current one at which a slot fires or cascades.
+
+    @param
+    wheel: The wheel
+
+    @return
+    The tick, or UINT64_MAX if no timer is pending in the wheel
+*/
+static uint64_t next_event(const timer_wheel *wheel)
+{
+    uint64_t next;
+    int      level;
+
+    next = UINT64_MAX;
+    for(level = 0; level < TIMER_LEVELS; level++)
+    {
+        uint32_t shift;
+        uint64_t block;
+        uint64_t candidate;
+
+        if(wheel->occupied[level] == 0)
+        {
+            continue;
+        }
+
+        shift     = (uint32_t)(TIMER_LEVEL_BITS * level);
+        block     = wheel->now >> shift;
+        candidate = (block + slot_distance(wheel->occupied[level], (uint32_t)(block & (TIMER_SLOTS - 1)))) << shift;
+        if(candidate < next)
+        {
+            next = candidate;
+        }
+    }
+
+    return next;
+}
+
+/*
+    Counts the slots from the current one to the next occupied one, wrapping
+    around the level.
+
+    @param
+    occupied: Bit per occupied slot, at least one set
+    current: The slot the level is at
+
+    @return
+    1 to TIMER_SLOTS
+*/
+static uint32_t slot_distance(uint64_t occupied, uint32_t current)
+{
+    uint64_t later;
+
+    later = current == TIMER_SLOTS - 1 ? 0 : occupied & (~0ULL << (current + 1));
+    if(later != 0)
+    {
+        return (uint32_t)__builtin_ctzll(later) - current;
+    }
+
+    return (uint32_t)__builtin_ctzll(occupied) + TIMER_SLOTS - current;
+}